@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+#include "admin.h"
+#include "utility.h"
+#include "channel.h"
+#include "rate_limit.h"
+#include "staging.h"
+#include "zerocopy.h"
+#include "phase_trace.h"
+#include "overload.h"
+#include "busy_poll.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/**
+ * Local control socket to look at and change the tunables of a running server. One command per
+ * line, answered with "name=value" lines and a final "ok" or "error: <reason>":
+ *   get [<name>...]                 current values, all of them when no name is given
+ *   set <name>=<value> [...]        every assignment is checked before any is applied, so a
+ *                                   command takes effect as a whole or not at all
+ *   dump-phases                     same as the phase trace signal
+ */
+
+int listen_backlog = LISTEN_BACKLOG_DEFAULT;
+
+struct admin_tunable {
+    const char* name;
+    /* checks value, and puts it in effect when apply is set */
+    int (*set)(const char* value, bool apply);
+    void (*get)(char* buf, size_t size);
+};
+
+static const char* log_level_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+static int log_level = LOG_DEBUG;
+
+static char* admin_path = NULL;
+static int admin_fd = -1;
+static int client_listen_fd = -1;
+static pthread_t admin_thread;
+/* applies commands one at a time, and keeps get from seeing half of a set */
+static pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int parse_size(const char* value, size_t min, size_t max, size_t* out) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || errno || value[0] == '-' || parsed < min || parsed > max) {
+        return EINVAL;
+    }
+    *out = parsed;
+    return 0;
+}
+
+static int set_read_chunk_size(const char* value, bool apply) {
+    size_t size;
+    if (parse_size(value, 64, 1024 * 1024, &size)) {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&read_chunk_size, size, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_read_chunk_size(char* buf, size_t size) {
+    snprintf(buf, size, "%zu", __atomic_load_n(&read_chunk_size, __ATOMIC_RELAXED));
+}
+
+static int set_dump_buffer_size(const char* value, bool apply) {
+    size_t size;
+    if (parse_size(value, 64, DUMP_BUFFER_MAX, &size)) {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&dump_buffer_size, size, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_dump_buffer_size(char* buf, size_t size) {
+    snprintf(buf, size, "%zu", __atomic_load_n(&dump_buffer_size, __ATOMIC_RELAXED));
+}
+
+static int set_listen_backlog(const char* value, bool apply) {
+    size_t backlog;
+    if (parse_size(value, 1, LISTEN_BACKLOG_MAX, &backlog)) {
+        return EINVAL;
+    }
+    /* listen() again on a listening socket only updates its backlog */
+    if (apply && listen(client_listen_fd, backlog) < 0) {
+        return errno;
+    }
+    if (apply) {
+        listen_backlog = backlog;
+    }
+    return 0;
+}
+
+static void get_listen_backlog(char* buf, size_t size) {
+    snprintf(buf, size, "%d", listen_backlog);
+}
+
+static int set_durability(const char* value, bool apply) {
+    bool durable;
+    if (strcmp(value, "fsync") == 0) {
+        durable = true;
+    }
+    else if (strcmp(value, "none") == 0) {
+        durable = false;
+    }
+    else {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&durable_appends, durable, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_durability(char* buf, size_t size) {
+    snprintf(buf, size, "%s", __atomic_load_n(&durable_appends, __ATOMIC_RELAXED) ? "fsync" : "none");
+}
+
+static int set_client_rate(const char* value, bool apply) {
+    struct rate_limits limits;
+    if (parse_rate_limits(value, &limits)) {
+        return EINVAL;
+    }
+    if (apply) {
+        rate_limit_set_clients(&limits);
+    }
+    return 0;
+}
+
+static void get_client_rate(char* buf, size_t size) {
+    snprintf(buf, size, "%lu,%lu", client_rate_limits.packets_per_sec, client_rate_limits.bytes_per_sec);
+}
+
+static void apply_channel_rate(struct channel* channel, void* args) {
+    rate_limiter_set(&channel->limiter, args);
+}
+
+static int set_channel_rate(const char* value, bool apply) {
+    struct rate_limits limits;
+    if (parse_rate_limits(value, &limits)) {
+        return EINVAL;
+    }
+    if (apply) {
+        channel_rate_limits = limits;
+        channel_for_each(apply_channel_rate, &limits);
+    }
+    return 0;
+}
+
+static void get_channel_rate(char* buf, size_t size) {
+    snprintf(buf, size, "%lu,%lu", channel_rate_limits.packets_per_sec, channel_rate_limits.bytes_per_sec);
+}
+
+static int set_log_level(const char* value, bool apply) {
+    for (int level = LOG_EMERG; level <= LOG_DEBUG; level++) {
+        if (strcmp(value, log_level_names[level]) == 0) {
+            if (apply) {
+                log_level = level;
+                setlogmask(LOG_UPTO(level));
+            }
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+static void get_log_level(char* buf, size_t size) {
+    snprintf(buf, size, "%s", log_level_names[log_level]);
+}
+
+static int set_memory_cap(const char* value, bool apply) {
+    size_t cap;
+    if (parse_size(value, 0, SIZE_MAX, &cap)) {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&ingest_memory_cap, cap, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_memory_cap(char* buf, size_t size) {
+    snprintf(buf, size, "%zu", __atomic_load_n(&ingest_memory_cap, __ATOMIC_RELAXED));
+}
+
+static int set_ingest_splice(const char* value, bool apply) {
+    bool enabled;
+    if (strcmp(value, "splice") == 0) {
+        enabled = true;
+    }
+    else if (strcmp(value, "read") == 0) {
+        enabled = false;
+    }
+    else {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&ingest_splice, enabled, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_ingest_splice(char* buf, size_t size) {
+    snprintf(buf, size, "%s", __atomic_load_n(&ingest_splice, __ATOMIC_RELAXED) ? "splice" : "read");
+}
+
+/* connections accepted before it was turned on don't get SO_BUSY_POLL, their reads spin all the same */
+static int set_busy_poll(const char* value, bool apply) {
+    size_t spin_us;
+    if (parse_size(value, 0, 1000000, &spin_us)) {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&busy_poll_us, (unsigned int)spin_us, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_busy_poll(char* buf, size_t size) {
+    snprintf(buf, size, "%u", __atomic_load_n(&busy_poll_us, __ATOMIC_RELAXED));
+}
+
+/* packets already published to a combiner are still appended by it */
+static int set_combine_appends(const char* value, bool apply) {
+    bool enabled;
+    if (strcmp(value, "on") == 0) {
+        enabled = true;
+    }
+    else if (strcmp(value, "off") == 0) {
+        enabled = false;
+    }
+    else {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&combine_appends, enabled, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_combine_appends(char* buf, size_t size) {
+    snprintf(buf, size, "%s", __atomic_load_n(&combine_appends, __ATOMIC_RELAXED) ? "on" : "off");
+}
+
+static int set_overload(const char* value, bool apply) {
+    struct overload_config config;
+    if (overload_parse(value, &config)) {
+        return EINVAL;
+    }
+    if (apply) {
+        overload_set(&config);
+    }
+    return 0;
+}
+
+static void get_overload(char* buf, size_t size) {
+    snprintf(buf, size, "%llu,%llu", (unsigned long long)overload_config.target_ms, (unsigned long long)overload_config.interval_ms);
+}
+
+/* connections pick the threshold up when they're accepted */
+static int set_zerocopy_threshold(const char* value, bool apply) {
+    size_t threshold;
+    if (parse_size(value, 0, SIZE_MAX, &threshold)) {
+        return EINVAL;
+    }
+    if (apply) {
+        __atomic_store_n(&zerocopy_threshold, threshold, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void get_zerocopy_threshold(char* buf, size_t size) {
+    snprintf(buf, size, "%zu", __atomic_load_n(&zerocopy_threshold, __ATOMIC_RELAXED));
+}
+
+static int set_trace_sampling(const char* value, bool apply) {
+    size_t every;
+    if (parse_size(value, 0, UINT32_MAX, &every)) {
+        return EINVAL;
+    }
+    if (!apply) {
+        return 0;
+    }
+    unsigned int previous = __atomic_exchange_n(&phase_trace_sample_every, every, __ATOMIC_RELAXED);
+    /* the dump signal is only set up once something is traced */
+    if (every && phase_trace_start()) {
+        __atomic_store_n(&phase_trace_sample_every, previous, __ATOMIC_RELAXED);
+        return EIO;
+    }
+    return 0;
+}
+
+static void get_trace_sampling(char* buf, size_t size) {
+    snprintf(buf, size, "%u", __atomic_load_n(&phase_trace_sample_every, __ATOMIC_RELAXED));
+}
+
+static const struct admin_tunable tunables[] = {
+    { "read_chunk_size", set_read_chunk_size, get_read_chunk_size },
+    { "dump_buffer_size", set_dump_buffer_size, get_dump_buffer_size },
+    { "listen_backlog", set_listen_backlog, get_listen_backlog },
+    { "durability", set_durability, get_durability },
+    { "client_rate", set_client_rate, get_client_rate },
+    { "channel_rate", set_channel_rate, get_channel_rate },
+    { "log_level", set_log_level, get_log_level },
+    { "memory_cap", set_memory_cap, get_memory_cap },
+    { "ingest", set_ingest_splice, get_ingest_splice },
+    { "overload", set_overload, get_overload },
+    { "combine", set_combine_appends, get_combine_appends },
+    { "busy_poll", set_busy_poll, get_busy_poll },
+    { "zerocopy_threshold", set_zerocopy_threshold, get_zerocopy_threshold },
+    { "trace_sampling", set_trace_sampling, get_trace_sampling },
+};
+#define TUNABLE_COUNT (sizeof(tunables) / sizeof(tunables[0]))
+
+static const struct admin_tunable* find_tunable(const char* name) {
+    for (size_t i = 0; i < TUNABLE_COUNT; i++) {
+        if (strcmp(tunables[i].name, name) == 0) {
+            return &tunables[i];
+        }
+    }
+    return NULL;
+}
+
+static void reply(int fd, const char* line) {
+    size_t length = strlen(line);
+    while (length) {
+        ssize_t sent = send(fd, line, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return;
+        }
+        line += sent;
+        length -= sent;
+    }
+}
+
+static void reply_value(int fd, const struct admin_tunable* tunable) {
+    char value[64];
+    char line[128];
+    tunable->get(value, sizeof(value));
+    snprintf(line, sizeof(line), "%s=%s\n", tunable->name, value);
+    reply(fd, line);
+}
+
+static void command_get(int fd, char* args) {
+    char* saveptr = NULL;
+    char* name = strtok_r(args, " ", &saveptr);
+    if (name == NULL) {
+        for (size_t i = 0; i < TUNABLE_COUNT; i++) {
+            reply_value(fd, &tunables[i]);
+        }
+        reply(fd, "ok\n");
+        return;
+    }
+    for (; name != NULL; name = strtok_r(NULL, " ", &saveptr)) {
+        const struct admin_tunable* tunable = find_tunable(name);
+        if (tunable == NULL) {
+            char line[ADMIN_LINE_MAX + 32];
+            snprintf(line, sizeof(line), "error: no tunable %s\n", name);
+            reply(fd, line);
+            return;
+        }
+        reply_value(fd, tunable);
+    }
+    reply(fd, "ok\n");
+}
+
+static void command_set(int fd, char* args) {
+    const struct admin_tunable* targets[TUNABLE_COUNT];
+    char* values[TUNABLE_COUNT];
+    size_t count = 0;
+    char line[ADMIN_LINE_MAX + 64];
+    char* saveptr = NULL;
+    for (char* assignment = strtok_r(args, " ", &saveptr); assignment != NULL; assignment = strtok_r(NULL, " ", &saveptr)) {
+        char* value = strchr(assignment, '=');
+        if (value == NULL) {
+            snprintf(line, sizeof(line), "error: %s is not <name>=<value>\n", assignment);
+            reply(fd, line);
+            return;
+        }
+        *value++ = '\0';
+        const struct admin_tunable* tunable = find_tunable(assignment);
+        if (tunable == NULL) {
+            snprintf(line, sizeof(line), "error: no tunable %s\n", assignment);
+            reply(fd, line);
+            return;
+        }
+        if (tunable->set(value, false)) {
+            snprintf(line, sizeof(line), "error: invalid value %s for %s\n", value, assignment);
+            reply(fd, line);
+            return;
+        }
+        if (count == TUNABLE_COUNT) {
+            reply(fd, "error: too many assignments\n");
+            return;
+        }
+        targets[count] = tunable;
+        values[count] = value;
+        count++;
+    }
+    if (count == 0) {
+        reply(fd, "error: nothing to set\n");
+        return;
+    }
+    /* everything checked, now it can only fail on the system calls some of them make, then the
+       changes already applied are put back so a set takes effect entirely or not at all */
+    char previous[TUNABLE_COUNT][64];
+    for (size_t i = 0; i < count; i++) {
+        targets[i]->get(previous[i], sizeof(previous[i]));
+    }
+    for (size_t i = 0; i < count; i++) {
+        int ret_val = targets[i]->set(values[i], true);
+        if (ret_val) {
+            for (size_t j = i; j > 0; j--) {
+                if (targets[j - 1]->set(previous[j - 1], true)) {
+                    syslog(LOG_ERR, "Admin could not restore %s to %s", targets[j - 1]->name, previous[j - 1]);
+                }
+            }
+            snprintf(line, sizeof(line), "error: applying %s failed, %s, nothing changed\n", targets[i]->name, strerror(ret_val));
+            reply(fd, line);
+            return;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        char value[64];
+        targets[i]->get(value, sizeof(value));
+        syslog(LOG_NOTICE, "Admin set %s to %s", targets[i]->name, value);
+        reply_value(fd, targets[i]);
+    }
+    reply(fd, "ok\n");
+}
+
+static void handle_command(int fd, char* command) {
+    char* args = strchr(command, ' ');
+    if (args != NULL) {
+        *args++ = '\0';
+    }
+    else {
+        args = command + strlen(command);
+    }
+    pthread_mutex_lock(&admin_mutex);
+    if (strcmp(command, "get") == 0) {
+        command_get(fd, args);
+    }
+    else if (strcmp(command, "set") == 0) {
+        command_set(fd, args);
+    }
+    else if (strcmp(command, "dump-phases") == 0) {
+        reply(fd, phase_trace_dump() == 0 ? "ok\n" : "error: phase trace dump failed\n");
+    }
+    else if (command[0] != '\0') {
+        reply(fd, "error: unknown command, expected get, set or dump-phases\n");
+    }
+    pthread_mutex_unlock(&admin_mutex);
+}
+
+static void serve_client(int fd) {
+    char buf[ADMIN_LINE_MAX + 1];
+    size_t used = 0;
+    while (true) {
+        ssize_t bytes_read = recv(fd, buf + used, ADMIN_LINE_MAX - used, 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return;
+        }
+        used += bytes_read;
+        char* line = buf;
+        char* newline;
+        while ((newline = memchr(line, '\n', buf + used - line)) != NULL) {
+            *newline = '\0';
+            if (newline > line && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+            handle_command(fd, line);
+            line = newline + 1;
+        }
+        used -= line - buf;
+        memmove(buf, line, used);
+        if (used == ADMIN_LINE_MAX) {
+            reply(fd, "error: line too long\n");
+            return;
+        }
+    }
+}
+
+static void* admin_run(void* args) {
+    while (true) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            syslog(LOG_ERR, "Admin socket accept failed, it's closed now, error: %s", strerror(errno));
+            return NULL;
+        }
+        struct timeval timeout = { .tv_sec = ADMIN_IDLE_TIMEOUT_SEC, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        serve_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* listens on the UNIX socket at path, only reachable by our own user */
+int admin_start(const char* path, int listen_fd) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Admin socket path %s is too long", path);
+        return ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+    client_listen_fd = listen_fd;
+    for (int level = LOG_DEBUG; level >= LOG_EMERG; level--) {
+        if (setlogmask(0) & LOG_MASK(level)) {
+            log_level = level;
+            break;
+        }
+    }
+
+    admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd < 0) {
+        syslog(LOG_ERR, "Could not create the admin socket, error: %s", strerror(errno));
+        return errno;
+    }
+    /* a previous run may have left its socket behind */
+    unlink(path);
+    mode_t old_mask = umask(0077);
+    int ret_val = bind(admin_fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret_val < 0 || listen(admin_fd, 1) < 0) {
+        ret_val = errno;
+        syslog(LOG_ERR, "Could not listen on admin socket %s, error: %s", path, strerror(ret_val));
+        close(admin_fd);
+        admin_fd = -1;
+        return ret_val;
+    }
+    admin_path = strdup(path);
+    ret_val = pthread_create(&admin_thread, NULL, admin_run, NULL);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not start the admin thread, error: %s", strerror(ret_val));
+        admin_cleanup();
+        return ret_val;
+    }
+    pthread_detach(admin_thread);
+    syslog(LOG_NOTICE, "Admin socket listening on %s", path);
+    return 0;
+}
+
+void admin_cleanup(void) {
+    if (admin_fd >= 0) {
+        close(admin_fd);
+        admin_fd = -1;
+    }
+    if (admin_path != NULL) {
+        unlink(admin_path);
+        free(admin_path);
+        admin_path = NULL;
+    }
+}
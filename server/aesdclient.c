@@ -0,0 +1,602 @@
+#define _GNU_SOURCE
+#include "aesdclient.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* response bytes past the caller's buffer are read into this much stack and dropped */
+#define DISCARD_SIZE 4096
+
+struct aesd_request {
+    char* response_buf;
+    size_t response_capacity;
+    size_t response_size;
+    aesd_client_callback callback;
+    void* user_data;
+    /* an append, the server may turn it away with OVERLOAD_BUSY_REPLY or READ_ONLY_REPLY */
+    bool append;
+    /* the start of the response, kept even without a buffer to tell those replies */
+    char head[sizeof(READ_ONLY_REPLY) - 1];
+    struct aesd_request* next;
+};
+
+/**
+ * Submitters hold send_mutex while they queue a request and send its packet, so requests are
+ * queued in the order the server answers them. The receiver thread only ever takes mutex, it
+ * can't get stuck behind a submitter blocked on a full socket waiting for it to read.
+ */
+struct aesd_connection {
+    struct aesd_client* client;
+    /* only the receiver thread changes it, under both mutexes */
+    int socketd;
+    bool connected;
+    pthread_mutex_t send_mutex;
+    pthread_mutex_t mutex;
+    /* a request completed, or the connection went up or down */
+    pthread_cond_t changed;
+    struct aesd_request* head;
+    struct aesd_request* tail;
+    unsigned int in_flight;
+    pthread_t receiver;
+};
+
+struct aesd_client {
+    char* host;
+    char* port;
+    char* channel;
+    unsigned int max_in_flight;
+    unsigned int connection_count;
+    unsigned int next_connection;
+    bool closing;
+    struct aesd_connection* connections;
+};
+
+/* callbacks run on receiver threads, which must never wait for a response themselves */
+static __thread bool on_receiver_thread = false;
+
+static int send_all(int socketd, struct iovec* iov, int iovcnt) {
+    while (iovcnt) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t sent = sendmsg(socketd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return errno;
+        }
+        while (iovcnt && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+static int recv_all(int socketd, void* buf, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t bytes_read = recv(socketd, (char*)buf + received, size - received, 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            return errno == EAGAIN ? ETIMEDOUT : errno;
+        }
+        if (bytes_read == 0) {
+            return ECONNRESET;
+        }
+        received += bytes_read;
+    }
+    return 0;
+}
+
+/* sends a command and checks it got the empty response commands get */
+static int send_command(int socketd, const char* command, const char* argument) {
+    struct iovec iov[3] = {
+        { .iov_base = (void*)command, .iov_len = strlen(command) },
+        { .iov_base = (void*)argument, .iov_len = strlen(argument) },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    int ret_val = send_all(socketd, iov, 3);
+    if (ret_val) {
+        return ret_val;
+    }
+    uint32_t header;
+    ret_val = recv_all(socketd, &header, sizeof(header));
+    if (ret_val) {
+        return ret_val;
+    }
+    /* a server without framing takes the command for data and answers with the channel */
+    return header == 0 ? 0 : EPROTO;
+}
+
+/* a new framed connection to the server, on the configured channel */
+static int connect_server(struct aesd_client* client, int* socketd) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses = NULL;
+    int ret_val = getaddrinfo(client->host, client->port, &hints, &addresses);
+    if (ret_val) {
+        return ret_val == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    }
+    int fd = -1;
+    ret_val = ECONNREFUSED;
+    for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0) {
+            ret_val = errno;
+            continue;
+        }
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            break;
+        }
+        ret_val = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        return ret_val;
+    }
+
+    /* pipelined packets are small, they must not wait for the acks of the previous ones */
+    int opt_val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+    struct timeval timeout = { .tv_sec = AESD_CLIENT_SETUP_TIMEOUT_MS / 1000, .tv_usec = (AESD_CLIENT_SETUP_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ret_val = send_command(fd, FRAMED_COMMAND, "");
+    if (!ret_val && client->channel != NULL) {
+        ret_val = send_command(fd, CHANNEL_COMMAND, client->channel);
+    }
+    if (ret_val) {
+        close(fd);
+        return ret_val;
+    }
+    /* responses can take as long as they take from here on */
+    memset(&timeout, 0, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    *socketd = fd;
+    return 0;
+}
+
+static void fail_requests(struct aesd_request* request, int status) {
+    while (request != NULL) {
+        struct aesd_request* next = request->next;
+        request->callback(request->user_data, status, request->response_size);
+        free(request);
+        request = next;
+    }
+}
+
+/* drops the connection, the requests on it get status */
+static void connection_down(struct aesd_connection* conn, int status) {
+    /* gets a submitter blocked on a full socket out of send() */
+    shutdown(conn->socketd, SHUT_RDWR);
+    pthread_mutex_lock(&conn->mutex);
+    conn->connected = false;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->mutex);
+
+    pthread_mutex_lock(&conn->send_mutex);
+    pthread_mutex_lock(&conn->mutex);
+    close(conn->socketd);
+    conn->socketd = -1;
+    struct aesd_request* requests = conn->head;
+    conn->head = NULL;
+    conn->tail = NULL;
+    pthread_mutex_unlock(&conn->mutex);
+    pthread_mutex_unlock(&conn->send_mutex);
+    fail_requests(requests, status);
+    /* nothing is submitted while disconnected, the count can only be of the requests just failed */
+    pthread_mutex_lock(&conn->mutex);
+    conn->in_flight = 0;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+static void connection_up(struct aesd_connection* conn, int socketd) {
+    pthread_mutex_lock(&conn->send_mutex);
+    pthread_mutex_lock(&conn->mutex);
+    conn->socketd = socketd;
+    conn->connected = true;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->mutex);
+    pthread_mutex_unlock(&conn->send_mutex);
+}
+
+static bool client_closing(struct aesd_client* client) {
+    return __atomic_load_n(&client->closing, __ATOMIC_ACQUIRE);
+}
+
+static bool is_reply(const struct aesd_request* request, const char* reply) {
+    size_t length = strlen(reply);
+    return request->response_size == length && memcmp(request->head, reply, length) == 0;
+}
+
+/* reads the next chunk of the response to the oldest request, returns the error dropping the connection */
+static int receive_chunk(struct aesd_connection* conn) {
+    uint32_t header;
+    int ret_val = recv_all(conn->socketd, &header, sizeof(header));
+    if (ret_val) {
+        return ret_val;
+    }
+    size_t chunk = ntohl(header);
+    /* only this thread takes requests off the queue, the head stays put while we fill it */
+    pthread_mutex_lock(&conn->mutex);
+    struct aesd_request* request = conn->head;
+    pthread_mutex_unlock(&conn->mutex);
+    if (request == NULL) {
+        return EPROTO;
+    }
+
+    if (chunk == 0) {
+        pthread_mutex_lock(&conn->mutex);
+        conn->head = request->next;
+        if (conn->head == NULL) {
+            conn->tail = NULL;
+        }
+        pthread_mutex_unlock(&conn->mutex);
+        int status = request->response_buf != NULL && request->response_size > request->response_capacity ? EMSGSIZE : 0;
+        if (request->append && is_reply(request, OVERLOAD_BUSY_REPLY)) {
+            status = EBUSY;
+        }
+        else if (request->append && is_reply(request, READ_ONLY_REPLY)) {
+            status = EROFS;
+        }
+        request->callback(request->user_data, status, request->response_size);
+        free(request);
+        /* only now, aesd_client_flush() returns once the callbacks are done */
+        pthread_mutex_lock(&conn->mutex);
+        conn->in_flight--;
+        pthread_cond_broadcast(&conn->changed);
+        pthread_mutex_unlock(&conn->mutex);
+        return 0;
+    }
+    char discard[DISCARD_SIZE];
+    while (chunk) {
+        /* straight into the caller's buffer, what doesn't fit is only counted */
+        char* target = discard;
+        size_t size = chunk < DISCARD_SIZE ? chunk : DISCARD_SIZE;
+        if (request->response_size < request->response_capacity) {
+            target = request->response_buf + request->response_size;
+            size = request->response_capacity - request->response_size;
+            size = chunk < size ? chunk : size;
+        }
+        ret_val = recv_all(conn->socketd, target, size);
+        if (ret_val) {
+            return ret_val;
+        }
+        if (request->response_size < sizeof(request->head)) {
+            size_t kept = sizeof(request->head) - request->response_size;
+            memcpy(request->head + request->response_size, target, size < kept ? size : kept);
+        }
+        request->response_size += size;
+        chunk -= size;
+    }
+    return 0;
+}
+
+static void* receiver_run(void* args) {
+    struct aesd_connection* conn = args;
+    struct aesd_client* client = conn->client;
+    on_receiver_thread = true;
+    int delay_ms = AESD_CLIENT_RECONNECT_MIN_MS;
+    while (!client_closing(client)) {
+        if (conn->socketd >= 0) {
+            int ret_val = receive_chunk(conn);
+            if (ret_val) {
+                connection_down(conn, ret_val);
+            }
+            continue;
+        }
+        int socketd;
+        if (connect_server(client, &socketd) == 0) {
+            connection_up(conn, socketd);
+            delay_ms = AESD_CLIENT_RECONNECT_MIN_MS;
+            continue;
+        }
+        /* back off, aesd_client_close() cuts it short */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += delay_ms / 1000;
+        deadline.tv_nsec += (delay_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&conn->mutex);
+        if (!client_closing(client)) {
+            pthread_cond_timedwait(&conn->changed, &conn->mutex, &deadline);
+        }
+        pthread_mutex_unlock(&conn->mutex);
+        delay_ms = delay_ms * 2 < AESD_CLIENT_RECONNECT_MAX_MS ? delay_ms * 2 : AESD_CLIENT_RECONNECT_MAX_MS;
+    }
+    if (conn->socketd >= 0) {
+        connection_down(conn, ECANCELED);
+    }
+    return NULL;
+}
+
+/* the next connected connection with room, or the next connected one when they're all full */
+static struct aesd_connection* pick_connection(struct aesd_client* client, bool* full) {
+    unsigned int first = __atomic_fetch_add(&client->next_connection, 1, __ATOMIC_RELAXED);
+    struct aesd_connection* fallback = NULL;
+    for (unsigned int i = 0; i < client->connection_count; i++) {
+        struct aesd_connection* conn = &client->connections[(first + i) % client->connection_count];
+        pthread_mutex_lock(&conn->mutex);
+        bool connected = conn->connected;
+        bool has_room = conn->in_flight < client->max_in_flight;
+        pthread_mutex_unlock(&conn->mutex);
+        if (connected && has_room) {
+            *full = false;
+            return conn;
+        }
+        if (connected && fallback == NULL) {
+            fallback = conn;
+        }
+    }
+    *full = true;
+    return fallback;
+}
+
+static int submit(struct aesd_client* client, struct iovec* iov, int iovcnt, bool append,
+                  void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data) {
+    bool full;
+    struct aesd_connection* conn = pick_connection(client, &full);
+    if (conn == NULL) {
+        return ENOTCONN;
+    }
+    if (full && on_receiver_thread) {
+        return EAGAIN;
+    }
+    struct aesd_request* request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        return ENOMEM;
+    }
+    request->response_buf = response_buf;
+    request->response_capacity = response_buf != NULL ? response_capacity : 0;
+    request->callback = callback;
+    request->user_data = user_data;
+    request->append = append;
+
+    pthread_mutex_lock(&conn->send_mutex);
+    pthread_mutex_lock(&conn->mutex);
+    while (conn->connected && conn->in_flight >= client->max_in_flight) {
+        pthread_cond_wait(&conn->changed, &conn->mutex);
+    }
+    if (!conn->connected) {
+        pthread_mutex_unlock(&conn->mutex);
+        pthread_mutex_unlock(&conn->send_mutex);
+        free(request);
+        return ENOTCONN;
+    }
+    if (conn->tail != NULL) {
+        conn->tail->next = request;
+    }
+    else {
+        conn->head = request;
+    }
+    conn->tail = request;
+    conn->in_flight++;
+    pthread_mutex_unlock(&conn->mutex);
+    if (send_all(conn->socketd, iov, iovcnt)) {
+        /* the receiver notices and fails this request along with the others on the connection */
+        shutdown(conn->socketd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->send_mutex);
+    return 0;
+}
+
+int aesd_client_append(struct aesd_client* client, const void* data, size_t size,
+                       void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data) {
+    bool terminated = size && ((const char*)data)[size - 1] == '\n';
+    size_t body = terminated ? size - 1 : size;
+    /* the server would split it and answer twice */
+    if (memchr(data, '\n', body) != NULL || callback == NULL) {
+        return EINVAL;
+    }
+    struct iovec iov[2] = {
+        { .iov_base = (void*)data, .iov_len = size },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    return submit(client, iov, terminated ? 1 : 2, true, response_buf, response_capacity, callback, user_data);
+}
+
+int aesd_client_seek(struct aesd_client* client, uint32_t write_cmd, uint32_t offset,
+                     void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data) {
+    if (callback == NULL) {
+        return EINVAL;
+    }
+    char command[64];
+    int length = snprintf(command, sizeof(command), "%s%u,%u\n", SEEK_COMMAND, write_cmd, offset);
+    struct iovec iov = { .iov_base = command, .iov_len = length };
+    return submit(client, &iov, 1, false, response_buf, response_capacity, callback, user_data);
+}
+
+int aesd_client_filter(struct aesd_client* client, const char* patterns, bool offsets,
+                       void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data) {
+    /* the server only answers a malformed filter with an empty response, tell the caller why */
+    if (callback == NULL || patterns == NULL || patterns[0] == '\0' || strchr(patterns, '\n') != NULL) {
+        return EINVAL;
+    }
+    const char* command = offsets ? FILTER_OFFSETS_COMMAND : FILTER_COMMAND;
+    struct iovec iov[3] = {
+        { .iov_base = (void*)command, .iov_len = strlen(command) },
+        { .iov_base = (void*)patterns, .iov_len = strlen(patterns) },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    return submit(client, iov, 3, false, response_buf, response_capacity, callback, user_data);
+}
+
+int aesd_client_flush(struct aesd_client* client) {
+    if (on_receiver_thread) {
+        return EDEADLK;
+    }
+    for (unsigned int i = 0; i < client->connection_count; i++) {
+        struct aesd_connection* conn = &client->connections[i];
+        pthread_mutex_lock(&conn->mutex);
+        while (conn->in_flight) {
+            pthread_cond_wait(&conn->changed, &conn->mutex);
+        }
+        pthread_mutex_unlock(&conn->mutex);
+    }
+    return 0;
+}
+
+struct sync_wait {
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    bool done;
+    int status;
+    size_t response_size;
+};
+
+static void sync_done(void* user_data, int status, size_t response_size) {
+    struct sync_wait* wait = user_data;
+    pthread_mutex_lock(&wait->mutex);
+    wait->done = true;
+    wait->status = status;
+    wait->response_size = response_size;
+    pthread_cond_signal(&wait->done_cond);
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+static int sync_result(struct sync_wait* wait, int submitted) {
+    if (!submitted) {
+        pthread_mutex_lock(&wait->mutex);
+        while (!wait->done) {
+            pthread_cond_wait(&wait->done_cond, &wait->mutex);
+        }
+        pthread_mutex_unlock(&wait->mutex);
+    }
+    pthread_mutex_destroy(&wait->mutex);
+    pthread_cond_destroy(&wait->done_cond);
+    return submitted ? submitted : wait->status;
+}
+
+int aesd_client_append_sync(struct aesd_client* client, const void* data, size_t size,
+                            void* response_buf, size_t response_capacity, size_t* response_size) {
+    if (on_receiver_thread) {
+        return EDEADLK;
+    }
+    struct sync_wait wait = { .mutex = PTHREAD_MUTEX_INITIALIZER, .done_cond = PTHREAD_COND_INITIALIZER };
+    int ret_val = sync_result(&wait, aesd_client_append(client, data, size, response_buf, response_capacity, sync_done, &wait));
+    if (response_size != NULL) {
+        *response_size = wait.response_size;
+    }
+    return ret_val;
+}
+
+int aesd_client_read_range(struct aesd_client* client, uint32_t write_cmd, uint32_t offset,
+                           void* buf, size_t length, size_t* bytes_read) {
+    if (on_receiver_thread) {
+        return EDEADLK;
+    }
+    struct sync_wait wait = { .mutex = PTHREAD_MUTEX_INITIALIZER, .done_cond = PTHREAD_COND_INITIALIZER };
+    int ret_val = sync_result(&wait, aesd_client_seek(client, write_cmd, offset, buf, length, sync_done, &wait));
+    /* the rest of the channel past the range is expected */
+    if (ret_val == EMSGSIZE) {
+        ret_val = 0;
+    }
+    if (bytes_read != NULL) {
+        *bytes_read = wait.response_size < length ? wait.response_size : length;
+    }
+    return ret_val;
+}
+
+/* connects the whole pool, later drops are reconnected in the background */
+int aesd_client_open(const struct aesd_client_config* config, struct aesd_client** client_ptr) {
+    struct aesd_client* client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return ENOMEM;
+    }
+    client->host = strdup(config->host != NULL ? config->host : "localhost");
+    client->port = strdup(config->port != NULL ? config->port : AESD_CLIENT_PORT_DEFAULT);
+    client->channel = config->channel != NULL ? strdup(config->channel) : NULL;
+    client->connection_count = config->connections ? config->connections : AESD_CLIENT_CONNECTIONS_DEFAULT;
+    client->max_in_flight = config->max_in_flight ? config->max_in_flight : AESD_CLIENT_IN_FLIGHT_DEFAULT;
+    client->connections = calloc(client->connection_count, sizeof(*client->connections));
+    if (client->host == NULL || client->port == NULL || (config->channel != NULL && client->channel == NULL) ||
+        client->connections == NULL) {
+        free(client->connections);
+        free(client->channel);
+        free(client->port);
+        free(client->host);
+        free(client);
+        return ENOMEM;
+    }
+
+    int ret_val = 0;
+    unsigned int started = 0;
+    for (; started < client->connection_count; started++) {
+        struct aesd_connection* conn = &client->connections[started];
+        conn->client = client;
+        pthread_mutex_init(&conn->send_mutex, NULL);
+        pthread_mutex_init(&conn->mutex, NULL);
+        pthread_cond_init(&conn->changed, NULL);
+        ret_val = connect_server(client, &conn->socketd);
+        if (ret_val) {
+            break;
+        }
+        conn->connected = true;
+        ret_val = pthread_create(&conn->receiver, NULL, receiver_run, conn);
+        if (ret_val) {
+            close(conn->socketd);
+            break;
+        }
+    }
+    if (ret_val) {
+        client->connection_count = started;
+        aesd_client_close(client);
+        return ret_val;
+    }
+    *client_ptr = client;
+    return 0;
+}
+
+/* waits for the outstanding requests, then disconnects */
+void aesd_client_close(struct aesd_client* client) {
+    aesd_client_flush(client);
+    __atomic_store_n(&client->closing, true, __ATOMIC_RELEASE);
+    for (unsigned int i = 0; i < client->connection_count; i++) {
+        struct aesd_connection* conn = &client->connections[i];
+        /* wakes the receiver from recv() or from its reconnect back off */
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->connected) {
+            shutdown(conn->socketd, SHUT_RDWR);
+        }
+        pthread_cond_broadcast(&conn->changed);
+        pthread_mutex_unlock(&conn->mutex);
+    }
+    for (unsigned int i = 0; i < client->connection_count; i++) {
+        struct aesd_connection* conn = &client->connections[i];
+        pthread_join(conn->receiver, NULL);
+        pthread_mutex_destroy(&conn->send_mutex);
+        pthread_mutex_destroy(&conn->mutex);
+        pthread_cond_destroy(&conn->changed);
+    }
+    free(client->connections);
+    free(client->channel);
+    free(client->port);
+    free(client->host);
+    free(client);
+}
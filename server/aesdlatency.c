@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**
+ * Measures what a latency sensitive producer sees: a few connections sending small packets at a
+ * steady pace, each one waiting for its response before the next, so every packet finds the
+ * server idle and pays for its wakeups. Run it against a default server and one busy polling
+ * (-b) to compare them, see busy-poll-bench.sh.
+ */
+
+#define LATENCY_RECV_SIZE (64 * 1024)
+#define LATENCY_PACKET_MAX 64
+#define LATENCY_RESPONSE_TIMEOUT_S 5
+
+struct latency_connection {
+    unsigned int index;
+    pthread_t thread;
+    /* results, only touched by the connection thread until it is joined */
+    uint64_t* latencies_ns;
+    size_t responses;
+    int error;
+};
+
+static struct addrinfo* server_address = NULL;
+static size_t packet_count = 1000;
+static unsigned long interval_us = 1000;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec deadline = { .tv_sec = deadline_ns / 1000000000ULL, .tv_nsec = deadline_ns % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+static int send_all(int socketd, const char* buf, size_t size) {
+    while (size) {
+        ssize_t sent = send(socketd, buf, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return errno;
+        }
+        buf += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+/* a write is answered with the whole channel, the response is over once it ends with the packet */
+static int read_response(int socketd, char* recv_buf, const char* packet, size_t length) {
+    char tail[LATENCY_PACKET_MAX];
+    size_t total = 0;
+    while (true) {
+        ssize_t bytes_read = recv(socketd, recv_buf, LATENCY_RECV_SIZE, 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            return errno == EAGAIN ? ETIMEDOUT : errno;
+        }
+        if (bytes_read == 0) {
+            return ECONNRESET;
+        }
+        total += bytes_read;
+        /* slide the window of the last length bytes received */
+        if ((size_t)bytes_read >= length) {
+            memcpy(tail, recv_buf + bytes_read - length, length);
+        }
+        else {
+            memmove(tail, tail + bytes_read, length - bytes_read);
+            memcpy(tail + length - bytes_read, recv_buf, bytes_read);
+        }
+        if (total >= length && memcmp(tail, packet, length) == 0) {
+            return 0;
+        }
+    }
+}
+
+static void* latency_connection_run(void* args) {
+    struct latency_connection* conn = args;
+    int socketd = socket(server_address->ai_family, SOCK_STREAM, 0);
+    if (socketd < 0 || connect(socketd, server_address->ai_addr, server_address->ai_addrlen) < 0) {
+        conn->error = errno;
+        if (socketd >= 0) {
+            close(socketd);
+        }
+        return NULL;
+    }
+    int opt_val = 1;
+    setsockopt(socketd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+    struct timeval timeout = { .tv_sec = LATENCY_RESPONSE_TIMEOUT_S };
+    setsockopt(socketd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char* recv_buf = malloc(LATENCY_RECV_SIZE);
+    conn->latencies_ns = calloc(packet_count, sizeof(uint64_t));
+    if (recv_buf == NULL || conn->latencies_ns == NULL) {
+        conn->error = ENOMEM;
+        free(recv_buf);
+        close(socketd);
+        return NULL;
+    }
+
+    uint64_t next_ns = now_ns();
+    for (size_t i = 0; i < packet_count && !conn->error; i++) {
+        char packet[LATENCY_PACKET_MAX];
+        size_t length = snprintf(packet, sizeof(packet), "latency %u %zu\n", conn->index, i);
+        sleep_until(next_ns);
+        uint64_t sent_ns = now_ns();
+        conn->error = send_all(socketd, packet, length);
+        if (!conn->error) {
+            conn->error = read_response(socketd, recv_buf, packet, length);
+        }
+        if (!conn->error) {
+            conn->latencies_ns[conn->responses++] = now_ns() - sent_ns;
+        }
+        next_ns += interval_us * 1000ULL;
+    }
+    free(recv_buf);
+    close(socketd);
+    return NULL;
+}
+
+static int compare_latency(const void* a, const void* b) {
+    uint64_t la = *(const uint64_t*)a;
+    uint64_t lb = *(const uint64_t*)b;
+    return la < lb ? -1 : la > lb;
+}
+
+static void report(struct latency_connection* connections, size_t connection_count) {
+    size_t responses = 0;
+    unsigned long failed = 0;
+    for (size_t i = 0; i < connection_count; i++) {
+        responses += connections[i].responses;
+        failed += connections[i].error != 0;
+    }
+    if (responses) {
+        uint64_t* latencies = malloc(responses * sizeof(uint64_t));
+        if (latencies != NULL) {
+            size_t filled = 0;
+            for (size_t i = 0; i < connection_count; i++) {
+                memcpy(latencies + filled, connections[i].latencies_ns, connections[i].responses * sizeof(uint64_t));
+                filled += connections[i].responses;
+            }
+            qsort(latencies, responses, sizeof(uint64_t), compare_latency);
+            printf("Response latency over %zu responses (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", responses,
+                   latencies[responses / 2] / 1e3, latencies[responses * 90 / 100] / 1e3,
+                   latencies[responses * 99 / 100] / 1e3, latencies[responses * 999 / 1000] / 1e3,
+                   latencies[responses - 1] / 1e3);
+            free(latencies);
+        }
+    }
+    if (failed) {
+        printf("%lu connections failed\n", failed);
+    }
+}
+
+static void print_usage(void) {
+    printf("Usage: aesdlatency [-h <host>] [-p <port>] [-c <connections>] [-n <packets>] [-i <interval us>]\n");
+    printf("\t-h <host>\t\tServer to measure, localhost by default.\n");
+    printf("\t-p <port>\t\tServer port, 9000 by default.\n");
+    printf("\t-c <connections>\tProducers sending at the same time, 1 by default.\n");
+    printf("\t-n <packets>\t\tPackets each producer sends, 1000 by default.\n");
+    printf("\t-i <interval us>\tPace of each producer, 1000 by default.\n");
+}
+
+int main(int argc, char** argv) {
+    const char* host = "localhost";
+    const char* port = "9000";
+    size_t connection_count = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:i:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                connection_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                packet_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                interval_us = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc || connection_count == 0 || packet_count == 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int ret_val = getaddrinfo(host, port, &hints, &server_address);
+    if (ret_val) {
+        fprintf(stderr, "Could not resolve %s:%s: %s\n", host, port, gai_strerror(ret_val));
+        exit(EXIT_FAILURE);
+    }
+    struct latency_connection* connections = calloc(connection_count, sizeof(*connections));
+    if (connections == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    size_t started = 0;
+    for (; started < connection_count; started++) {
+        connections[started].index = started;
+        ret_val = pthread_create(&connections[started].thread, NULL, latency_connection_run, &connections[started]);
+        if (ret_val) {
+            fprintf(stderr, "Could not start connection %zu: %s\n", started, strerror(ret_val));
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(connections[i].thread, NULL);
+    }
+    report(connections, started);
+
+    for (size_t i = 0; i < started; i++) {
+        free(connections[i].latencies_ns);
+    }
+    free(connections);
+    freeaddrinfo(server_address);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "phase_trace.h"
+
+/**
+ * Turns a phase trace dumped by aesdsocket -S into Chrome trace event JSON, which both
+ * chrome://tracing and ui.perfetto.dev open. Every connection is a track, every sampled
+ * request a slice with its phases nested under it.
+ */
+
+struct phase_span {
+    const char* name;
+    enum phase_mark from;
+    enum phase_mark to;
+};
+
+/* the dump starts after whichever of the storage steps the request went through last */
+static const struct phase_span spans[] = {
+    { "read", PHASE_READ_START, PHASE_READ_DONE },
+    { "parse", PHASE_READ_DONE, PHASE_PARSED },
+    { "rate limit", PHASE_PARSED, PHASE_ADMITTED },
+    { "lock wait", PHASE_ADMITTED, PHASE_LOCKED },
+    { "write", PHASE_LOCKED, PHASE_WRITTEN },
+    { "fsync", PHASE_WRITTEN, PHASE_SYNCED },
+    { "dump", PHASE_MARKS, PHASE_DUMPED },
+    { "close", PHASE_DUMPED, PHASE_UNLOCKED },
+};
+
+static bool first_event = true;
+
+static void print_slice(const char* name, unsigned int pid, const struct phase_record* record, uint64_t start_ns, uint64_t end_ns, const char* extra_args) {
+    printf("%s\n{\"name\":\"%s\",\"cat\":\"aesdsocket\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%llu,"
+           "\"args\":{\"packet\":%llu,\"bytes\":%llu%s}}",
+           first_event ? "" : ",", name, start_ns / 1e3, (end_ns - start_ns) / 1e3, pid,
+           (unsigned long long)record->connection_id, (unsigned long long)record->packet,
+           (unsigned long long)record->size, extra_args);
+    first_event = false;
+}
+
+static void print_record(unsigned int pid, const struct phase_record* record) {
+    const uint64_t* marks = record->marks;
+    /* the whole request first so viewers nest the phases under it */
+    enum phase_mark last = PHASE_READ_DONE;
+    for (int mark = PHASE_READ_DONE; mark < PHASE_MARKS; mark++) {
+        if (marks[mark]) {
+            last = mark;
+        }
+    }
+    if (!marks[PHASE_READ_START] || !marks[last]) {
+        return;
+    }
+    print_slice("request", pid, record, marks[PHASE_READ_START], marks[last], "");
+
+    for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); i++) {
+        uint64_t start_ns;
+        if (spans[i].from == PHASE_MARKS) {
+            start_ns = marks[PHASE_SYNCED] ? marks[PHASE_SYNCED] : marks[PHASE_WRITTEN] ? marks[PHASE_WRITTEN] : marks[PHASE_LOCKED];
+        }
+        else {
+            start_ns = marks[spans[i].from];
+        }
+        uint64_t end_ns = marks[spans[i].to];
+        if (!start_ns || !end_ns || end_ns < start_ns) {
+            continue;
+        }
+        char extra_args[64] = "";
+        if (spans[i].to == PHASE_DUMPED) {
+            snprintf(extra_args, sizeof(extra_args), ",\"send_us\":%.3f", record->send_ns / 1e3);
+        }
+        print_slice(spans[i].name, pid, record, start_ns, end_ns, extra_args);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        printf("Usage: aesdphases <phase trace file> > trace.json\n");
+        exit(EXIT_FAILURE);
+    }
+    FILE* file = fopen(argv[1], "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct phase_trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != PHASE_TRACE_MAGIC ||
+        header.version != PHASE_TRACE_VERSION || header.marks != PHASE_MARKS) {
+        fprintf(stderr, "%s is not a phase trace of this aesdsocket version\n", argv[1]);
+        fclose(file);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    struct phase_record record;
+    unsigned long records = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        print_record(header.pid, &record);
+        records++;
+    }
+    printf("\n]}\n");
+    fclose(file);
+    fprintf(stderr, "Converted %lu requests\n", records);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "capture.h"
+#include "protocol.h"
+
+/**
+ * Replays a trace captured by aesdsocket -k against a server: every captured connection gets
+ * its own thread, opened, fed and closed on the captured schedule (or as fast as possible),
+ * and every response is timed.
+ */
+
+#define REPLAY_BUCKETS 4096
+#define REPLAY_RECV_SIZE (64 * 1024)
+/* a response to a write ends with that write, other responses end when the server goes quiet */
+#define REPLAY_QUIET_MS 100
+#define REPLAY_RESPONSE_TIMEOUT_MS 5000
+/**
+ * The server tells packets apart by reads ending in a newline, and a channel switch gets no
+ * answer to wait for, so give it this long before the next packet or both arrive as one.
+ */
+#define REPLAY_COMMAND_SETTLE_MS 10
+
+struct replay_packet {
+    uint64_t time_ns;
+    uint64_t length;
+    uint32_t captured;
+    char* payload;
+};
+
+struct replay_connection {
+    uint64_t id;
+    uint64_t open_ns;
+    uint64_t close_ns;
+    bool closed;
+    struct replay_packet* packets;
+    size_t packet_count;
+    size_t packet_capacity;
+    struct replay_connection* next_in_bucket;
+    pthread_t thread;
+    /* results, only touched by the connection thread until it is joined */
+    uint64_t* latencies_ns;
+    size_t responses;
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long timeouts;
+    /* packets the server shed under overload, answered with OVERLOAD_BUSY_REPLY */
+    unsigned long busy;
+    int error;
+};
+
+static struct replay_connection** connections = NULL;
+static size_t connection_count = 0;
+static size_t connection_capacity = 0;
+static struct replay_connection* buckets[REPLAY_BUCKETS];
+
+/* 0 replays as fast as possible */
+static double speed = 1.0;
+static uint64_t trace_origin_ns = UINT64_MAX;
+static struct timespec replay_start;
+static struct addrinfo* server_address = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* sleeps until the replay catches up with this point of the trace */
+static void wait_until(uint64_t trace_ns) {
+    if (speed == 0 || trace_ns <= trace_origin_ns) {
+        return;
+    }
+    uint64_t offset = (uint64_t)((trace_ns - trace_origin_ns) / speed);
+    struct timespec deadline = replay_start;
+    deadline.tv_sec += offset / 1000000000ULL;
+    deadline.tv_nsec += offset % 1000000000ULL;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+static struct replay_connection* connection_for(uint64_t id, uint64_t time_ns) {
+    struct replay_connection** bucket = &buckets[id % REPLAY_BUCKETS];
+    for (struct replay_connection* conn = *bucket; conn != NULL; conn = conn->next_in_bucket) {
+        if (conn->id == id) {
+            return conn;
+        }
+    }
+    if (connection_count == connection_capacity) {
+        size_t capacity = connection_capacity ? connection_capacity * 2 : 64;
+        struct replay_connection** grown = realloc(connections, capacity * sizeof(*connections));
+        if (grown == NULL) {
+            return NULL;
+        }
+        connections = grown;
+        connection_capacity = capacity;
+    }
+    struct replay_connection* conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        return NULL;
+    }
+    /* a connection already open when the capture started begins with its first packet */
+    conn->id = id;
+    conn->open_ns = time_ns;
+    conn->next_in_bucket = *bucket;
+    *bucket = conn;
+    connections[connection_count++] = conn;
+    return conn;
+}
+
+static int add_packet(struct replay_connection* conn, const struct capture_event* event, char* payload) {
+    if (conn->packet_count == conn->packet_capacity) {
+        size_t capacity = conn->packet_capacity ? conn->packet_capacity * 2 : 16;
+        struct replay_packet* grown = realloc(conn->packets, capacity * sizeof(*conn->packets));
+        if (grown == NULL) {
+            return ENOMEM;
+        }
+        conn->packets = grown;
+        conn->packet_capacity = capacity;
+    }
+    struct replay_packet* packet = &conn->packets[conn->packet_count++];
+    packet->time_ns = event->time_ns;
+    packet->length = event->length;
+    packet->captured = event->captured;
+    packet->payload = payload;
+    return 0;
+}
+
+static int load_trace(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open trace %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+    struct capture_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not an aesdsocket capture\n", path);
+        fclose(file);
+        return EINVAL;
+    }
+    struct capture_event event;
+    unsigned long events = 0;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        char* payload = NULL;
+        if (event.captured > CAPTURE_PAYLOAD_MAX || event.captured > event.length) {
+            fprintf(stderr, "Corrupt event %lu in %s\n", events, path);
+            break;
+        }
+        if (event.captured) {
+            payload = malloc(event.captured);
+            if (payload == NULL || fread(payload, event.captured, 1, file) != 1) {
+                /* the server died halfway through an event, replay what came before */
+                free(payload);
+                break;
+            }
+        }
+        struct replay_connection* conn = connection_for(event.connection_id, event.time_ns);
+        if (conn == NULL) {
+            free(payload);
+            fclose(file);
+            return ENOMEM;
+        }
+        if (event.time_ns < trace_origin_ns) {
+            trace_origin_ns = event.time_ns;
+        }
+        switch (event.type) {
+            case CAPTURE_OPEN:
+                conn->open_ns = event.time_ns;
+                break;
+            case CAPTURE_PACKET:
+                if (add_packet(conn, &event, payload)) {
+                    free(payload);
+                    fclose(file);
+                    return ENOMEM;
+                }
+                payload = NULL;
+                break;
+            case CAPTURE_CLOSE:
+                conn->close_ns = event.time_ns;
+                conn->closed = true;
+                break;
+            default:
+                break;
+        }
+        free(payload);
+        events++;
+    }
+    fclose(file);
+    printf("Loaded %lu events, %zu connections from %s\n", events, connection_count, path);
+    return 0;
+}
+
+/* the packet as it was sent, sizes past the captured part are filled in and newline terminated */
+static char* packet_data(const struct replay_packet* packet) {
+    char* data = malloc(packet->length ? packet->length : 1);
+    if (data == NULL) {
+        return NULL;
+    }
+    if (packet->captured) {
+        memcpy(data, packet->payload, packet->captured);
+    }
+    if (packet->captured < packet->length) {
+        memset(data + packet->captured, 'x', packet->length - packet->captured);
+        data[packet->length - 1] = '\n';
+    }
+    return data;
+}
+
+/**
+ * Reads one response. A write is answered with the whole channel, ending with the packet just
+ * written, so match_tail looks for it; otherwise the response is over once the server is quiet.
+ * A write the server shed is answered with OVERLOAD_BUSY_REPLY alone instead, EBUSY once it goes
+ * quiet after that. done_ns is when its last byte arrived, 0 if nothing did.
+ */
+static int read_response(int socketd, char* recv_buf, const char* packet, size_t length, bool match_tail,
+                         struct replay_connection* conn, uint64_t* done_ns) {
+    char* tail = NULL;
+    if (match_tail) {
+        tail = malloc(length);
+        if (tail == NULL) {
+            return ENOMEM;
+        }
+    }
+    char head[sizeof(OVERLOAD_BUSY_REPLY) - 1];
+    size_t total = 0;
+    int ret_val = 0;
+    *done_ns = 0;
+    while (true) {
+        bool busy = match_tail && total == sizeof(head) && memcmp(head, OVERLOAD_BUSY_REPLY, sizeof(head)) == 0;
+        struct pollfd pfd = { .fd = socketd, .events = POLLIN };
+        int ready = poll(&pfd, 1, match_tail && !busy ? REPLAY_RESPONSE_TIMEOUT_MS : REPLAY_QUIET_MS);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            ret_val = errno;
+            break;
+        }
+        if (ready == 0) {
+            ret_val = busy ? EBUSY : match_tail ? ETIMEDOUT : 0;
+            break;
+        }
+        ssize_t bytes_read = recv(socketd, recv_buf, REPLAY_RECV_SIZE, 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            ret_val = bytes_read == 0 ? ECONNRESET : errno;
+            break;
+        }
+        *done_ns = now_ns();
+        if (total < sizeof(head)) {
+            size_t kept = sizeof(head) - total;
+            memcpy(head + total, recv_buf, (size_t)bytes_read < kept ? (size_t)bytes_read : kept);
+        }
+        total += bytes_read;
+        conn->bytes_received += bytes_read;
+        if (match_tail) {
+            /* slide the window of the last length bytes received */
+            if ((size_t)bytes_read >= length) {
+                memcpy(tail, recv_buf + bytes_read - length, length);
+            }
+            else {
+                memmove(tail, tail + bytes_read, length - bytes_read);
+                memcpy(tail + length - bytes_read, recv_buf, bytes_read);
+            }
+            if (total >= length && memcmp(tail, packet, length) == 0) {
+                break;
+            }
+        }
+    }
+    free(tail);
+    return ret_val;
+}
+
+static void* replay_connection_run(void* args) {
+    struct replay_connection* conn = args;
+    int socketd = socket(server_address->ai_family, SOCK_STREAM, 0);
+    if (socketd < 0 || connect(socketd, server_address->ai_addr, server_address->ai_addrlen) < 0) {
+        conn->error = errno;
+        if (socketd >= 0) {
+            close(socketd);
+        }
+        return NULL;
+    }
+    int opt_val = 1;
+    setsockopt(socketd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+    char* recv_buf = malloc(REPLAY_RECV_SIZE);
+    conn->latencies_ns = calloc(conn->packet_count ? conn->packet_count : 1, sizeof(uint64_t));
+    if (recv_buf == NULL || conn->latencies_ns == NULL) {
+        conn->error = ENOMEM;
+        free(recv_buf);
+        close(socketd);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < conn->packet_count && !conn->error; i++) {
+        struct replay_packet* packet = &conn->packets[i];
+        char* data = packet_data(packet);
+        if (data == NULL) {
+            conn->error = ENOMEM;
+            break;
+        }
+        /* responses are read the plain way, the replayed connection stays unframed */
+        if (packet->length == strlen(FRAMED_COMMAND) + 1 && memcmp(data, FRAMED_COMMAND, strlen(FRAMED_COMMAND)) == 0) {
+            free(data);
+            continue;
+        }
+        wait_until(packet->time_ns);
+        uint64_t sent_ns = now_ns();
+        size_t sent = 0;
+        while (sent < packet->length) {
+            ssize_t bytes_wrote = send(socketd, data + sent, packet->length - sent, MSG_NOSIGNAL);
+            if (bytes_wrote < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_wrote < 0) {
+                conn->error = errno;
+                break;
+            }
+            sent += bytes_wrote;
+        }
+        conn->bytes_sent += sent;
+        /* switching channels gets no answer */
+        bool channel_command = packet->length >= strlen(CHANNEL_COMMAND) && memcmp(data, CHANNEL_COMMAND, strlen(CHANNEL_COMMAND)) == 0;
+        if (!conn->error && channel_command) {
+            struct timespec settle = { .tv_sec = 0, .tv_nsec = REPLAY_COMMAND_SETTLE_MS * 1000000L };
+            nanosleep(&settle, NULL);
+        }
+        else if (!conn->error) {
+            /* seek and filter responses don't end with the packet, they're read until the connection goes quiet */
+            bool seek_command = memmem(data, packet->captured, SEEK_COMMAND, strlen(SEEK_COMMAND)) != NULL ||
+                                (packet->captured >= strlen(FILTER_COMMAND) && memcmp(data, FILTER_COMMAND, strlen(FILTER_COMMAND)) == 0) ||
+                                (packet->captured >= strlen(FILTER_OFFSETS_COMMAND) && memcmp(data, FILTER_OFFSETS_COMMAND, strlen(FILTER_OFFSETS_COMMAND)) == 0);
+            uint64_t done_ns;
+            int ret_val = read_response(socketd, recv_buf, data, packet->length, !seek_command, conn, &done_ns);
+            if (ret_val == ETIMEDOUT) {
+                conn->timeouts++;
+            }
+            else if (ret_val == EBUSY) {
+                conn->busy++;
+            }
+            else if (ret_val) {
+                conn->error = ret_val;
+            }
+            else if (done_ns) {
+                conn->latencies_ns[conn->responses++] = done_ns - sent_ns;
+            }
+        }
+        free(data);
+    }
+
+    if (conn->closed) {
+        wait_until(conn->close_ns);
+    }
+    free(recv_buf);
+    close(socketd);
+    return NULL;
+}
+
+static int compare_open(const void* a, const void* b) {
+    const struct replay_connection* ca = *(struct replay_connection* const*)a;
+    const struct replay_connection* cb = *(struct replay_connection* const*)b;
+    return ca->open_ns < cb->open_ns ? -1 : ca->open_ns > cb->open_ns;
+}
+
+static int compare_latency(const void* a, const void* b) {
+    uint64_t la = *(const uint64_t*)a;
+    uint64_t lb = *(const uint64_t*)b;
+    return la < lb ? -1 : la > lb;
+}
+
+static void report(uint64_t elapsed_ns) {
+    size_t responses = 0;
+    unsigned long packets = 0, bytes_sent = 0, bytes_received = 0, timeouts = 0, busy = 0, failed = 0;
+    for (size_t i = 0; i < connection_count; i++) {
+        responses += connections[i]->responses;
+        packets += connections[i]->packet_count;
+        bytes_sent += connections[i]->bytes_sent;
+        bytes_received += connections[i]->bytes_received;
+        timeouts += connections[i]->timeouts;
+        busy += connections[i]->busy;
+        failed += connections[i]->error != 0;
+    }
+    double seconds = elapsed_ns / 1e9;
+    printf("Replayed %zu connections, %lu packets in %.3f s: %.1f packets/s\n", connection_count, packets, seconds, packets / seconds);
+    printf("Sent %lu bytes at %.1f MB/s, received %lu bytes at %.1f MB/s\n", bytes_sent, bytes_sent / seconds / 1e6,
+           bytes_received, bytes_received / seconds / 1e6);
+    if (responses) {
+        uint64_t* latencies = malloc(responses * sizeof(uint64_t));
+        if (latencies != NULL) {
+            size_t filled = 0;
+            for (size_t i = 0; i < connection_count; i++) {
+                memcpy(latencies + filled, connections[i]->latencies_ns, connections[i]->responses * sizeof(uint64_t));
+                filled += connections[i]->responses;
+            }
+            qsort(latencies, responses, sizeof(uint64_t), compare_latency);
+            printf("Response latency over %zu responses (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", responses,
+                   latencies[responses / 2] / 1e3, latencies[responses * 90 / 100] / 1e3,
+                   latencies[responses * 99 / 100] / 1e3, latencies[responses * 999 / 1000] / 1e3,
+                   latencies[responses - 1] / 1e3);
+            free(latencies);
+        }
+    }
+    if (busy) {
+        printf("%lu packets shed by the server as busy, not stored\n", busy);
+    }
+    if (timeouts || failed) {
+        printf("%lu responses timed out, %lu connections failed\n", timeouts, failed);
+    }
+}
+
+static void print_usage(void) {
+    printf("Usage: aesdreplay [-h <host>] [-p <port>] [-s <speed>] <capture file>\n");
+    printf("\t-h <host>\t\tServer to replay against, localhost by default.\n");
+    printf("\t-p <port>\t\tServer port, 9000 by default.\n");
+    printf("\t-s <speed>\t\tReplay speed relative to the capture, 0 for as fast as possible (1 by default).\n");
+}
+
+int main(int argc, char** argv) {
+    const char* host = "localhost";
+    const char* port = "9000";
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 's':
+                speed = strtod(optarg, NULL);
+                if (speed < 0) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int ret_val = getaddrinfo(host, port, &hints, &server_address);
+    if (ret_val) {
+        fprintf(stderr, "Could not resolve %s:%s: %s\n", host, port, gai_strerror(ret_val));
+        exit(EXIT_FAILURE);
+    }
+    if (load_trace(argv[optind])) {
+        exit(EXIT_FAILURE);
+    }
+    if (connection_count == 0) {
+        printf("Nothing to replay\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    /* connections start in the order they were opened, each one keeps its own schedule */
+    qsort(connections, connection_count, sizeof(*connections), compare_open);
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    uint64_t start_ns = now_ns();
+    size_t started = 0;
+    for (; started < connection_count; started++) {
+        wait_until(connections[started]->open_ns);
+        ret_val = pthread_create(&connections[started]->thread, NULL, replay_connection_run, connections[started]);
+        if (ret_val) {
+            fprintf(stderr, "Could not start connection %zu: %s\n", started, strerror(ret_val));
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(connections[i]->thread, NULL);
+    }
+    connection_count = started;
+    report(now_ns() - start_ns);
+
+    freeaddrinfo(server_address);
+    return EXIT_SUCCESS;
+}
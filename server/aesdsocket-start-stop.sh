@@ -2,8 +2,11 @@
 
 # Description: start/stop init script for the aesd socket server application assignment
 
+# UNIX socket a running instance hands its listening socket over through on upgrade
+AESDSOCKET_HANDOFF_SOCKET=${AESDSOCKET_HANDOFF_SOCKET:-/var/run/aesdsocket.sock}
+
 do_start() {
-    AESDSOCKET_ARGS="$AESDSOCKET_ARGS -d"
+    AESDSOCKET_ARGS="$AESDSOCKET_ARGS -d -u $AESDSOCKET_HANDOFF_SOCKET"
     printf "Starting aesdsocket as daemon..."
     umask 077
     
@@ -17,6 +20,15 @@ do_stop() {
     [ $? = 0 ] && echo "OK" || echo "FAIL"
 }
 
+do_upgrade() {
+    # the new instance takes over the listening socket and live connections, the old one drains and exits by itself
+    printf "Upgrading aesdsocket..."
+    umask 077
+
+    /usr/bin/aesdsocket $AESDSOCKET_ARGS -d -u $AESDSOCKET_HANDOFF_SOCKET -l
+    [ $? = 0 ] && echo "OK" || echo "FAIL"
+}
+
 case "$1" in
     start)
         do_start
@@ -28,8 +40,11 @@ case "$1" in
         do_stop
         do_start
         ;;
+    upgrade)
+        do_upgrade
+        ;;
     *)
-        echo "Usage: $0 {start|stop|restart}"
+        echo "Usage: $0 {start|stop|restart|upgrade}"
 esac
 
 exit 0
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,9 +16,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "queue.h"
 #include "utility.h"
+#include "channel.h"
+#include "affinity.h"
+#include "handoff.h"
+#include "snapshot.h"
+#include "deadlines.h"
+#include "rate_limit.h"
+#include "staging.h"
+#include "replication.h"
+#include "prefork.h"
+#include "shared_log.h"
+#include "frame_log.h"
+#include "probes.h"
+#include "capture.h"
+#include "phase_trace.h"
+#include "admin.h"
+#include "overload.h"
+#include "busy_poll.h"
 
 #define USE_AESD_CHAR_DEVICE 1
 
@@ -45,10 +64,18 @@ char* output_file_path = "/dev/aesdchar";
 #else
 char* output_file_path = "/var/tmp/aesdsocketdata";
 #endif
-bool mutex_initialized = false;
-pthread_mutex_t mutex;
+bool channels_initialized = false;
+/* set when our data is taken over by a new server instance or needed by the next start, which must find it in place */
+bool keep_data_on_exit = false;
+char* handoff_socket_path = NULL;
+bool handoff_live_clients = false;
 timer_t timer_id = 0;
+/* source of the connection ids, the acceptor and the handoff receiver both spawn connections */
+unsigned long connections_spawned = 0;
+char* capture_path = NULL;
+char* admin_socket_path = NULL;
 SLIST_HEAD(slist_head, list_node);
+pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct slist_head head_node;
 
@@ -60,6 +87,58 @@ void close_socket(int sd) {
     }
 }
 
+/* the thread of the node must have been joined already */
+static void free_connection(struct list_node* node) {
+    struct thread_information* t_info = node->ptr;
+    deadlines_cancel(&t_info->deadlines);
+    if (t_info->socketd) {
+        close(t_info->socketd);
+        syslog(LOG_NOTICE, "Closed connection from %s", t_info->ip_address);
+    }
+    free(t_info->ip_address);
+    free(t_info);
+    free(node);
+}
+
+/**
+ * Joins the connection threads that are done and releases their socket, stack and thread
+ * information, so a long running server doesn't hold on to every connection it ever served.
+ */
+static void reap_finished_connections(void) {
+    bool any_finished = false;
+    struct list_node* current_node = NULL;
+    pthread_mutex_lock(&thread_list_mutex);
+    SLIST_FOREACH(current_node, &head_node, nodes) {
+        if (__atomic_load_n(&current_node->ptr->finished, __ATOMIC_ACQUIRE)) {
+            any_finished = true;
+            break;
+        }
+    }
+    if (any_finished) {
+        /* terminate() walks the list from the signal handlers, keep them out while it changes */
+        sigset_t termination_signals;
+        sigset_t previous_mask;
+        sigemptyset(&termination_signals);
+        sigaddset(&termination_signals, SIGINT);
+        sigaddset(&termination_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &termination_signals, &previous_mask);
+        struct list_node* next_node = NULL;
+        SLIST_FOREACH_SAFE(current_node, &head_node, nodes, next_node) {
+            if (!__atomic_load_n(&current_node->ptr->finished, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            int ret_val = pthread_join(current_node->ptr->thread_id, NULL);
+            if (ret_val) {
+                syslog(LOG_ERR, "join error for thread ID %ld, error: %s", current_node->ptr->thread_id, strerror(ret_val));
+            }
+            SLIST_REMOVE(&head_node, current_node, list_node, nodes);
+            free_connection(current_node);
+        }
+        pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
+
 void terminate(int termination_reason) {
     if (timer_id) {
         if (timer_delete(timer_id) != 0) {
@@ -81,36 +160,33 @@ void terminate(int termination_reason) {
         if (ret_val) {
             syslog(LOG_ERR, "join error for thread ID %ld, error: %s", current_node->ptr->thread_id, strerror(ret_val));
         }
-        if (current_node->ptr->socketd) {
-            close(current_node->ptr->socketd);
-            syslog(LOG_NOTICE, "Closed connection from %s", current_node->ptr->ip_address);
-            if (current_node->ptr->ip_address) {
-                free(current_node->ptr->ip_address);
-            }
-        }
-        if (current_node->ptr->file_name) {
-            free(current_node->ptr->file_name);
-        }
 
         SLIST_REMOVE_HEAD(&head_node, nodes);
-        free(current_node->ptr);
-        free(current_node);
+        free_connection(current_node);
         current_node = NULL;
     }
 
-    if (mutex_initialized) {
-        int ret_val = pthread_mutex_destroy(&mutex);
-        if (ret_val) {
-            syslog(LOG_WARNING, "Failed to destroy mutex instance during cleanup, error: %s", strerror(ret_val));
-        }
+    syslog(LOG_NOTICE, "Server threads migrated across cores %lu times overall", affinity_total_migrations());
+    if (overload_config.target_ms) {
+        syslog(LOG_NOTICE, "Shed %lu packets under overload", overload_shed_count());
     }
     close_socket(server_socket_descriptor);
-#ifndef USE_AESD_CHAR_DEVICE
-    if (remove(output_file_path) < 0) {
-        syslog(LOG_ERR, "Failed to remove the file at %s upon termination, error: %s", output_file_path, strerror(errno));
-        exit(EXIT_FAILURE);
+    capture_close();
+    admin_cleanup();
+    handoff_cleanup();
+    rate_limit_cleanup();
+    if (prefork_is_master()) {
+        /* the data must outlive every worker still appending to it */
+        prefork_stop();
+    }
+    if (channels_initialized) {
+        /* data in a device outlives us, files are removed unless a new server takes them over */
+        struct channel* default_channel = channel_get_default();
+        bool keep_files = keep_data_on_exit || (default_channel != NULL && default_channel->is_device);
+        /* the snapshot thread writes the last snapshot, only it can wait for the channel table safely */
+        snapshot_stop(keep_files);
+        channel_table_destroy(!keep_files && !prefork_is_worker());
     }
-#endif
     exit(termination_reason);
 }
 
@@ -126,6 +202,10 @@ static void termination_handler(int signal_number) {
     }
 }
 
+/* only there to interrupt blocking calls during a handoff, see HANDOFF_SIGNAL */
+static void handoff_signal_handler(int signal_number) {
+}
+
 void setup_signal_handlers(void) {
     struct sigaction sigact;
     memset(&sigact, 0, sizeof(sigact));
@@ -138,6 +218,12 @@ void setup_signal_handlers(void) {
         syslog(LOG_ERR, "Failure when trying to register a handler for the SIGINT signal");
         exit(EXIT_FAILURE);
     }
+    /* no SA_RESTART on purpose, accept() and read() must return EINTR */
+    sigact.sa_handler = handoff_signal_handler;
+    if (sigaction(HANDOFF_SIGNAL, &sigact, NULL) != 0) {
+        syslog(LOG_ERR, "Failure when trying to register a handler for the handoff signal");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void print_usage(void) {
@@ -146,21 +232,66 @@ void print_usage(void) {
     printf("aesdsocket [-OPTION] [[value]]\n");
     printf("\t-d\t\t\tRun as daemon.\n");
     printf("\t-p <port number>\tSpecify port number.\n");
-    printf("\t-f <file>\t\tOutput file.\n");
+    printf("\t-f <file>\t\tOutput file, a regular file is removed on exit unless -s, -R or -F is given.\n");
+    printf("\t-a <cpu list>\t\tPin the acceptor thread to these CPUs (e.g. 0-1,4).\n");
+    printf("\t-w <cpu list>\t\tPin connection worker threads to these CPUs.\n");
+    printf("\t-t <cpu list>\t\tPin the flusher (time stamp) thread to these CPUs.\n");
+    printf("\t-i\t\t\tRun each connection on the CPU that received it (SO_INCOMING_CPU).\n");
+    printf("\t-u <socket path>\tHot upgrade: take over from the server listening on this UNIX socket, then listen on it.\n");
+    printf("\t-l\t\t\tOn hot upgrade, also take over the live client connections.\n");
+    printf("\t-n\t\t\tPlain socket writes, no corking nor send buffer tuning.\n");
+    printf("\t-T <idle>,<header>,<packet>\tConnection timeouts in seconds (0 disables): silence while waiting\n\t\t\t\tfor bytes, first packet after connecting, first byte to end of a packet.\n");
+    printf("\t-s <seconds>\t\tSnapshot the channel indexes this often and on shutdown, for fast restarts.\n");
+    printf("\t-r <packets/s>,<bytes/s>\tRate limit each client address (0 leaves that limit off).\n");
+    printf("\t-c <packets/s>,<bytes/s>\tRate limit each channel across all its clients.\n");
+    printf("\t-m <bytes>\t\tMemory a connection may use per packet, larger packets are staged in %s (0 for no cap).\n", STAGING_DIRECTORY);
+    printf("\t-R <port|host:port|path>\tServe replicas on this TCP address or UNIX socket path.\n");
+    printf("\t-F <host:port|path>\tRun as a read-only replica of the primary at this address.\n");
+    printf("\t-P <workers>\t\tServe from this many worker processes sharing the channel files (not with a device).\n");
+    printf("\t-H\t\t\tKeep what the device evicts in cold segments (%s%s.*), dumps send the whole history.\n", CHANNEL_FALLBACK_PATH, TIER_SEGMENT_SUFFIX);
+    printf("\t-C\t\t\tChecksum every record stored in a file, a torn tail is cut off on start.\n");
+    printf("\t-B\t\t\tCombine concurrent appends to a channel into one write and sync, replies may then\n\t\t\t\talso hold the packets combined with theirs (not with -P, -H nor -N).\n");
+    printf("\t-k <file>\t\tCapture the incoming traffic to this file, for aesdreplay.\n");
+    printf("\t-S <n>\t\t\tTrace the phases of one request out of n, SIGUSR1 dumps them to %s for aesdphases.\n", PHASE_TRACE_DIRECTORY);
+    printf("\t-A <socket path>\tTake get/set commands for the tunables on this UNIX socket, per worker with -P\n\t\t\t\t(<path>.<worker>). SIGTTIN/SIGTTOU add or retire a worker.\n");
+    printf("\t-N <file>[,<file>...]\tStripe the default channel over these files or devices too, each with its own lock.\n");
+    printf("\t-M <connection|packet>\tWith -N, pick the shard per connection (default) or per packet hash.\n");
+    printf("\t-O <target ms>[,<interval ms>]\tShed packets with %.*s and pause accepting while lock queueing stays\n\t\t\t\tabove target for an interval (CoDel, %d,%d is a good start).\n",
+           (int)strlen(OVERLOAD_BUSY_REPLY) - 1, OVERLOAD_BUSY_REPLY, OVERLOAD_TARGET_MS_DEFAULT, OVERLOAD_INTERVAL_MS_DEFAULT);
+    printf("\t-b <us>\t\t\tBusy poll: spin this long on reads, accepts and the channel lock before blocking\n\t\t\t\t(%d is a good start), with -w and -a on cores of their own.\n", BUSY_POLL_US_DEFAULT);
+    printf("\t-Z <bytes>\t\tSend response chunks of at least this size with MSG_ZEROCOPY (%d is a good start).\n", ZEROCOPY_THRESHOLD_DEFAULT);
 }
 
 enum program_parameters {
     NONE,
     RUN_AS_DAEMON,
     PORT_NUMBER,
-    OUTPUT_FILE
+    OUTPUT_FILE,
+    ACCEPTOR_CPUS,
+    WORKER_CPUS,
+    FLUSHER_CPUS,
+    HANDOFF_SOCKET,
+    SNAPSHOT_INTERVAL,
+    TIMEOUTS,
+    CLIENT_RATE,
+    CHANNEL_RATE,
+    MEMORY_CAP,
+    REPLICA_LISTEN,
+    PRIMARY_ADDRESS,
+    PREFORK_WORKERS,
+    ZEROCOPY_THRESHOLD,
+    CAPTURE_FILE,
+    TRACE_SAMPLING,
+    ADMIN_SOCKET,
+    SHARD_PATHS,
+    SHARD_ROUTING,
+    OVERLOAD_CONTROL,
+    BUSY_POLL
 };
 
-#ifndef USE_AESD_CHAR_DEVICE
-
 static void timer_thread_run_function(union sigval sigval) {
-    struct thread_information* thread_info = (struct thread_information*)sigval.sival_ptr;
-    if (pthread_mutex_lock(thread_info->mutex_ptr) != 0) {
+    struct channel* channel = (struct channel*)sigval.sival_ptr;
+    if (pthread_mutex_lock(&channel->mutex) != 0) {
     	syslog(LOG_ERR, "Time stamp thread could not lock output file for writing, error: %s", strerror(errno));
     }
     else {
@@ -175,24 +306,150 @@ static void timer_thread_run_function(union sigval sigval) {
         if (ret_val == 0) {
             syslog(LOG_ERR, "Failed to get formatted time stamp string, error: %s", strerror(ret_val));
         }
-        ret_val = dump_buffer_to_file(time_stamp_str, ret_val, thread_info->filed);
-        if (ret_val) {
-            syslog(LOG_ERR, "Could not write time stamp to output file, error: %s", strerror(ret_val));
-            //thread_info->thread_return_value = EXIT_FAILURE;
-            //pthread_exit(&thread_info->thread_return_value);
+        int filed = open(channel->file_name, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+        if (filed < 0) {
+            syslog(LOG_ERR, "Could not open output file at %s to time stamp it, error: %s", channel->file_name, strerror(errno));
+        }
+        else {
+            size_t time_stamp_length = ret_val;
+            ret_val = channel_append(channel, filed, time_stamp_str, time_stamp_length);
+            if (ret_val) {
+                syslog(LOG_ERR, "Could not write time stamp to output file, error: %s", strerror(ret_val));
+            }
+            AESD_PROBE2(timer__fired, channel->name, time_stamp_length);
+            close(filed);
         }
 
-    	if (pthread_mutex_unlock(thread_info->mutex_ptr) != 0) {
+    	if (pthread_mutex_unlock(&channel->mutex) != 0) {
     	    syslog(LOG_ERR, "Time stamp thread could not unlock output file... server will likely lock up, error: %s", strerror(errno));
     	}
     }
 }
 
-#endif
+int spawn_connection_thread(int conn_socket, const char* remote_ip_address, struct channel* channel) {
+    /* using calloc here cause it actually initializes the allocated memory */
+    struct thread_information* t_info = calloc(1, sizeof(struct thread_information));
+    if (t_info == NULL) {
+        syslog(LOG_ERR, "Failed to allocate memory for the thread information structure, error: %s", strerror(errno));
+        return ENOMEM;
+    }
+    t_info->ip_address = calloc(1, strlen(remote_ip_address) + 1);
+    if (t_info->ip_address == NULL) {
+        syslog(LOG_ERR, "Failed to allocate memory to store the IP address of the remote party, error: %s", strerror(errno));
+        free(t_info);
+        return ENOMEM;
+    }
+    strcpy(t_info->ip_address, remote_ip_address);
+    t_info->socketd = conn_socket;
+    t_info->channel = channel;
+    t_info->connection_id = __atomic_add_fetch(&connections_spawned, 1, __ATOMIC_RELAXED);
+
+    /* if everything is fine, add the thread to the list */
+    struct list_node* t_node = calloc(1, sizeof(struct list_node));
+    if (t_node == NULL) {
+        syslog(LOG_ERR, "Could not allocate memory to hold the list node for the thread just spawned, error: %s", strerror(errno));
+        free(t_info->ip_address);
+        free(t_info);
+        return ENOMEM;
+    }
+    t_node->ptr = t_info;
+
+    /* spawn thread on its CPU set, check for errors */
+    pthread_attr_t worker_attr;
+    cpu_set_t worker_cpus;
+    pthread_attr_init(&worker_attr);
+    if (worker_cpu_for_socket(conn_socket, &worker_cpus) == 0) {
+        set_thread_attr_affinity(&worker_attr, &worker_cpus);
+    }
+    /* connections can also come in from the handoff receiver thread */
+    pthread_mutex_lock(&thread_list_mutex);
+    int ret_val = pthread_create(&t_info->thread_id, &worker_attr, thread_run_function, t_info);
+    if (ret_val == 0) {
+        SLIST_INSERT_HEAD(&head_node, t_node, nodes);
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+    pthread_attr_destroy(&worker_attr);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn thread for incoming connection, error: %s", strerror(ret_val));
+        free(t_info->ip_address);
+        free(t_info);
+        free(t_node);
+    }
+    return ret_val;
+}
+
+/* a live connection handed over by the server we are replacing */
+static void handoff_client_received(int socketd, const char* ip_address, const char* channel_name) {
+    struct channel* channel = channel_get_or_create(channel_name);
+    if (channel == NULL) {
+        channel = channel_get_default();
+    }
+    syslog(LOG_NOTICE, "Took over connection from %s", ip_address);
+    if (spawn_connection_thread(socketd, ip_address, channel)) {
+        close(socketd);
+    }
+}
+
+/**
+ * Our listening socket now belongs to a new server: let the in-flight packets complete (or hand
+ * the connections over if the new server asked for them) and exit, keeping the data in place.
+ */
+static void drain_after_handoff(void) {
+    struct timespec deadline;
+    struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+    bool pass_clients = handoff_clients_wanted();
+
+    syslog(LOG_NOTICE, "Draining connections before handing over to the new server");
+    if (timer_id) {
+        if (timer_delete(timer_id) != 0) {
+            syslog(LOG_ERR, "Error while canceling time stamp timer, error: %s", strerror(errno));
+        }
+        timer_id = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += HANDOFF_DRAIN_TIMEOUT_SEC;
+    while (true) {
+        bool all_done = true;
+        struct list_node* current_node = NULL;
+        pthread_mutex_lock(&thread_list_mutex);
+        SLIST_FOREACH(current_node, &head_node, nodes) {
+            if (__atomic_load_n(&current_node->ptr->finished, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            all_done = false;
+            if (pass_clients) {
+                /* kick the thread out of its blocking read, it passes the socket on between packets */
+                __atomic_store_n(&current_node->ptr->handoff_requested, true, __ATOMIC_RELEASE);
+                pthread_kill(current_node->ptr->thread_id, HANDOFF_SIGNAL);
+            }
+        }
+        pthread_mutex_unlock(&thread_list_mutex);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (all_done) {
+            break;
+        }
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+            syslog(LOG_WARNING, "Drain timeout expired, dropping the remaining connections");
+            break;
+        }
+        nanosleep(&poll_interval, NULL);
+    }
+
+    handoff_finish();
+    keep_data_on_exit = true;
+    terminate(EXIT_SUCCESS);
+}
 
 int main(int argc, char* argv[]) {
 
     bool running_as_daemon = false;
+    unsigned int snapshot_interval = 0;
+    char* replica_listen_address = NULL;
+    char* primary_address = NULL;
+    unsigned int prefork_workers = 0;
     int opt_val = 1;
     int server_port = 9000;
     SLIST_INIT(&head_node);
@@ -221,6 +478,136 @@ int main(int argc, char* argv[]) {
                     last_parameter = OUTPUT_FILE;
                     arg_idx++;
                 }
+                else if (strcmp(argv[arg_idx], "-a") == 0) {
+                    reading_value = true;
+                    last_parameter = ACCEPTOR_CPUS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-w") == 0) {
+                    reading_value = true;
+                    last_parameter = WORKER_CPUS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-t") == 0) {
+                    reading_value = true;
+                    last_parameter = FLUSHER_CPUS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-i") == 0) {
+                    reading_value = false;
+                    affinity_config.steer_to_incoming_cpu = true;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-u") == 0) {
+                    reading_value = true;
+                    last_parameter = HANDOFF_SOCKET;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-s") == 0) {
+                    reading_value = true;
+                    last_parameter = SNAPSHOT_INTERVAL;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-T") == 0) {
+                    reading_value = true;
+                    last_parameter = TIMEOUTS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-r") == 0) {
+                    reading_value = true;
+                    last_parameter = CLIENT_RATE;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-c") == 0) {
+                    reading_value = true;
+                    last_parameter = CHANNEL_RATE;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-m") == 0) {
+                    reading_value = true;
+                    last_parameter = MEMORY_CAP;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-R") == 0) {
+                    reading_value = true;
+                    last_parameter = REPLICA_LISTEN;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-F") == 0) {
+                    reading_value = true;
+                    last_parameter = PRIMARY_ADDRESS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-P") == 0) {
+                    reading_value = true;
+                    last_parameter = PREFORK_WORKERS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-Z") == 0) {
+                    reading_value = true;
+                    last_parameter = ZEROCOPY_THRESHOLD;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-k") == 0) {
+                    reading_value = true;
+                    last_parameter = CAPTURE_FILE;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-A") == 0) {
+                    reading_value = true;
+                    last_parameter = ADMIN_SOCKET;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-b") == 0) {
+                    reading_value = true;
+                    last_parameter = BUSY_POLL;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-O") == 0) {
+                    reading_value = true;
+                    last_parameter = OVERLOAD_CONTROL;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-N") == 0) {
+                    reading_value = true;
+                    last_parameter = SHARD_PATHS;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-M") == 0) {
+                    reading_value = true;
+                    last_parameter = SHARD_ROUTING;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-S") == 0) {
+                    reading_value = true;
+                    last_parameter = TRACE_SAMPLING;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-H") == 0) {
+                    reading_value = false;
+                    tiered_storage_enabled = true;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-C") == 0) {
+                    reading_value = false;
+                    record_frames_enabled = true;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-B") == 0) {
+                    reading_value = false;
+                    combine_appends = true;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-n") == 0) {
+                    reading_value = false;
+                    send_policy_enabled = false;
+                    arg_idx++;
+                }
+                else if (strcmp(argv[arg_idx], "-l") == 0) {
+                    reading_value = false;
+                    handoff_live_clients = true;
+                    arg_idx++;
+                }
                 else {
                     print_usage();
                     exit(EXIT_FAILURE);
@@ -240,6 +627,138 @@ int main(int argc, char* argv[]) {
                         last_parameter = NONE;
                         arg_idx++;
                         break;
+                    case ACCEPTOR_CPUS:
+                    case WORKER_CPUS:
+                    case FLUSHER_CPUS: {
+                        cpu_set_t* set = last_parameter == ACCEPTOR_CPUS ? &affinity_config.acceptor_cpus :
+                                         last_parameter == WORKER_CPUS ? &affinity_config.worker_cpus : &affinity_config.flusher_cpus;
+                        if (parse_cpu_list(argv[arg_idx], set)) {
+                            printf("Invalid CPU list %s\n", argv[arg_idx]);
+                            print_usage();
+                            exit(EXIT_FAILURE);
+                        }
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    }
+                    case HANDOFF_SOCKET:
+                        handoff_socket_path = argv[arg_idx];
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case TIMEOUTS:
+                        if (parse_timeouts(argv[arg_idx], &timeout_config)) {
+                            printf("Invalid timeouts %s\n", argv[arg_idx]);
+                            print_usage();
+                            exit(EXIT_FAILURE);
+                        }
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case CLIENT_RATE:
+                    case CHANNEL_RATE:
+                        if (parse_rate_limits(argv[arg_idx], last_parameter == CLIENT_RATE ? &client_rate_limits : &channel_rate_limits)) {
+                            printf("Invalid rate limits %s\n", argv[arg_idx]);
+                            print_usage();
+                            exit(EXIT_FAILURE);
+                        }
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case MEMORY_CAP:
+                        ingest_memory_cap = strtoul(argv[arg_idx], NULL, 10);
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case ZEROCOPY_THRESHOLD:
+                        zerocopy_threshold = strtoul(argv[arg_idx], NULL, 10);
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case CAPTURE_FILE:
+                        capture_path = argv[arg_idx];
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case ADMIN_SOCKET:
+                        admin_socket_path = argv[arg_idx];
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case BUSY_POLL:
+                        busy_poll_us = strtoul(argv[arg_idx], NULL, 10);
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case OVERLOAD_CONTROL:
+                        if (overload_parse(argv[arg_idx], &overload_config)) {
+                            print_usage();
+                            exit(EXIT_FAILURE);
+                        }
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case SHARD_PATHS:
+                        shard_paths = argv[arg_idx];
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case SHARD_ROUTING:
+                        if (strcmp(argv[arg_idx], "connection") == 0) {
+                            shard_routing = SHARD_BY_CONNECTION;
+                        }
+                        else if (strcmp(argv[arg_idx], "packet") == 0) {
+                            shard_routing = SHARD_BY_PACKET;
+                        }
+                        else {
+                            print_usage();
+                            exit(EXIT_FAILURE);
+                        }
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case TRACE_SAMPLING:
+                        phase_trace_sample_every = strtoul(argv[arg_idx], NULL, 10);
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case REPLICA_LISTEN:
+                        replica_listen_address = argv[arg_idx];
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case PRIMARY_ADDRESS:
+                        primary_address = argv[arg_idx];
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case PREFORK_WORKERS:
+                        prefork_workers = atoi(argv[arg_idx]);
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
+                    case SNAPSHOT_INTERVAL:
+                        snapshot_interval = atoi(argv[arg_idx]);
+                        reading_value = false;
+                        last_parameter = NONE;
+                        arg_idx++;
+                        break;
                     default:
                         print_usage();
                         exit(EXIT_FAILURE);
@@ -251,32 +770,71 @@ int main(int argc, char* argv[]) {
             printf("Found argument %s at position %d\n", argv[arg_idx], arg_idx);
         }
     }
+    /* workers are forked from a single process, there's no single process to hand over nor to replicate */
+    if (prefork_workers && (handoff_socket_path != NULL || replica_listen_address != NULL || primary_address != NULL)) {
+        printf("Prefork mode can't be combined with hot upgrades nor replication\n");
+        exit(EXIT_FAILURE);
+    }
+    /* connection ids are only unique within a process, a trace comes from a single one */
+    if (prefork_workers && capture_path != NULL) {
+        printf("Prefork mode can't be combined with traffic capture\n");
+        exit(EXIT_FAILURE);
+    }
+    /* shards are striped within one process, and a replica follows a single file per channel */
+    if (shard_paths != NULL && (prefork_workers || tiered_storage_enabled || replica_listen_address != NULL || primary_address != NULL)) {
+        printf("Sharding can't be combined with prefork mode, tiered storage nor replication\n");
+        exit(EXIT_FAILURE);
+    }
+    /* snapshots only pay off on the next start, and replicas resume from the offsets they reached */
+    if (snapshot_interval || replica_listen_address != NULL || primary_address != NULL) {
+        keep_data_on_exit = true;
+    }
+    /* workers serialize appends through the shared log of a file, nothing locks a device across processes */
+    struct stat output_stat;
+    if (prefork_workers && stat(output_file_path, &output_stat) == 0 && S_ISCHR(output_stat.st_mode)) {
+        printf("Prefork mode needs a regular file, %s is a device\n", output_file_path);
+        exit(EXIT_FAILURE);
+    }
+    /* the cold tier has a single spill thread appending to the segments */
+    if (prefork_workers && tiered_storage_enabled) {
+        printf("Prefork mode can't be combined with tiered storage\n");
+        exit(EXIT_FAILURE);
+    }
     
     setup_signal_handlers();
     
     syslog(LOG_NOTICE, "%s as a daemon, on port number %d, dumping to file %s", running_as_daemon ? "Running" : "Not running" , server_port, output_file_path);
 
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        syslog(LOG_ERR, "Failed to open server socket: %d", errno);
-        terminate(EXIT_FAILURE);
-    }
-    
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt_val, sizeof(opt_val)) < 0) {
-        syslog(LOG_ERR, "Failed to set socket options: %d", errno);
-        terminate(EXIT_FAILURE);	
-    }
-    
     struct sockaddr_in address;
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(server_port);
     unsigned int addr_length = sizeof(address);
+
+    /* on a hot upgrade the running server hands us its listening socket, nothing to bind */
+    int socket_fd = -1;
+    bool handed_over = false;
+    if (handoff_socket_path != NULL && handoff_acquire(handoff_socket_path, handoff_live_clients, &socket_fd) == 0) {
+        handed_over = true;
+    }
+
+    if (!handed_over) {
+        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (socket_fd < 0) {
+            syslog(LOG_ERR, "Failed to open server socket: %d", errno);
+            terminate(EXIT_FAILURE);
+        }
         
-    if (bind(socket_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        syslog(LOG_ERR, "Socket bind failed: %d", errno);
-        terminate(EXIT_FAILURE);
+        if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt_val, sizeof(opt_val)) < 0) {
+            syslog(LOG_ERR, "Failed to set socket options: %d", errno);
+            terminate(EXIT_FAILURE);	
+        }
+            
+        if (bind(socket_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            syslog(LOG_ERR, "Socket bind failed: %d", errno);
+            terminate(EXIT_FAILURE);
+        }
     }
     
     /* Here is where we need to check if we should be running as a daemon */
@@ -342,106 +900,136 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    if (listen(socket_fd, 1) < 0) {
+    if (!handed_over && listen(socket_fd, listen_backlog) < 0) {
         syslog(LOG_ERR, "Socket listen failed: %d", errno);
         terminate(EXIT_FAILURE);
     }
             
+    /* the acceptor is the main thread, worker threads get their placement at creation time */
+    if (pin_current_thread(&affinity_config.acceptor_cpus)) {
+        terminate(EXIT_FAILURE);
+    }
+
     int conn_socket = 0;
-    int ret_val = pthread_mutex_init(&mutex, NULL);
+    if (prefork_workers) {
+        shared_log_owner = getpid();
+    }
+    int ret_val = channel_table_init(output_file_path);
     if (ret_val) {
-        syslog(LOG_ERR, "Error while creating the mutex instance, error: %s", strerror(ret_val));
+        syslog(LOG_ERR, "Error while creating the default channel, error: %s", strerror(ret_val));
         terminate(EXIT_FAILURE);
     }
-    mutex_initialized = true;
-
-#ifndef USE_AESD_CHAR_DEVICE
-
-    /* create thread to start dumping timestamps in output file */
-    struct sigevent sev = {0};
-    struct thread_information timer_thread_info;
-    memset(&timer_thread_info, 0, sizeof(struct thread_information));
-    timer_thread_info.filed = fd;
-    timer_thread_info.mutex_ptr = &mutex;
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_value.sival_ptr = &timer_thread_info;
-    sev.sigev_notify_function = timer_thread_run_function;
-
-    struct itimerspec its = {0};
-    its.it_value.tv_sec = 1;
-    its.it_interval.tv_sec = 10;
-
-    if (timer_create(CLOCK_REALTIME, &sev, &timer_id) !=0 ) {
-        syslog(LOG_ERR, "Could not create timestamp timer object, error: %s", strerror(errno));
+    channels_initialized = true;
+    if (shard_paths != NULL && (ret_val = channel_table_shard(shard_paths, shard_routing)) != 0) {
+        syslog(LOG_ERR, "Error while sharding the default channel, error: %s", strerror(ret_val));
         terminate(EXIT_FAILURE);
     }
-    // fire timer
-    ret_val = timer_settime(timer_id, 0, &its, NULL);
-    if (ret_val != 0) {
-        syslog(LOG_ERR, "Failed to start time stamp time, error: %s", strerror(errno));
+    /* from here on we're one of the workers, the master never returns */
+    if (prefork_workers && prefork_start(prefork_workers)) {
+        terminate(EXIT_FAILURE);
+    }
+    if (snapshot_interval && prefork_is_leader() && snapshot_start(snapshot_interval)) {
+        terminate(EXIT_FAILURE);
+    }
+    if (timeouts_enabled() && timer_wheel_start()) {
+        terminate(EXIT_FAILURE);
+    }
+    if (capture_path != NULL && capture_open(capture_path)) {
+        terminate(EXIT_FAILURE);
+    }
+    if (phase_trace_sample_every && phase_trace_start()) {
+        terminate(EXIT_FAILURE);
+    }
+    if (admin_socket_path != NULL) {
+        char worker_admin_path[PATH_MAX];
+        /* every worker has its own tunables, and its own socket to change them */
+        if (prefork_is_worker()) {
+            snprintf(worker_admin_path, sizeof(worker_admin_path), "%s.%d", admin_socket_path, prefork_worker_index());
+        }
+        else {
+            snprintf(worker_admin_path, sizeof(worker_admin_path), "%s", admin_socket_path);
+        }
+        if (admin_start(worker_admin_path, socket_fd)) {
+            terminate(EXIT_FAILURE);
+        }
+    }
+    if (primary_address != NULL && replication_follow(primary_address)) {
+        terminate(EXIT_FAILURE);
+    }
+    if (replica_listen_address != NULL && replication_serve(replica_listen_address)) {
         terminate(EXIT_FAILURE);
     }
-#endif
 
-    while ((conn_socket = accept(socket_fd, (struct sockaddr*)&address, (socklen_t*)&addr_length)) > 0) {
-        char* remote_ip_address = inet_ntoa(address.sin_addr);
-        syslog(LOG_NOTICE, "Accepted connection from %s", remote_ip_address);
-        
-        /* using calloc here cause it actually initializes the allocated memory */
-        struct thread_information* t_info = calloc(1, sizeof(struct thread_information));
-        if (t_info == NULL) {
-            syslog(LOG_ERR, "Failed to allocate memory for the thread information structure, error: %s", strerror(errno));
+    /* time stamps go to files only, a replica gets them from the primary like any other record, workers from the leader */
+    if (!channel_get_default()->is_device && !replication_is_replica() && prefork_is_leader()) {
+        /* create thread to start dumping timestamps in output file */
+        struct sigevent sev = {0};
+        pthread_attr_t flusher_attr;
+        pthread_attr_init(&flusher_attr);
+        if (set_thread_attr_affinity(&flusher_attr, &affinity_config.flusher_cpus)) {
             terminate(EXIT_FAILURE);
         }
-        t_info->ip_address = calloc(1, strlen(remote_ip_address) + 1);
-        if (t_info->ip_address == NULL) {
-            syslog(LOG_ERR, "Failed to allocate memory to store the IP address of the remote party, error: %s", strerror(errno));
-            free(t_info);
+        sev.sigev_notify = SIGEV_THREAD;
+        sev.sigev_notify_attributes = &flusher_attr;
+        sev.sigev_value.sival_ptr = channel_get_default();
+        sev.sigev_notify_function = timer_thread_run_function;
+
+        struct itimerspec its = {0};
+        its.it_value.tv_sec = 1;
+        its.it_interval.tv_sec = 10;
+
+        if (timer_create(CLOCK_REALTIME, &sev, &timer_id) !=0 ) {
+            syslog(LOG_ERR, "Could not create timestamp timer object, error: %s", strerror(errno));
             terminate(EXIT_FAILURE);
         }
-        strcpy(t_info->ip_address, remote_ip_address);
-        t_info->socketd = conn_socket;
-        t_info->file_name = calloc(1, strlen(output_file_path) + 1);
-        if (t_info->file_name == NULL) {
-            syslog(LOG_ERR, "Failed to allocate memory to store the file name of output file, error: %s", strerror(errno));
-            free(t_info->ip_address);
-            free(t_info);
+        // fire timer
+        ret_val = timer_settime(timer_id, 0, &its, NULL);
+        if (ret_val != 0) {
+            syslog(LOG_ERR, "Failed to start time stamp time, error: %s", strerror(errno));
             terminate(EXIT_FAILURE);
         }
-        strcpy(t_info->file_name, output_file_path);
-        t_info->mutex_ptr = &mutex;
+    }
 
-        /* spawn thread, check for errors */
-        int ret_val = pthread_create(&t_info->thread_id, NULL, thread_run_function, t_info);
-        if (ret_val) {
-            syslog(LOG_ERR, "Could not spawn thread for incoming connection, error: %s", strerror(ret_val));
-            free(t_info->ip_address);
-            free(t_info->file_name);
-            free(t_info);
-            terminate(EXIT_FAILURE);
+    if (handoff_socket_path != NULL) {
+        /* the handoff socket now serves our successor */
+        if (handed_over) {
+            handoff_start_receiver(handoff_client_received, socket_fd, pthread_self());
         }
+        else {
+            handoff_listen(handoff_socket_path, socket_fd, pthread_self());
+        }
+    }
 
-        /* if everything is fine, add the thread to the list */
-        struct list_node* t_node = calloc(1, sizeof(struct list_node));
-        if (t_node == NULL) {
-            syslog(LOG_ERR, "Could not allocate memory to hold the list node for the thread just spawned, error: %s", strerror(errno));
-            /* kill thread just created */
-            /* kill all threads */
-            free(t_info->ip_address);
-            free(t_info->file_name);
-            free(t_info);
+    while (!handoff_requested()) {
+        overload_wait_to_accept();
+        busy_poll_wait_readable(socket_fd);
+        if (handoff_requested()) {
+            break;
+        }
+        conn_socket = accept(socket_fd, (struct sockaddr*)&address, (socklen_t*)&addr_length);
+        if (conn_socket < 0) {
+            if (errno == EINTR && !handoff_requested()) {
+                continue;
+            }
+            break;
+        }
+        reap_finished_connections();
+        char* remote_ip_address = inet_ntoa(address.sin_addr);
+        syslog(LOG_NOTICE, "Accepted connection from %s", remote_ip_address);
+        if (spawn_connection_thread(conn_socket, remote_ip_address, channel_get_default())) {
             terminate(EXIT_FAILURE);
         }
-        t_node->ptr = t_info;
-        SLIST_INSERT_HEAD(&head_node, t_node, nodes);
-
     }
+    handoff_acceptor_stopped();
 
     if (close(socket_fd) < 0) {
         syslog(LOG_ERR, "Shutdown failed on server socket: %d", errno);
         terminate(EXIT_FAILURE);
     }
+
+    if (handoff_requested()) {
+        drain_after_handoff();
+    }
     
     terminate(EXIT_SUCCESS);
 }
-
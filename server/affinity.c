@@ -0,0 +1,113 @@
+#include "affinity.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+struct affinity_config affinity_config;
+static unsigned long total_migrations = 0;
+
+/* parses lists such as "0-3,6,8-9" into a CPU set */
+int parse_cpu_list(const char* list, cpu_set_t* set) {
+    const char* ptr = list;
+    char* end = NULL;
+
+    CPU_ZERO(set);
+    while (*ptr != '\0') {
+        long first = strtol(ptr, &end, 10);
+        if (end == ptr || first < 0 || first >= CPU_SETSIZE) {
+            return EINVAL;
+        }
+        long last = first;
+        ptr = end;
+        if (*ptr == '-') {
+            ptr++;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr || last < first || last >= CPU_SETSIZE) {
+                return EINVAL;
+            }
+            ptr = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*ptr == ',') {
+            ptr++;
+        }
+        else if (*ptr != '\0') {
+            return EINVAL;
+        }
+    }
+    return CPU_COUNT(set) ? 0 : EINVAL;
+}
+
+int pin_current_thread(const cpu_set_t* set) {
+    if (CPU_COUNT(set) == 0) {
+        return 0;
+    }
+    int ret_val = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not pin thread ID %ld to its CPU set, error: %s", pthread_self(), strerror(ret_val));
+    }
+    return ret_val;
+}
+
+int set_thread_attr_affinity(pthread_attr_t* attr, const cpu_set_t* set) {
+    if (CPU_COUNT(set) == 0) {
+        return 0;
+    }
+    int ret_val = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), set);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not set CPU affinity on thread attributes, error: %s", strerror(ret_val));
+    }
+    return ret_val;
+}
+
+/**
+ * Picks the CPU set a connection thread should run on: the CPU that processed the incoming
+ * packets of the connection if steering is enabled (and that CPU is allowed for workers),
+ * the configured worker set otherwise.
+ */
+int worker_cpu_for_socket(int socketd, cpu_set_t* set) {
+    *set = affinity_config.worker_cpus;
+    if (!affinity_config.steer_to_incoming_cpu) {
+        return 0;
+    }
+
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(socketd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) {
+        syslog(LOG_WARNING, "Could not read the incoming CPU of the connection, error: %s", strerror(errno));
+        return errno;
+    }
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return 0;
+    }
+    if (CPU_COUNT(&affinity_config.worker_cpus) && !CPU_ISSET(cpu, &affinity_config.worker_cpus)) {
+        syslog(LOG_DEBUG, "Incoming CPU %d is outside of the worker CPU set, not steering", cpu);
+        return 0;
+    }
+    CPU_ZERO(set);
+    CPU_SET(cpu, set);
+    return 0;
+}
+
+void cpu_tracker_init(struct cpu_tracker* tracker) {
+    tracker->last_cpu = sched_getcpu();
+    tracker->migrations = 0;
+}
+
+/* call once per packet, counts a migration each time the thread shows up on a different CPU */
+void cpu_tracker_sample(struct cpu_tracker* tracker) {
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && tracker->last_cpu >= 0 && cpu != tracker->last_cpu) {
+        tracker->migrations++;
+        __atomic_add_fetch(&total_migrations, 1, __ATOMIC_RELAXED);
+    }
+    tracker->last_cpu = cpu;
+}
+
+unsigned long affinity_total_migrations(void) {
+    return __atomic_load_n(&total_migrations, __ATOMIC_RELAXED);
+}
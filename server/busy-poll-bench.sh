@@ -0,0 +1,35 @@
+#!/bin/sh
+
+# Description: compares the response latency of the default mode and of busy polling (-b) on loopback, run after make
+# Spinning only pays off with cores to spare, and every request is logged, so have a syslog daemon
+# running (without one each line goes to the console) or lower the log_level through the admin socket.
+
+AESDSOCKET=${AESDSOCKET:-./aesdsocket}
+AESDLATENCY=${AESDLATENCY:-./aesdlatency}
+BENCH_PORT=${BENCH_PORT:-9100}
+BENCH_SPIN_US=${BENCH_SPIN_US:-200}
+# on tmpfs the fsync of every append is free, what's left to measure is mostly wakeups
+BENCH_DIR=${BENCH_DIR:-/dev/shm}
+# cores the server gets to itself in both runs, e.g. "2-3", keep the producers off them; empty leaves it unpinned
+BENCH_CPUS=${BENCH_CPUS:-}
+BENCH_ARGS=${BENCH_ARGS:--c 1 -n 2000 -i 1000}
+
+run() {
+    mode=$1
+    shift
+    data=$(mktemp -p "$BENCH_DIR")
+    if [ -n "$BENCH_CPUS" ]; then
+        set -- "$@" -a "$BENCH_CPUS" -w "$BENCH_CPUS"
+    fi
+    $AESDSOCKET -p "$BENCH_PORT" -f "$data" "$@" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    echo "$mode:"
+    $AESDLATENCY -p "$BENCH_PORT" $BENCH_ARGS
+    kill $pid
+    wait $pid
+    rm -f "$data"
+}
+
+run default
+run "busy poll ($BENCH_SPIN_US us)" -b "$BENCH_SPIN_US"
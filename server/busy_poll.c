@@ -0,0 +1,71 @@
+#include "busy_poll.h"
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+unsigned int busy_poll_us = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* tells the core this is a spin loop, so a sibling hyperthread gets the pipeline meanwhile */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+uint64_t busy_poll_deadline(void) {
+    unsigned int spin_us = __atomic_load_n(&busy_poll_us, __ATOMIC_RELAXED);
+    return spin_us ? now_ns() + spin_us * 1000ULL : 0;
+}
+
+bool busy_poll_spin(uint64_t deadline) {
+    if (deadline == 0 || now_ns() >= deadline) {
+        return false;
+    }
+    cpu_relax();
+    return true;
+}
+
+void busy_poll_socket(int socketd) {
+#ifdef SO_BUSY_POLL
+    int spin_us = (int)__atomic_load_n(&busy_poll_us, __ATOMIC_RELAXED);
+    /* above net.core.busy_read it takes CAP_NET_ADMIN, the reads still spin in user space without it */
+    if (spin_us && setsockopt(socketd, SOL_SOCKET, SO_BUSY_POLL, &spin_us, sizeof(spin_us)) < 0) {
+        syslog(LOG_DEBUG, "Could not set SO_BUSY_POLL on the connection, error: %s", strerror(errno));
+    }
+#endif
+}
+
+ssize_t busy_poll_read(int socketd, void* buf, size_t size) {
+    uint64_t deadline = busy_poll_deadline();
+    if (deadline) {
+        do {
+            ssize_t read_bytes = recv(socketd, buf, size, MSG_DONTWAIT);
+            if (read_bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                return read_bytes;
+            }
+        } while (busy_poll_spin(deadline));
+    }
+    return read(socketd, buf, size);
+}
+
+void busy_poll_wait_readable(int fd) {
+    uint64_t deadline = busy_poll_deadline();
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (busy_poll_spin(deadline)) {
+        if (poll(&pfd, 1, 0) != 0) {
+            return;
+        }
+    }
+}
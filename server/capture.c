@@ -0,0 +1,72 @@
+#include "capture.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+/* stays NULL unless -k was given, every connection thread shares the one stream */
+static FILE* capture_file = NULL;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+
+int capture_open(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        syslog(LOG_ERR, "Could not create capture file %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+    /* large buffer, the connection threads only pay for a memcpy most of the time */
+    setvbuf(file, NULL, _IOFBF, 256 * 1024);
+    struct capture_header header = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        syslog(LOG_ERR, "Could not write capture file header, error: %s", strerror(errno));
+        fclose(file);
+        return EIO;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &capture_start);
+    __atomic_store_n(&capture_file, file, __ATOMIC_RELEASE);
+    syslog(LOG_NOTICE, "Capturing incoming traffic to %s", path);
+    return 0;
+}
+
+void capture_record(enum capture_event_type type, unsigned long connection_id, const char* payload, size_t payload_size, size_t length) {
+    if (__atomic_load_n(&capture_file, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct capture_event event = {
+        .time_ns = (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL + now.tv_nsec - capture_start.tv_nsec,
+        .connection_id = connection_id,
+        .type = type,
+        .captured = payload_size < CAPTURE_PAYLOAD_MAX ? payload_size : CAPTURE_PAYLOAD_MAX,
+        .length = length
+    };
+    /* a connection cancelled halfway through must not leave the stream locked for the others */
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL) {
+        if (fwrite(&event, sizeof(event), 1, capture_file) != 1 ||
+            (event.captured && fwrite(payload, event.captured, 1, capture_file) != 1)) {
+            syslog(LOG_ERR, "Could not write to the capture file, capture stopped, error: %s", strerror(errno));
+            fclose(capture_file);
+            __atomic_store_n(&capture_file, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+}
+
+void capture_close(void) {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL) {
+        if (fclose(capture_file) != 0) {
+            syslog(LOG_ERR, "Could not flush the capture file, error: %s", strerror(errno));
+        }
+        __atomic_store_n(&capture_file, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
@@ -0,0 +1,647 @@
+#include "channel.h"
+#include "snapshot.h"
+#include "replication.h"
+#include "crc32c.h"
+#include "utility.h"
+#include "busy_poll.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <libgen.h>
+
+/* channel table, buckets are only walked/modified while holding table_mutex */
+static struct channel* table[CHANNEL_TABLE_BUCKETS];
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct channel* default_channel = NULL;
+
+bool durable_appends = true;
+
+/* djb2, good enough for short channel names */
+static unsigned long hash_name(const char* name) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = (unsigned char)*name++) != 0) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+/* cuts a crash-torn tail off the data before anything indexes or maps it */
+static int recover_frames(struct channel* ch) {
+    uint64_t length = 0;
+    /* other processes may be appending to the file right now, recovery must not cut their data */
+    int ret_val = ch->shared != NULL ? shared_log_lock(ch->shared) : 0;
+    if (ret_val) {
+        return ret_val;
+    }
+    ret_val = frame_log_open(&ch->frames, ch->file_name, &length);
+    if (ret_val == 0 && ch->shared != NULL) {
+        ret_val = shared_log_publish(ch->shared, length);
+    }
+    if (ch->shared != NULL) {
+        shared_log_unlock(ch->shared);
+    }
+    return ret_val;
+}
+
+static struct channel* channel_alloc(const char* name, const char* file_name) {
+    struct channel* ch = calloc(1, sizeof(struct channel));
+    if (ch == NULL) {
+        syslog(LOG_ERR, "Failed to allocate memory for channel %s, error: %s", name, strerror(errno));
+        return NULL;
+    }
+    ch->name = strdup(name);
+    ch->file_name = strdup(file_name);
+    if (ch->name == NULL || ch->file_name == NULL) {
+        syslog(LOG_ERR, "Failed to allocate memory for channel %s names, error: %s", name, strerror(errno));
+        free(ch->name);
+        free(ch->file_name);
+        free(ch);
+        return NULL;
+    }
+    int ret_val = pthread_mutex_init(&ch->mutex, NULL);
+    if (ret_val) {
+        syslog(LOG_ERR, "Failed to create mutex for channel %s, error: %s", name, strerror(ret_val));
+        free(ch->name);
+        free(ch->file_name);
+        free(ch);
+        return NULL;
+    }
+    ret_val = fair_lock_init(&ch->gate);
+    if (ret_val) {
+        syslog(LOG_ERR, "Failed to create fair lock for channel %s, error: %s", name, strerror(ret_val));
+        pthread_mutex_destroy(&ch->mutex);
+        free(ch->name);
+        free(ch->file_name);
+        free(ch);
+        return NULL;
+    }
+    ret_val = combiner_init(&ch->combiner);
+    if (ret_val) {
+        syslog(LOG_ERR, "Failed to create append combiner for channel %s, error: %s", name, strerror(ret_val));
+        fair_lock_destroy(&ch->gate);
+        pthread_mutex_destroy(&ch->mutex);
+        free(ch->name);
+        free(ch->file_name);
+        free(ch);
+        return NULL;
+    }
+    rate_limiter_init(&ch->limiter, &channel_rate_limits);
+
+    struct stat file_stat;
+    ch->is_device = stat(file_name, &file_stat) == 0 && S_ISCHR(file_stat.st_mode);
+    record_index_init(&ch->index);
+    ch->frames.filed = -1;
+    if ((!ch->is_device && shared_log_owner && (ch->shared = shared_log_open(file_name)) == NULL) ||
+        (!ch->is_device && record_frames_enabled && recover_frames(ch) != 0)) {
+        if (ch->shared != NULL) {
+            shared_log_close(ch->shared);
+        }
+        combiner_destroy(&ch->combiner);
+        fair_lock_destroy(&ch->gate);
+        rate_limiter_destroy(&ch->limiter);
+        pthread_mutex_destroy(&ch->mutex);
+        free(ch->name);
+        free(ch->file_name);
+        free(ch);
+        return NULL;
+    }
+    if (ch->is_device && tiered_storage_enabled && (ch->tier = tier_open(file_name, CHANNEL_FALLBACK_PATH)) == NULL) {
+        combiner_destroy(&ch->combiner);
+        fair_lock_destroy(&ch->gate);
+        rate_limiter_destroy(&ch->limiter);
+        pthread_mutex_destroy(&ch->mutex);
+        free(ch->name);
+        free(ch->file_name);
+        free(ch);
+        return NULL;
+    }
+    if (!ch->is_device) {
+        /* warm start: take the index from the last snapshot and only scan what was stored after it */
+        snapshot_load(&ch->index, file_name, &ch->version);
+        int filed = open(file_name, O_RDONLY | O_CLOEXEC);
+        if (filed >= 0) {
+            record_index_catch_up(&ch->index, filed);
+            close(filed);
+        }
+    }
+    return ch;
+}
+
+static void channel_free(struct channel* ch, bool remove_file) {
+    int ret_val = pthread_mutex_destroy(&ch->mutex);
+    if (ret_val) {
+        syslog(LOG_WARNING, "Failed to destroy mutex of channel %s during cleanup, error: %s", ch->name, strerror(ret_val));
+    }
+    if (ch->combiner.batches > 0) {
+        syslog(LOG_INFO, "Appended %lu packets to %s in %lu combined writes", ch->combiner.packets, ch->file_name, ch->combiner.batches);
+    }
+    combiner_destroy(&ch->combiner);
+    fair_lock_destroy(&ch->gate);
+    rate_limiter_destroy(&ch->limiter);
+    if (remove_file && remove(ch->file_name) < 0 && errno != ENOENT) {
+        syslog(LOG_ERR, "Failed to remove the file at %s upon termination, error: %s", ch->file_name, strerror(errno));
+    }
+    if (remove_file) {
+        snapshot_remove(ch->file_name);
+    }
+    if (ch->shared != NULL) {
+        shared_log_close(ch->shared);
+        if (remove_file) {
+            shared_log_remove(ch->file_name);
+        }
+    }
+    /* the cold tier is the history, it stays whatever happens to the device */
+    if (ch->tier != NULL) {
+        tier_close(ch->tier);
+    }
+    frame_log_close(&ch->frames);
+    if (remove_file) {
+        frame_log_remove(ch->file_name);
+    }
+    record_index_free(&ch->index);
+    free(ch->name);
+    free(ch->file_name);
+    free(ch);
+}
+
+/**
+ * A channel is stored in "<default file>.<name>", right where the sidecar files of the default
+ * storage are, "<default file><suffix>": a channel named after a suffix would be that file.
+ */
+static const char* reserved_suffixes[] = { SNAPSHOT_SUFFIX, FRAME_LOG_SUFFIX, SHARED_LOG_SUFFIX, SHARD_SEQ_SUFFIX };
+
+bool channel_name_is_valid(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > CHANNEL_NAME_MAX_LEN) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-') {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < sizeof(reserved_suffixes) / sizeof(reserved_suffixes[0]); i++) {
+        /* the suffixes all start with the '.' separating a channel name */
+        if (strcmp(name, reserved_suffixes[i] + 1) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int channel_table_init(const char* default_file_name) {
+    memset(table, 0, sizeof(table));
+    default_channel = channel_alloc("", default_file_name);
+    if (default_channel == NULL) {
+        return ENOMEM;
+    }
+    table[hash_name("") % CHANNEL_TABLE_BUCKETS] = default_channel;
+    return 0;
+}
+
+void channel_table_destroy(bool remove_files) {
+    pthread_mutex_lock(&table_mutex);
+    /* the shards past the default channel are only known to the shard set */
+    struct shard_set* shards = default_channel != NULL ? default_channel->shards : NULL;
+    if (shards != NULL) {
+        for (unsigned int i = 1; i < shards->count; i++) {
+            channel_free(shards->shards[i], remove_files);
+        }
+        shard_set_destroy(shards, remove_files);
+        free(shards);
+    }
+    for (int i = 0; i < CHANNEL_TABLE_BUCKETS; i++) {
+        struct channel* ch = table[i];
+        while (ch != NULL) {
+            struct channel* next = ch->next;
+            channel_free(ch, remove_files);
+            ch = next;
+        }
+        table[i] = NULL;
+    }
+    default_channel = NULL;
+    pthread_mutex_unlock(&table_mutex);
+}
+
+/**
+ * Stripes the default channel over the storages in paths, separated by SHARD_PATH_SEPARATOR,
+ * besides its own. They're only reachable through the default channel, see shard.h.
+ */
+int channel_table_shard(const char* paths, enum shard_routing routing) {
+    struct shard_set* set = malloc(sizeof(*set));
+    if (set == NULL) {
+        return ENOMEM;
+    }
+    shard_set_init(set, routing);
+    int ret_val = shard_set_add(set, default_channel);
+    const char* path = paths;
+    while (!ret_val && *path != '\0') {
+        char file_name[4096] = {0};
+        const char* separator = strchr(path, SHARD_PATH_SEPARATOR);
+        size_t length = separator != NULL ? (size_t)(separator - path) : strlen(path);
+        if (length == 0 || length >= sizeof(file_name)) {
+            syslog(LOG_ERR, "Invalid shard storage list %s", paths);
+            ret_val = EINVAL;
+            break;
+        }
+        memcpy(file_name, path, length);
+        struct channel* shard = channel_alloc("", file_name);
+        if (shard == NULL) {
+            ret_val = ENOMEM;
+            break;
+        }
+        if ((ret_val = shard_set_add(set, shard)) != 0) {
+            syslog(LOG_ERR, "Could not add shard %s, error: %s", file_name, strerror(ret_val));
+            channel_free(shard, false);
+            break;
+        }
+        syslog(LOG_NOTICE, "Default channel sharded to %s", file_name);
+        path += length + (separator != NULL);
+    }
+    if (ret_val) {
+        for (unsigned int i = 1; i < set->count; i++) {
+            channel_free(set->shards[i], false);
+        }
+        shard_set_destroy(set, false);
+        free(set);
+        default_channel->shards = NULL;
+        return ret_val;
+    }
+    return 0;
+}
+
+struct channel* channel_get_default(void) {
+    return default_channel;
+}
+
+struct channel* channel_get_or_create(const char* name) {
+    if (name[0] == '\0') {
+        return default_channel;
+    }
+    if (!channel_name_is_valid(name) || default_channel == NULL) {
+        return NULL;
+    }
+
+    unsigned long bucket = hash_name(name) % CHANNEL_TABLE_BUCKETS;
+    pthread_mutex_lock(&table_mutex);
+    struct channel* ch = table[bucket];
+    while (ch != NULL && strcmp(ch->name, name) != 0) {
+        ch = ch->next;
+    }
+    if (ch == NULL) {
+        /* first connection asking for this channel, create it next to the default storage */
+        char file_name[4096] = {0};
+        const char* base = default_channel->file_name;
+        if (strncmp(base, "/dev/", strlen("/dev/")) == 0) {
+            base = CHANNEL_FALLBACK_PATH;
+        }
+        int ret_val = snprintf(file_name, sizeof(file_name), "%s.%s", base, name);
+        if (ret_val < 0 || (size_t)ret_val >= sizeof(file_name)) {
+            syslog(LOG_ERR, "Storage path for channel %s is too long", name);
+        }
+        else if ((ch = channel_alloc(name, file_name)) != NULL) {
+            ch->next = table[bucket];
+            table[bucket] = ch;
+            syslog(LOG_NOTICE, "Created channel %s, stored at %s", name, file_name);
+        }
+    }
+    pthread_mutex_unlock(&table_mutex);
+    return ch;
+}
+
+/**
+ * Named channels are normally created when a client first asks for them, this opens the ones
+ * whose storage is already sitting next to the default one, e.g. left by a previous run.
+ */
+int channel_table_discover(void) {
+    if (default_channel == NULL) {
+        return EINVAL;
+    }
+    const char* base = default_channel->file_name;
+    if (strncmp(base, "/dev/", strlen("/dev/")) == 0) {
+        base = CHANNEL_FALLBACK_PATH;
+    }
+    char dir_path[4096] = {0};
+    char base_path[4096] = {0};
+    strncpy(dir_path, base, sizeof(dir_path) - 1);
+    strncpy(base_path, base, sizeof(base_path) - 1);
+    const char* prefix = basename(base_path);
+    size_t prefix_len = strlen(prefix);
+
+    DIR* dir = opendir(dirname(dir_path));
+    if (dir == NULL) {
+        int err = errno;
+        syslog(LOG_ERR, "Could not look for channels next to %s, error: %s", base, strerror(err));
+        return err;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        /* "<default file>.<name>", the sidecar files of the default storage have reserved names, and the
+           ones of other channels hold a second '.', which is not valid in a name */
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0 && entry->d_name[prefix_len] == '.' &&
+            channel_name_is_valid(entry->d_name + prefix_len + 1)) {
+            channel_get_or_create(entry->d_name + prefix_len + 1);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+void channel_for_each(channel_callback callback, void* args) {
+    pthread_mutex_lock(&table_mutex);
+    for (int i = 0; i < CHANNEL_TABLE_BUCKETS; i++) {
+        for (struct channel* ch = table[i]; ch != NULL; ch = ch->next) {
+            callback(ch, args);
+        }
+    }
+    if (default_channel != NULL && default_channel->shards != NULL) {
+        for (unsigned int i = 1; i < default_channel->shards->count; i++) {
+            callback(default_channel->shards->shards[i], args);
+        }
+    }
+    pthread_mutex_unlock(&table_mutex);
+}
+
+/**
+ * Takes the channel mutex on behalf of a client connection. Connections first queue on the fair
+ * gate, which lets them through one at a time in deficit round robin order across clients, so
+ * the mutex itself is only ever contended by the flusher and the snapshot threads.
+ */
+int channel_lock(struct channel* channel, const char* client, size_t cost) {
+    int ret_val = fair_lock_acquire(&channel->gate, client, cost);
+    if (ret_val) {
+        return ret_val;
+    }
+    /* the flusher or a snapshot holds it at worst, briefly, spin for it when busy polling */
+    uint64_t spin_deadline = busy_poll_deadline();
+    while ((ret_val = pthread_mutex_trylock(&channel->mutex)) == EBUSY && busy_poll_spin(spin_deadline)) {
+    }
+    if (ret_val == EBUSY) {
+        ret_val = pthread_mutex_lock(&channel->mutex);
+    }
+    if (ret_val) {
+        fair_lock_release(&channel->gate);
+    }
+    return ret_val;
+}
+
+void channel_unlock(struct channel* channel) {
+    pthread_mutex_unlock(&channel->mutex);
+    fair_lock_release(&channel->gate);
+}
+
+/* appends a packet to the channel storage, keeping its index and version up to date, call with mutex held */
+static int append_packet(struct channel* channel, int filed, struct packet_stage* stage, char* buf, size_t size) {
+    if (!channel->is_device) {
+        /* pick up anything stored behind our back so the offsets stay right */
+        int ret_val = record_index_catch_up(&channel->index, filed);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    uint64_t offset = channel->index.length;
+    if (channel->tier != NULL) {
+        int ret_val = tier_append(channel->tier, stage, buf, size);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    if (stage != NULL) {
+        int ret_val = packet_stage_publish(stage, filed);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    int ret_val = dump_buffer_to_file(buf, size, filed);
+    if (ret_val) {
+        return ret_val;
+    }
+    if (!channel->is_device && stage != NULL) {
+        /* the staged part never was in memory, let the index read it back from the file */
+        ret_val = record_index_catch_up(&channel->index, filed);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    else if (!channel->is_device) {
+        record_index_add(&channel->index, buf, size);
+    }
+    if (channel->frames.filed >= 0) {
+        uint32_t crc = crc32c(stage != NULL ? stage->crc : 0, buf, size);
+        ret_val = frame_log_append(&channel->frames, offset, (stage != NULL ? stage->length : 0) + size, crc,
+                                   __atomic_load_n(&durable_appends, __ATOMIC_RELAXED));
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    if (channel->shared != NULL) {
+        /* nobody else appends while we hold the shared lock, so the file ends with our packet */
+        struct stat file_stat;
+        if (fstat(filed, &file_stat) < 0) {
+            return errno;
+        }
+        ret_val = shared_log_publish(channel->shared, file_stat.st_size);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    channel->version++;
+    replication_notify();
+    return 0;
+}
+
+static int append_locked(struct channel* channel, int filed, struct packet_stage* stage, char* buf, size_t size) {
+    if (channel->shards != NULL) {
+        uint64_t packet_size = (stage != NULL ? stage->length : 0) + size;
+        shard_append_begin(channel);
+        int ret_val = append_packet(channel, filed, stage, buf, size);
+        int shard_ret_val = shard_append_end(channel, filed, packet_size, ret_val == 0);
+        return ret_val ? ret_val : shard_ret_val;
+    }
+    if (channel->shared == NULL) {
+        return append_packet(channel, filed, stage, buf, size);
+    }
+    /* the mutex only keeps this process' threads apart, other processes append to the file too */
+    int ret_val = shared_log_lock(channel->shared);
+    if (ret_val) {
+        return ret_val;
+    }
+    ret_val = append_packet(channel, filed, stage, buf, size);
+    shared_log_unlock(channel->shared);
+    return ret_val;
+}
+
+int channel_append(struct channel* channel, int filed, char* buf, size_t size) {
+    return append_locked(channel, filed, NULL, buf, size);
+}
+
+/* same as channel_append() for a packet whose head is in the connection staging area */
+int channel_append_staged(struct channel* channel, int filed, struct packet_stage* stage, char* buf, size_t size) {
+    return append_locked(channel, filed, stage, buf, size);
+}
+
+/* combining writes the packets straight to the storage, the bookkeeping of the other modes is per packet */
+bool channel_can_combine(struct channel* channel) {
+    return __atomic_load_n(&combine_appends, __ATOMIC_RELAXED) && channel->shards == NULL && channel->shared == NULL && channel->tier == NULL;
+}
+
+static int writev_all(int filed, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t wrote = writev(filed, iov, count);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            syslog(LOG_ERR, "Failure to write to output file, error: %s", strerror(errno));
+            return wrote < 0 ? errno : EIO;
+        }
+        while (count > 0 && (size_t)wrote >= iov->iov_len) {
+            wrote -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + wrote;
+            iov->iov_len -= wrote;
+        }
+    }
+    return 0;
+}
+
+/* append_packet() for a whole batch of combined packets, one write and at most one sync for all of them */
+static int append_batch(struct channel* channel, int filed, struct combine_slot** batch, size_t count) {
+    if (!channel->is_device) {
+        int ret_val = record_index_catch_up(&channel->index, filed);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    uint64_t offset = channel->index.length;
+    struct iovec iov[COMBINE_BATCH_MAX];
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = batch[i]->buf;
+        iov[i].iov_len = batch[i]->size;
+    }
+    int ret_val = writev_all(filed, iov, count);
+    if (ret_val) {
+        return ret_val;
+    }
+    bool durable = __atomic_load_n(&durable_appends, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < count; i++) {
+        if (!channel->is_device) {
+            record_index_add(&channel->index, batch[i]->buf, batch[i]->size);
+        }
+        if (channel->frames.filed >= 0) {
+            ret_val = frame_log_append(&channel->frames, offset, batch[i]->size, crc32c(0, batch[i]->buf, batch[i]->size),
+                                       durable && i + 1 == count);
+            if (ret_val) {
+                return ret_val;
+            }
+        }
+        offset += batch[i]->size;
+        channel->version++;
+    }
+    if (durable && !channel->is_device && fsync(filed) < 0) {
+        syslog(LOG_ERR, "Failed to sync combined appends to %s, error: %s", channel->file_name, strerror(errno));
+        return errno;
+    }
+    replication_notify();
+    return 0;
+}
+
+/**
+ * Appends the packet a connection published in slot, together with every other packet published
+ * to the channel meanwhile, unless a connection ahead already did, call with mutex held. Unlike
+ * channel_append() the storage is synced here when appends are durable.
+ */
+int channel_append_combined(struct channel* channel, int filed, struct combine_slot* slot) {
+    struct combine_slot* batch[COMBINE_BATCH_MAX];
+    int result = 0;
+    while (!combiner_is_done(&channel->combiner, slot, &result)) {
+        size_t count = combiner_take(&channel->combiner, batch);
+        if (count == 0) {
+            /* published slots only leave the list while someone holds mutex, and that's us */
+            return EINVAL;
+        }
+        combiner_finish(&channel->combiner, batch, count, append_batch(channel, filed, batch, count));
+    }
+    return result;
+}
+
+/**
+ * AESDCHAR_IOCSEEKTO against a regular file, answered from the record index the same way the
+ * driver answers it from its entries: the command has to be stored and the offset within it.
+ */
+static int index_seek(struct channel* channel, int filed, struct aesd_seekto* seek, uint64_t* dump_from) {
+    /* other processes may have appended since our last look at the file */
+    int ret_val = record_index_catch_up(&channel->index, filed);
+    if (ret_val) {
+        return ret_val;
+    }
+    size_t count = record_index_count(&channel->index);
+    if (seek->write_cmd >= count) {
+        return EINVAL;
+    }
+    uint64_t start = record_index_get(&channel->index, seek->write_cmd);
+    uint64_t end = seek->write_cmd + 1 < count ? record_index_get(&channel->index, seek->write_cmd + 1) : channel->index.length;
+    if (seek->write_cmd_offset >= end - start) {
+        return EINVAL;
+    }
+    *dump_from = start + seek->write_cmd_offset;
+    return 0;
+}
+
+/* AESDCHAR_IOCSEEKTO, dump_from is then passed on to channel_dump() */
+int channel_seek(struct channel* channel, int filed, struct aesd_seekto* seek, uint64_t* dump_from) {
+    *dump_from = 0;
+    if (channel->shards != NULL) {
+        /* write commands are numbered per shard storage, there's nothing to seek in the merged log */
+        syslog(LOG_ERR, "Seek commands are not supported on a sharded channel");
+        return EINVAL;
+    }
+    if (channel->tier != NULL) {
+        return tier_seek(channel->tier, filed, seek, dump_from);
+    }
+    if (!channel->is_device) {
+        return index_seek(channel, filed, seek, dump_from);
+    }
+    return ioctl(filed, AESDCHAR_IOCSEEKTO, seek) < 0 ? errno : 0;
+}
+
+/* sends the channel back to a client from dump_from on, shared storage is read up to what's been published */
+int channel_dump(struct channel* channel, int filed, int socketd, struct send_policy* policy, uint64_t dump_from) {
+    if (channel->shards != NULL) {
+        return shard_dump(channel->shards, socketd, policy);
+    }
+    if (channel->tier != NULL) {
+        return tier_dump(channel->tier, filed, socketd, policy, dump_from);
+    }
+    if (channel->shared != NULL) {
+        return shared_log_dump(channel->shared, socketd, policy, dump_from);
+    }
+    return dump_file_to_socket(filed, socketd, policy, dump_from);
+}
+
+/* searches the channel for filter, with the same view of it channel_dump() has */
+int channel_filter(struct channel* channel, int filed, struct filter* filter) {
+    if (channel->shards != NULL) {
+        return shard_filter(channel->shards, filter);
+    }
+    if (channel->tier != NULL) {
+        return tier_filter(channel->tier, filed, filter);
+    }
+    if (channel->shared != NULL) {
+        return filter_search(filter, channel->shared->data, shared_log_length(channel->shared));
+    }
+    return filter_search_file(filter, filed, UINT64_MAX);
+}
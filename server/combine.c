@@ -0,0 +1,104 @@
+#include "combine.h"
+#include <string.h>
+
+bool combine_appends = false;
+
+int combiner_init(struct append_combiner* combiner) {
+    memset(combiner, 0, sizeof(*combiner));
+    int ret_val = pthread_mutex_init(&combiner->mutex, NULL);
+    if (ret_val) {
+        return ret_val;
+    }
+    ret_val = pthread_cond_init(&combiner->done_cond, NULL);
+    if (ret_val) {
+        pthread_mutex_destroy(&combiner->mutex);
+    }
+    return ret_val;
+}
+
+void combiner_destroy(struct append_combiner* combiner) {
+    pthread_cond_destroy(&combiner->done_cond);
+    pthread_mutex_destroy(&combiner->mutex);
+}
+
+void combiner_publish(struct append_combiner* combiner, struct combine_slot* slot, char* buf, size_t size) {
+    slot->buf = buf;
+    slot->size = size;
+    slot->taken = false;
+    slot->done = false;
+    slot->result = 0;
+    slot->next = NULL;
+    pthread_mutex_lock(&combiner->mutex);
+    if (combiner->tail != NULL) {
+        combiner->tail->next = slot;
+    }
+    else {
+        combiner->head = slot;
+    }
+    combiner->tail = slot;
+    pthread_mutex_unlock(&combiner->mutex);
+}
+
+bool combiner_is_done(struct append_combiner* combiner, struct combine_slot* slot, int* result) {
+    pthread_mutex_lock(&combiner->mutex);
+    bool done = slot->done;
+    *result = slot->result;
+    pthread_mutex_unlock(&combiner->mutex);
+    return done;
+}
+
+size_t combiner_take(struct append_combiner* combiner, struct combine_slot** batch) {
+    size_t count = 0;
+    pthread_mutex_lock(&combiner->mutex);
+    while (combiner->head != NULL && count < COMBINE_BATCH_MAX) {
+        struct combine_slot* slot = combiner->head;
+        combiner->head = slot->next;
+        slot->taken = true;
+        batch[count++] = slot;
+    }
+    if (combiner->head == NULL) {
+        combiner->tail = NULL;
+    }
+    pthread_mutex_unlock(&combiner->mutex);
+    return count;
+}
+
+void combiner_finish(struct append_combiner* combiner, struct combine_slot** batch, size_t count, int result) {
+    pthread_mutex_lock(&combiner->mutex);
+    for (size_t i = 0; i < count; i++) {
+        batch[i]->result = result;
+        batch[i]->done = true;
+    }
+    combiner->batches++;
+    combiner->packets += count;
+    pthread_cond_broadcast(&combiner->done_cond);
+    pthread_mutex_unlock(&combiner->mutex);
+}
+
+void combiner_withdraw(struct append_combiner* combiner, struct combine_slot* slot) {
+    pthread_mutex_lock(&combiner->mutex);
+    if (!slot->taken) {
+        struct combine_slot* prev = NULL;
+        struct combine_slot* cur = combiner->head;
+        while (cur != NULL && cur != slot) {
+            prev = cur;
+            cur = cur->next;
+        }
+        if (cur != NULL) {
+            if (prev != NULL) {
+                prev->next = cur->next;
+            }
+            else {
+                combiner->head = cur->next;
+            }
+            if (combiner->tail == cur) {
+                combiner->tail = prev;
+            }
+        }
+    }
+    /* the combiner writing it still reads the packet buffer */
+    while (slot->taken && !slot->done) {
+        pthread_cond_wait(&combiner->done_cond, &combiner->mutex);
+    }
+    pthread_mutex_unlock(&combiner->mutex);
+}
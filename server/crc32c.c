@@ -0,0 +1,118 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86_HW 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM_HW 1
+#endif
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/* slicing-by-8 tables, crc_table[0] is the classic byte at a time table */
+static uint32_t crc_table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* ptr, size_t length);
+/* picked once, the instruction based versions when the CPU has them */
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char* ptr, size_t length) = crc32c_software;
+
+#ifdef CRC32C_X86_HW
+/* SSE4.2 crc32 instruction, which implements exactly this polynomial */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* ptr, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t value;
+        memcpy(&value, ptr, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+        ptr += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length >= 4) {
+        uint32_t value;
+        memcpy(&value, ptr, sizeof(value));
+        crc = _mm_crc32_u32(crc, value);
+        ptr += 4;
+        length -= 4;
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *ptr++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM_HW
+/* ARMv8 CRC extension, only built when the target is known to have it */
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char* ptr, size_t length) {
+    while (length >= 8) {
+        uint64_t value;
+        memcpy(&value, ptr, sizeof(value));
+        crc = __crc32cd(crc, value);
+        ptr += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *ptr++);
+    }
+    return crc;
+}
+#endif
+
+static void build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            crc_table[slice][i] = (crc_table[slice - 1][i] >> 8) ^ crc_table[0][crc_table[slice - 1][i] & 0xff];
+        }
+    }
+#ifdef CRC32C_X86_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_sse42;
+    }
+#endif
+#ifdef CRC32C_ARM_HW
+    crc32c_impl = crc32c_armv8;
+#endif
+}
+
+/* works on the inverted crc like the instructions do */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* ptr, size_t length) {
+    while (length >= 8) {
+        uint32_t low = crc ^ ((uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 | (uint32_t)ptr[3] << 24);
+        crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff] ^
+              crc_table[5][(low >> 16) & 0xff] ^ crc_table[4][low >> 24] ^
+              crc_table[3][ptr[4]] ^ crc_table[2][ptr[5]] ^ crc_table[1][ptr[6]] ^ crc_table[0][ptr[7]];
+        ptr += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = crc_table[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&table_once, build_table);
+    return ~crc32c_impl(~crc, data, length);
+}
+
+bool crc32c_hardware(void) {
+    pthread_once(&table_once, build_table);
+    return crc32c_impl != crc32c_software;
+}
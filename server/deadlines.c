@@ -0,0 +1,96 @@
+#include "deadlines.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+struct timeout_config timeout_config;
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool timeouts_enabled(void) {
+    return timeout_config.idle_ms || timeout_config.header_ms || timeout_config.packet_ms;
+}
+
+/* "idle,header,packet" in seconds, e.g. "30,10,60", 0 or an empty field disables that timeout */
+int parse_timeouts(const char* spec, struct timeout_config* config) {
+    unsigned int* fields[] = { &config->idle_ms, &config->header_ms, &config->packet_ms };
+    const char* ptr = spec;
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        char* end = NULL;
+        long seconds = strtol(ptr, &end, 10);
+        if (seconds < 0 || seconds > 24 * 3600) {
+            return EINVAL;
+        }
+        *fields[i] = seconds * 1000;
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ',') {
+            return EINVAL;
+        }
+        ptr = end + 1;
+    }
+    return EINVAL;
+}
+
+static void deadline_expired(struct wheel_timer* timer) {
+    struct connection_deadlines* deadlines = (struct connection_deadlines*)((char*)timer - offsetof(struct connection_deadlines, timer));
+    deadlines->expired = true;
+    /* wakes the connection thread up with an end of stream */
+    shutdown(deadlines->socketd, SHUT_RDWR);
+}
+
+void deadlines_init(struct connection_deadlines* deadlines, int socketd) {
+    wheel_timer_init(&deadlines->timer, deadline_expired);
+    deadlines->socketd = socketd;
+    deadlines->header_deadline_ms = timeout_config.header_ms ? now_ms() + timeout_config.header_ms : 0;
+    deadlines->packet_deadline_ms = 0;
+    deadlines->expired = false;
+}
+
+/* arms the timer before blocking on the socket, packet_started tells if bytes of the packet already came in */
+void deadlines_wait_for_bytes(struct connection_deadlines* deadlines, bool packet_started) {
+    if (!timeouts_enabled()) {
+        return;
+    }
+    uint64_t now = now_ms();
+    uint64_t deadline = timeout_config.idle_ms ? now + timeout_config.idle_ms : UINT64_MAX;
+
+    if (packet_started && deadlines->packet_deadline_ms == 0 && timeout_config.packet_ms) {
+        deadlines->packet_deadline_ms = now + timeout_config.packet_ms;
+    }
+    if (deadlines->packet_deadline_ms && deadlines->packet_deadline_ms < deadline) {
+        deadline = deadlines->packet_deadline_ms;
+    }
+    if (deadlines->header_deadline_ms && deadlines->header_deadline_ms < deadline) {
+        deadline = deadlines->header_deadline_ms;
+    }
+    if (deadline == UINT64_MAX) {
+        return;
+    }
+    wheel_timer_schedule(&deadlines->timer, deadline > now ? deadline - now : 0);
+}
+
+void deadlines_packet_done(struct connection_deadlines* deadlines) {
+    wheel_timer_cancel(&deadlines->timer);
+    deadlines->packet_deadline_ms = 0;
+    deadlines->header_deadline_ms = 0;
+}
+
+/* the connection is going away, its timer must not fire on a socket that may be closed and reused */
+void deadlines_cancel(struct connection_deadlines* deadlines) {
+    wheel_timer_cancel(&deadlines->timer);
+}
+
+bool deadlines_expired(struct connection_deadlines* deadlines) {
+    wheel_timer_cancel(&deadlines->timer);
+    return deadlines->expired;
+}
@@ -0,0 +1,162 @@
+#include "fair_lock.h"
+#include "busy_poll.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct fair_waiter {
+    pthread_cond_t cond;
+    struct fair_lock* lock;
+    struct fair_flow* flow;
+    long cost;
+    bool granted;
+    struct fair_waiter* next;
+};
+
+int fair_lock_init(struct fair_lock* lock) {
+    lock->held = false;
+    lock->active_head = NULL;
+    lock->active_tail = NULL;
+    return pthread_mutex_init(&lock->mutex, NULL);
+}
+
+void fair_lock_destroy(struct fair_lock* lock) {
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static void unlink_flow(struct fair_lock* lock, struct fair_flow* flow) {
+    struct fair_flow** link = &lock->active_head;
+    struct fair_flow* previous = NULL;
+    while (*link != flow) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    *link = flow->next;
+    if (lock->active_tail == flow) {
+        lock->active_tail = previous;
+    }
+    free(flow);
+}
+
+/**
+ * Passes the lock on to the next waiter according to deficit round robin, or marks it free when
+ * nobody is waiting. The flow at the head keeps being served while its credit covers the cost
+ * of its next request, otherwise it gets a quantum more and goes to the back of the round.
+ * Call with lock->mutex held.
+ */
+static void grant_next(struct fair_lock* lock) {
+    while (lock->active_head != NULL) {
+        struct fair_flow* flow = lock->active_head;
+        struct fair_waiter* waiter = flow->head;
+        if (waiter->cost <= flow->deficit) {
+            flow->deficit -= waiter->cost;
+            flow->head = waiter->next;
+            if (flow->head == NULL) {
+                /* client has nobody else waiting, unused credit is not carried over */
+                unlink_flow(lock, flow);
+            }
+            waiter->granted = true;
+            pthread_cond_signal(&waiter->cond);
+            return;
+        }
+        flow->deficit += FAIR_LOCK_QUANTUM;
+        if (flow->next != NULL) {
+            lock->active_head = flow->next;
+            flow->next = NULL;
+            lock->active_tail->next = flow;
+            lock->active_tail = flow;
+        }
+    }
+    __atomic_store_n(&lock->held, false, __ATOMIC_RELAXED);
+}
+
+/* a waiter cancelled while blocked must not stay queued, nor keep a lock it was just given */
+static void abandon_wait(void* args) {
+    struct fair_waiter* waiter = args;
+    struct fair_lock* lock = waiter->lock;
+    if (waiter->granted) {
+        grant_next(lock);
+    }
+    else {
+        struct fair_flow* flow = waiter->flow;
+        struct fair_waiter** link = &flow->head;
+        struct fair_waiter* previous = NULL;
+        while (*link != waiter) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        *link = waiter->next;
+        if (flow->tail == waiter) {
+            flow->tail = previous;
+        }
+        if (flow->head == NULL) {
+            unlink_flow(lock, flow);
+        }
+    }
+    pthread_cond_destroy(&waiter->cond);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+int fair_lock_acquire(struct fair_lock* lock, const char* key, size_t cost) {
+    pthread_mutex_lock(&lock->mutex);
+    uint64_t spin_deadline = lock->held ? busy_poll_deadline() : 0;
+    if (spin_deadline) {
+        /* the holder may well be done before a sleep and a wakeup would be, spin for it first (-b) */
+        pthread_mutex_unlock(&lock->mutex);
+        while (__atomic_load_n(&lock->held, __ATOMIC_RELAXED) && busy_poll_spin(spin_deadline)) {
+        }
+        pthread_mutex_lock(&lock->mutex);
+    }
+    if (!lock->held) {
+        /* nobody is queued while the lock is free, grant_next() hands it over directly */
+        __atomic_store_n(&lock->held, true, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock->mutex);
+        return 0;
+    }
+
+    struct fair_flow* flow = lock->active_head;
+    while (flow != NULL && strcmp(flow->key, key) != 0) {
+        flow = flow->next;
+    }
+    if (flow == NULL) {
+        flow = calloc(1, sizeof(struct fair_flow));
+        if (flow == NULL) {
+            pthread_mutex_unlock(&lock->mutex);
+            return ENOMEM;
+        }
+        strncpy(flow->key, key, sizeof(flow->key) - 1);
+        if (lock->active_tail != NULL) {
+            lock->active_tail->next = flow;
+        }
+        else {
+            lock->active_head = flow;
+        }
+        lock->active_tail = flow;
+    }
+
+    struct fair_waiter waiter = { .lock = lock, .flow = flow, .cost = cost + FAIR_LOCK_REQUEST_COST };
+    pthread_cond_init(&waiter.cond, NULL);
+    if (flow->tail != NULL) {
+        flow->tail->next = &waiter;
+    }
+    else {
+        flow->head = &waiter;
+    }
+    flow->tail = &waiter;
+
+    pthread_cleanup_push(abandon_wait, &waiter);
+    while (!waiter.granted) {
+        pthread_cond_wait(&waiter.cond, &lock->mutex);
+    }
+    pthread_cleanup_pop(0);
+
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+void fair_lock_release(struct fair_lock* lock) {
+    pthread_mutex_lock(&lock->mutex);
+    grant_next(lock);
+    pthread_mutex_unlock(&lock->mutex);
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "filter.h"
+#include "utility.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FILTER_READ_CHUNK (64 * 1024)
+/* "<command>,<byte offset>,<size>\n" */
+#define FILTER_OFFSET_LINE_MAX 64
+
+struct filter_match {
+    /* command index counted from the start of the part */
+    uint64_t record;
+    size_t offset;
+    size_t size;
+};
+
+/* a slice of a region ending where a command does, searched by one thread */
+struct filter_part {
+    const struct filter* filter;
+    const char* data;
+    size_t start;
+    size_t end;
+    struct filter_match* matches;
+    size_t count;
+    size_t capacity;
+    /* commands ending in the part */
+    uint64_t records;
+    int ret_val;
+    pthread_t thread;
+};
+
+bool is_filter_command(const char* buf, size_t size) {
+    return (size >= strlen(FILTER_COMMAND) && strncmp(buf, FILTER_COMMAND, strlen(FILTER_COMMAND)) == 0) ||
+           (size >= strlen(FILTER_OFFSETS_COMMAND) && strncmp(buf, FILTER_OFFSETS_COMMAND, strlen(FILTER_OFFSETS_COMMAND)) == 0);
+}
+
+/* the patterns point into buf, which has to outlive the filter */
+int filter_init(struct filter* filter, const char* buf, size_t size) {
+    memset(filter, 0, sizeof(*filter));
+    filter->offsets = strncmp(buf, FILTER_OFFSETS_COMMAND, strlen(FILTER_OFFSETS_COMMAND)) == 0;
+    size_t position = strlen(filter->offsets ? FILTER_OFFSETS_COMMAND : FILTER_COMMAND);
+    if (size > position && buf[size - 1] == '\n') {
+        size--;
+    }
+    while (position <= size) {
+        const char* separator = memchr(buf + position, FILTER_PATTERN_SEPARATOR, size - position);
+        size_t end = separator != NULL ? (size_t)(separator - buf) : size;
+        /* an empty pattern would match everything, that's what a dump is for */
+        if (end == position || filter->pattern_count == FILTER_PATTERNS_MAX || memchr(buf + position, '\n', end - position) != NULL) {
+            return EINVAL;
+        }
+        filter->patterns[filter->pattern_count] = buf + position;
+        filter->pattern_sizes[filter->pattern_count++] = end - position;
+        position = end + 1;
+    }
+    return 0;
+}
+
+void filter_free(struct filter* filter) {
+    free(filter->out);
+    filter->out = NULL;
+    filter->out_size = filter->out_capacity = 0;
+}
+
+static int append_out(struct filter* filter, const char* buf, size_t size) {
+    if (filter->out_size + size > filter->out_capacity) {
+        size_t capacity = filter->out_capacity ? filter->out_capacity : FILTER_READ_CHUNK;
+        while (capacity < filter->out_size + size) {
+            capacity *= 2;
+        }
+        char* tmp_ptr = realloc(filter->out, capacity);
+        if (tmp_ptr == NULL) {
+            return ENOMEM;
+        }
+        filter->out = tmp_ptr;
+        filter->out_capacity = capacity;
+    }
+    memcpy(filter->out + filter->out_size, buf, size);
+    filter->out_size += size;
+    return 0;
+}
+
+/* memchr is vectorized in glibc, counting the lines this way keeps up with memmem */
+static uint64_t count_newlines(const char* data, size_t size) {
+    uint64_t count = 0;
+    const char* end = data + size;
+    while (data < end && (data = memchr(data, '\n', end - data)) != NULL) {
+        count++;
+        data++;
+    }
+    return count;
+}
+
+static int add_match(struct filter_part* part, uint64_t record, size_t offset, size_t size) {
+    if (part->count == part->capacity) {
+        size_t capacity = part->capacity ? part->capacity * 2 : 64;
+        struct filter_match* tmp_ptr = realloc(part->matches, capacity * sizeof(*tmp_ptr));
+        if (tmp_ptr == NULL) {
+            return ENOMEM;
+        }
+        part->matches = tmp_ptr;
+        part->capacity = capacity;
+    }
+    part->matches[part->count++] = (struct filter_match){ record, offset, size };
+    return 0;
+}
+
+/**
+ * Every pattern keeps the position of its next hit, the earliest one gives the next matching
+ * command. Searching goes on from the end of that command, so a command is reported once however
+ * many patterns it holds, and each pattern is only looked for again once its hit was passed.
+ */
+static void* search_part(void* args) {
+    struct filter_part* part = args;
+    const struct filter* filter = part->filter;
+    const char* data = part->data;
+    const char* end = data + part->end;
+    const char* next_hit[FILTER_PATTERNS_MAX];
+    const char* cursor = data + part->start;
+    /* newlines are counted up to here */
+    const char* counted = cursor;
+    uint64_t record = 0;
+
+    for (unsigned int i = 0; i < filter->pattern_count; i++) {
+        next_hit[i] = memmem(cursor, end - cursor, filter->patterns[i], filter->pattern_sizes[i]);
+    }
+    while (true) {
+        const char* hit = NULL;
+        for (unsigned int i = 0; i < filter->pattern_count; i++) {
+            if (next_hit[i] != NULL && (hit == NULL || next_hit[i] < hit)) {
+                hit = next_hit[i];
+            }
+        }
+        if (hit == NULL) {
+            break;
+        }
+        /* patterns hold no '\n', a hit never spans two commands */
+        const char* record_start = hit > cursor ? memrchr(cursor, '\n', hit - cursor) : NULL;
+        record_start = record_start != NULL ? record_start + 1 : cursor;
+        const char* record_end = memchr(hit, '\n', end - hit);
+        record_end = record_end != NULL ? record_end + 1 : end;
+        record += count_newlines(counted, record_start - counted);
+        counted = record_start;
+        if ((part->ret_val = add_match(part, record, record_start - data, record_end - record_start)) != 0) {
+            return NULL;
+        }
+        cursor = record_end;
+        for (unsigned int i = 0; i < filter->pattern_count; i++) {
+            if (next_hit[i] != NULL && next_hit[i] < cursor) {
+                next_hit[i] = memmem(cursor, end - cursor, filter->patterns[i], filter->pattern_sizes[i]);
+            }
+        }
+    }
+    part->records = record + count_newlines(counted, end - counted);
+    return NULL;
+}
+
+static unsigned int part_count(size_t size) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t parts = size / FILTER_PART_MIN;
+    if (cpus > 0 && parts > (size_t)cpus) {
+        parts = cpus;
+    }
+    if (parts > FILTER_THREADS_MAX) {
+        parts = FILTER_THREADS_MAX;
+    }
+    return parts ? parts : 1;
+}
+
+int filter_search(struct filter* filter, const char* data, size_t size) {
+    struct filter_part parts[FILTER_THREADS_MAX];
+    unsigned int count = part_count(size);
+    size_t start = 0;
+    int ret_val = 0;
+
+    /* parts are cut at the first command boundary past an even split */
+    for (unsigned int i = 0; i < count; i++) {
+        size_t end = size;
+        if (i + 1 < count) {
+            size_t split = (i + 1) * (size / count);
+            if (split < start) {
+                split = start;
+            }
+            const char* newline = memchr(data + split, '\n', size - split);
+            end = newline != NULL ? (size_t)(newline - data) + 1 : size;
+        }
+        parts[i] = (struct filter_part){ .filter = filter, .data = data, .start = start, .end = end };
+        start = end;
+    }
+    /* the first part is searched on this thread, a thread failing to start leaves its part to it too */
+    bool spawned[FILTER_THREADS_MAX] = { false };
+    for (unsigned int i = 1; i < count; i++) {
+        if (parts[i].start < parts[i].end) {
+            spawned[i] = pthread_create(&parts[i].thread, NULL, search_part, &parts[i]) == 0;
+        }
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        if (spawned[i]) {
+            pthread_join(parts[i].thread, NULL);
+        }
+        else if (parts[i].start < parts[i].end) {
+            search_part(&parts[i]);
+        }
+    }
+
+    uint64_t first_record = filter->records;
+    for (unsigned int i = 0; i < count; i++) {
+        for (size_t j = 0; !ret_val && j < parts[i].count; j++) {
+            const struct filter_match* match = &parts[i].matches[j];
+            if (filter->offsets) {
+                char line[FILTER_OFFSET_LINE_MAX];
+                int length = snprintf(line, sizeof(line), "%llu,%llu,%zu\n", (unsigned long long)(first_record + match->record),
+                                      (unsigned long long)(filter->bytes + match->offset), match->size);
+                ret_val = append_out(filter, line, length);
+            }
+            else {
+                ret_val = append_out(filter, data + match->offset, match->size);
+            }
+        }
+        if (!ret_val) {
+            ret_val = parts[i].ret_val;
+        }
+        filter->matches += parts[i].count;
+        first_record += parts[i].records;
+        free(parts[i].matches);
+    }
+    /* a last command without its '\n' still counts */
+    filter->records = first_record + (size > 0 && data[size - 1] != '\n');
+    filter->bytes += size;
+    return ret_val;
+}
+
+int filter_search_file(struct filter* filter, int filed, uint64_t limit) {
+    struct stat file_stat;
+    if (fstat(filed, &file_stat) < 0) {
+        syslog(LOG_ERR, "Could not stat the file to filter, error: %s", strerror(errno));
+        return errno;
+    }
+    /* the device has no size to map, the few commands it keeps are read in */
+    if (S_ISCHR(file_stat.st_mode)) {
+        char* data = NULL;
+        size_t size = 0;
+        int ret_val = 0;
+        while (size < limit) {
+            char* tmp_ptr = realloc(data, size + FILTER_READ_CHUNK);
+            if (tmp_ptr == NULL) {
+                ret_val = ENOMEM;
+                break;
+            }
+            data = tmp_ptr;
+            ssize_t bytes_read = read(filed, data + size, FILTER_READ_CHUNK);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read < 0) {
+                syslog(LOG_ERR, "Error reading from the source file, error: %s", strerror(errno));
+                ret_val = errno;
+                break;
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            size += bytes_read;
+        }
+        if (!ret_val) {
+            ret_val = filter_search(filter, data, size < limit ? size : limit);
+        }
+        free(data);
+        return ret_val;
+    }
+    uint64_t size = (uint64_t)file_stat.st_size < limit ? (uint64_t)file_stat.st_size : limit;
+    if (size == 0) {
+        return 0;
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, filed, 0);
+    if (data == MAP_FAILED) {
+        syslog(LOG_ERR, "Could not map the file to filter, error: %s", strerror(errno));
+        return errno;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    int ret_val = filter_search(filter, data, size);
+    munmap(data, size);
+    return ret_val;
+}
+
+/* one response holding every match, framed like a dump; out is freed right after, so it is sent as a copy */
+int filter_send(struct filter* filter, int socketd, struct send_policy* policy) {
+    size_t response_size = 0;
+    send_policy_begin(policy, socketd);
+    int ret_val = send_response_chunk(socketd, policy, filter->out, filter->out_size, &response_size);
+    if (ret_val) {
+        return ret_val;
+    }
+    return send_response_end(socketd, policy, response_size);
+}
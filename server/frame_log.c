@@ -0,0 +1,197 @@
+#include "frame_log.h"
+#include "crc32c.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+
+bool record_frames_enabled = false;
+
+static int frame_log_path(const char* data_file_name, char* path, size_t size) {
+    int ret_val = snprintf(path, size, "%s%s", data_file_name, FRAME_LOG_SUFFIX);
+    return ret_val < 0 || (size_t)ret_val >= size ? ENAMETOOLONG : 0;
+}
+
+static uint32_t frame_crc(const struct record_frame* frame) {
+    return crc32c(0, frame, offsetof(struct record_frame, frame_crc));
+}
+
+/* crc32c of length bytes of the data file starting at offset */
+static int data_crc(int data_fd, uint64_t offset, uint64_t length, uint32_t* crc) {
+    char* buf = malloc(FRAME_READ_SIZE);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+    *crc = 0;
+    int err = 0;
+    while (length) {
+        ssize_t read_bytes = pread(data_fd, buf, length < FRAME_READ_SIZE ? length : FRAME_READ_SIZE, offset);
+        if (read_bytes <= 0) {
+            if (read_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            err = read_bytes < 0 ? errno : EIO;
+            break;
+        }
+        *crc = crc32c(*crc, buf, read_bytes);
+        offset += read_bytes;
+        length -= read_bytes;
+    }
+    free(buf);
+    return err;
+}
+
+static int write_frame(int filed, uint64_t offset, uint64_t length, uint32_t payload_crc) {
+    struct record_frame frame = { .magic = FRAME_MAGIC, .payload_crc = payload_crc, .offset = offset, .length = length };
+    frame.frame_crc = frame_crc(&frame);
+    ssize_t ret_val;
+    while ((ret_val = write(filed, &frame, sizeof(frame))) < 0 && errno == EINTR) {
+    }
+    if (ret_val < 0) {
+        return errno;
+    }
+    return (size_t)ret_val == sizeof(frame) ? 0 : EIO;
+}
+
+/**
+ * Walks the frames backward from the last one until one matches the data, then cuts both files
+ * right after it: a crash mid-append leaves either a torn frame, a frame whose data never made
+ * it to disk, or data without a frame, and all of those are after the last good frame.
+ * Only the tail is read, so this costs the size of the last record, not of the file.
+ */
+static int recover(int frames_fd, int data_fd, const char* data_file_name, uint64_t* recovered_length) {
+    struct stat frames_stat, data_stat;
+    if (fstat(frames_fd, &frames_stat) < 0 || fstat(data_fd, &data_stat) < 0) {
+        return errno;
+    }
+    uint64_t data_size = data_stat.st_size;
+    uint64_t frame_count = frames_stat.st_size / sizeof(struct record_frame);
+
+    if (frame_count == 0) {
+        /* not even one whole frame, at worst the very first append is kept without being acknowledged */
+        if (frames_stat.st_size && ftruncate(frames_fd, 0) < 0) {
+            return errno;
+        }
+        *recovered_length = data_size;
+        if (data_size == 0) {
+            return 0;
+        }
+        /* data from before framing was turned on, vouch for it as a whole once */
+        uint32_t crc = 0;
+        int ret_val = data_crc(data_fd, 0, data_size, &crc);
+        if (ret_val == 0) {
+            ret_val = write_frame(frames_fd, 0, data_size, crc);
+        }
+        if (ret_val == 0) {
+            syslog(LOG_NOTICE, "Framed the existing %lu bytes of %s", (unsigned long)data_size, data_file_name);
+        }
+        return ret_val;
+    }
+
+    uint64_t valid_frames = frame_count;
+    uint64_t valid_end = 0;
+    while (valid_frames > 0) {
+        struct record_frame frame;
+        ssize_t read_bytes = pread(frames_fd, &frame, sizeof(frame), (valid_frames - 1) * sizeof(frame));
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes == sizeof(frame) && frame.magic == FRAME_MAGIC && frame.frame_crc == frame_crc(&frame) &&
+            frame.offset + frame.length <= data_size) {
+            uint32_t crc = 0;
+            int ret_val = data_crc(data_fd, frame.offset, frame.length, &crc);
+            if (ret_val) {
+                return ret_val;
+            }
+            if (crc == frame.payload_crc) {
+                valid_end = frame.offset + frame.length;
+                break;
+            }
+        }
+        valid_frames--;
+    }
+
+    if ((uint64_t)frames_stat.st_size != valid_frames * sizeof(struct record_frame)) {
+        syslog(LOG_WARNING, "Cutting the frames of %s back to the last %lu valid ones", data_file_name, (unsigned long)valid_frames);
+        if (ftruncate(frames_fd, valid_frames * sizeof(struct record_frame)) < 0) {
+            return errno;
+        }
+    }
+    if (data_size > valid_end) {
+        syslog(LOG_WARNING, "Dropping %lu bytes past the last valid record of %s", (unsigned long)(data_size - valid_end), data_file_name);
+        if (ftruncate(data_fd, valid_end) < 0) {
+            return errno;
+        }
+    }
+    *recovered_length = valid_end;
+    return 0;
+}
+
+/* opens the frames of a data file, first bringing both back to the last valid record */
+int frame_log_open(struct frame_log* log, const char* data_file_name, uint64_t* recovered_length) {
+    char path[4096];
+    struct timespec start, end;
+    log->filed = -1;
+    int ret_val = frame_log_path(data_file_name, path, sizeof(path));
+    if (ret_val) {
+        return ret_val;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int data_fd = open(data_file_name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    log->filed = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (data_fd < 0 || log->filed < 0) {
+        ret_val = errno;
+    }
+    else {
+        ret_val = recover(log->filed, data_fd, data_file_name, recovered_length);
+    }
+    if (data_fd >= 0) {
+        close(data_fd);
+    }
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not recover %s, error: %s", data_file_name, strerror(ret_val));
+        frame_log_close(log);
+        return ret_val;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    syslog(LOG_INFO, "Checked the tail of %s in %ld us", data_file_name,
+           (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+    return 0;
+}
+
+void frame_log_close(struct frame_log* log) {
+    if (log->filed >= 0) {
+        close(log->filed);
+    }
+    log->filed = -1;
+}
+
+void frame_log_remove(const char* data_file_name) {
+    char path[4096];
+    if (frame_log_path(data_file_name, path, sizeof(path)) == 0 && remove(path) < 0 && errno != ENOENT) {
+        syslog(LOG_WARNING, "Failed to remove frames %s, error: %s", path, strerror(errno));
+    }
+}
+
+/**
+ * Records an append that's already in the data file. With sync the frame is synced right away,
+ * the caller syncs the data: if only the frame survives a crash its CRC won't match and recovery
+ * drops it.
+ */
+int frame_log_append(struct frame_log* log, uint64_t offset, uint64_t length, uint32_t payload_crc, bool sync) {
+    int ret_val = write_frame(log->filed, offset, length, payload_crc);
+    if (ret_val == 0 && sync && fdatasync(log->filed) < 0) {
+        ret_val = errno;
+    }
+    if (ret_val) {
+        syslog(LOG_ERR, "Failed to frame record at offset %lu, error: %s", (unsigned long)offset, strerror(ret_val));
+    }
+    return ret_val;
+}
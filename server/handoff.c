@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static char handoff_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+/* UNIX socket we listen on for a successor, only while we are the active server */
+static int control_fd = -1;
+/* connection to the successor (old server) or to the predecessor (new server) */
+static int peer_fd = -1;
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool requested = false;
+static bool clients_wanted = false;
+/* the acceptor saw the request and left its accept loop, see handoff_acceptor_stopped() */
+static bool acceptor_stopped = false;
+static int handed_listen_fd = -1;
+static pthread_t acceptor_thread;
+static handoff_client_callback client_callback = NULL;
+
+static int send_message(int fd, const struct handoff_message* msg, int passed_fd) {
+    struct iovec iov = { .iov_base = (void*)msg, .iov_len = sizeof(*msg) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(control, 0, sizeof(control));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (passed_fd >= 0) {
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+    }
+    if (sendmsg(fd, &hdr, MSG_NOSIGNAL) < 0) {
+        syslog(LOG_ERR, "Failed to send handoff message, error: %s", strerror(errno));
+        return errno;
+    }
+    return 0;
+}
+
+static int recv_message(int fd, struct handoff_message* msg, int* passed_fd) {
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    *passed_fd = -1;
+
+    ssize_t received = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        syslog(LOG_ERR, "Failed to receive handoff message, error: %s", strerror(errno));
+        return errno;
+    }
+    if (received != sizeof(*msg)) {
+        syslog(LOG_ERR, "Handoff peer went away or sent a malformed message (%zd bytes)", received);
+        return EPROTO;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    msg->ip_address[sizeof(msg->ip_address) - 1] = '\0';
+    msg->channel[sizeof(msg->channel) - 1] = '\0';
+    return 0;
+}
+
+static int open_unix_socket(const char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        syslog(LOG_ERR, "Handoff socket path %s is too long", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to open handoff socket, error: %s", strerror(errno));
+    }
+    return fd;
+}
+
+/* waits for a successor, hands it the listening socket and tells the acceptor to stop */
+static void* listener_thread_function(void* args) {
+    while (true) {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Handoff socket accept failed, no hot upgrade possible, error: %s", strerror(errno));
+            return NULL;
+        }
+
+        /* whoever takes over gets the listening socket and the clients, only our own user may */
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+            syslog(LOG_ERR, "Could not check handoff peer credentials, error: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+        if (cred.uid != geteuid()) {
+            syslog(LOG_WARNING, "Refused handoff request from uid %u, pid %d", (unsigned int)cred.uid, (int)cred.pid);
+            close(fd);
+            continue;
+        }
+
+        struct handoff_message msg;
+        int unused_fd = -1;
+        if (recv_message(fd, &msg, &unused_fd) || msg.type != HANDOFF_REQUEST) {
+            if (unused_fd >= 0) {
+                close(unused_fd);
+            }
+            close(fd);
+            continue;
+        }
+
+        struct handoff_message reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.type = HANDOFF_LISTENER;
+        if (send_message(fd, &reply, handed_listen_fd)) {
+            close(fd);
+            continue;
+        }
+        syslog(LOG_NOTICE, "Handed listening socket over to new server%s", msg.want_clients ? ", live connections will follow" : "");
+
+        peer_fd = fd;
+        __atomic_store_n(&clients_wanted, msg.want_clients, __ATOMIC_RELEASE);
+        __atomic_store_n(&requested, true, __ATOMIC_RELEASE);
+        /* the successor owns the socket path from now on */
+        close(control_fd);
+        control_fd = -1;
+        /* a signal landing between the acceptor's last look at the request and accept() is lost */
+        struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+        while (!__atomic_load_n(&acceptor_stopped, __ATOMIC_ACQUIRE)) {
+            pthread_kill(acceptor_thread, HANDOFF_SIGNAL);
+            nanosleep(&poll_interval, NULL);
+        }
+        return NULL;
+    }
+}
+
+int handoff_listen(const char* path, int listen_fd, pthread_t acceptor) {
+    struct sockaddr_un addr;
+    int fd = open_unix_socket(path, &addr);
+    if (fd < 0) {
+        return EINVAL;
+    }
+    if (unlink(path) < 0 && errno != ENOENT) {
+        syslog(LOG_WARNING, "Could not remove stale handoff socket %s, error: %s", path, strerror(errno));
+    }
+    /* owner only, on top of the peer credentials check */
+    mode_t old_mask = umask(0077);
+    int ret_val = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret_val < 0 || listen(fd, 1) < 0) {
+        syslog(LOG_ERR, "Could not bind handoff socket %s, error: %s", path, strerror(errno));
+        close(fd);
+        return errno;
+    }
+
+    strcpy(handoff_path, path);
+    control_fd = fd;
+    handed_listen_fd = listen_fd;
+    acceptor_thread = acceptor;
+
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret_val = pthread_create(&thread_id, &attr, listener_thread_function, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn handoff listener thread, error: %s", strerror(ret_val));
+        close(control_fd);
+        control_fd = -1;
+        return ret_val;
+    }
+    syslog(LOG_NOTICE, "Hot upgrades accepted on %s", path);
+    return 0;
+}
+
+bool handoff_requested(void) {
+    return __atomic_load_n(&requested, __ATOMIC_ACQUIRE);
+}
+
+/* called by the acceptor once out of its loop, the listener stops signalling it */
+void handoff_acceptor_stopped(void) {
+    __atomic_store_n(&acceptor_stopped, true, __ATOMIC_RELEASE);
+}
+
+bool handoff_clients_wanted(void) {
+    return __atomic_load_n(&clients_wanted, __ATOMIC_ACQUIRE);
+}
+
+int handoff_send_client(int socketd, const char* ip_address, const char* channel) {
+    struct handoff_message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = HANDOFF_CLIENT;
+    strncpy(msg.ip_address, ip_address, sizeof(msg.ip_address) - 1);
+    strncpy(msg.channel, channel, sizeof(msg.channel) - 1);
+
+    pthread_mutex_lock(&send_mutex);
+    int ret_val = peer_fd >= 0 ? send_message(peer_fd, &msg, socketd) : ENOTCONN;
+    pthread_mutex_unlock(&send_mutex);
+    return ret_val;
+}
+
+void handoff_finish(void) {
+    struct handoff_message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = HANDOFF_DONE;
+
+    pthread_mutex_lock(&send_mutex);
+    if (peer_fd >= 0) {
+        send_message(peer_fd, &msg, -1);
+        close(peer_fd);
+        peer_fd = -1;
+    }
+    pthread_mutex_unlock(&send_mutex);
+}
+
+void handoff_cleanup(void) {
+    if (control_fd >= 0) {
+        close(control_fd);
+        control_fd = -1;
+        unlink(handoff_path);
+    }
+}
+
+int handoff_acquire(const char* path, bool want_clients, int* listen_fd) {
+    struct sockaddr_un addr;
+    int fd = open_unix_socket(path, &addr);
+    if (fd < 0) {
+        return EINVAL;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        /* nobody to take over from, regular start */
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    struct handoff_message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = HANDOFF_REQUEST;
+    msg.want_clients = want_clients;
+    int ret_val = send_message(fd, &msg, -1);
+    if (ret_val == 0) {
+        ret_val = recv_message(fd, &msg, listen_fd);
+    }
+    if (ret_val == 0 && (msg.type != HANDOFF_LISTENER || *listen_fd < 0)) {
+        syslog(LOG_ERR, "Running server did not hand over its listening socket");
+        ret_val = EPROTO;
+    }
+    if (ret_val) {
+        close(fd);
+        return ret_val;
+    }
+    strcpy(handoff_path, path);
+    peer_fd = fd;
+    syslog(LOG_NOTICE, "Took over listening socket from running server through %s", path);
+    return 0;
+}
+
+/* takes in the live connections of the old server until it is done draining, then accepts upgrades ourselves */
+static void* receiver_thread_function(void* args) {
+    struct handoff_message msg;
+    int fd = -1;
+    unsigned long clients = 0;
+
+    while (recv_message(peer_fd, &msg, &fd) == 0 && msg.type != HANDOFF_DONE) {
+        if (msg.type == HANDOFF_CLIENT && fd >= 0) {
+            client_callback(fd, msg.ip_address, msg.channel);
+            clients++;
+        }
+        else if (fd >= 0) {
+            close(fd);
+        }
+    }
+    syslog(LOG_NOTICE, "Previous server finished draining, %lu live connections taken over", clients);
+    close(peer_fd);
+    peer_fd = -1;
+    handoff_listen(handoff_path, handed_listen_fd, acceptor_thread);
+    return NULL;
+}
+
+int handoff_start_receiver(handoff_client_callback callback, int listen_fd, pthread_t acceptor) {
+    client_callback = callback;
+    handed_listen_fd = listen_fd;
+    acceptor_thread = acceptor;
+
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret_val = pthread_create(&thread_id, &attr, receiver_thread_function, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn handoff receiver thread, error: %s", strerror(ret_val));
+    }
+    return ret_val;
+}
@@ -0,0 +1,17 @@
+#ifndef AESDSOCKET_ADMIN_H
+#define AESDSOCKET_ADMIN_H
+
+/* longest command line the admin socket takes */
+#define ADMIN_LINE_MAX 1024
+/* an admin client idle for this long is dropped, there is only one served at a time */
+#define ADMIN_IDLE_TIMEOUT_SEC 30
+#define LISTEN_BACKLOG_DEFAULT 1
+#define LISTEN_BACKLOG_MAX 4096
+
+/* backlog of the client listening socket, the admin socket can change it */
+extern int listen_backlog;
+
+int admin_start(const char* path, int listen_fd);
+void admin_cleanup(void);
+
+#endif /* AESDSOCKET_ADMIN_H */
@@ -0,0 +1,76 @@
+#ifndef AESDSOCKET_AESDCLIENT_H
+#define AESDSOCKET_AESDCLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * libaesdclient, a client of aesdsocket for services that talk to it a lot. It keeps a pool of
+ * connections in framed mode, so requests are pipelined: a submission returns once the packet is
+ * sent and its callback runs when the response is in, without waiting for the ones before it.
+ * Responses are received straight into the buffer given with the request.
+ *
+ * Requests on one connection are answered in order, requests spread over the pool are not: use
+ * a single connection when the order of the appends matters. A dropped connection is reconnected
+ * in the background; its outstanding requests complete with ECONNRESET, appends among them may or
+ * may not have made it to the log.
+ */
+
+#define AESD_CLIENT_PORT_DEFAULT "9000"
+#define AESD_CLIENT_CONNECTIONS_DEFAULT 4
+#define AESD_CLIENT_IN_FLIGHT_DEFAULT 64
+/* reconnect attempts back off from the first delay to the second */
+#define AESD_CLIENT_RECONNECT_MIN_MS 50
+#define AESD_CLIENT_RECONNECT_MAX_MS 2000
+/* the server has this long to answer the commands setting a new connection up */
+#define AESD_CLIENT_SETUP_TIMEOUT_MS 5000
+
+struct aesd_client_config {
+    /* NULL for localhost */
+    const char* host;
+    /* NULL for AESD_CLIENT_PORT_DEFAULT */
+    const char* port;
+    /* NULL for the default channel */
+    const char* channel;
+    /* 0 for the defaults */
+    unsigned int connections;
+    /* requests outstanding on one connection, submissions wait past it */
+    unsigned int max_in_flight;
+};
+
+struct aesd_client;
+
+/**
+ * Runs on the connection's receiver thread once the response is in, and must not block.
+ * status is 0, EMSGSIZE when the response was larger than the buffer (which then holds the
+ * start of it), EBUSY when the server shed an append under overload (the packet was not stored
+ * and can be sent again later), EROFS when the server is a replica that takes no appends, or
+ * the error that dropped the connection. response_size is the full size.
+ * Without a buffer the response is only counted.
+ */
+typedef void (*aesd_client_callback)(void* user_data, int status, size_t response_size);
+
+int aesd_client_open(const struct aesd_client_config* config, struct aesd_client** client);
+void aesd_client_close(struct aesd_client* client);
+
+/* data is one packet, its terminating '\n' is added when missing, it can't hold another one */
+int aesd_client_append(struct aesd_client* client, const void* data, size_t size,
+                       void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data);
+/* AESDCHAR_IOCSEEKTO, the response is the channel from that write command and offset on */
+int aesd_client_seek(struct aesd_client* client, uint32_t write_cmd, uint32_t offset,
+                     void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data);
+/* AESDCHAR_FILTER, patterns are separated by '|'; with offsets the response lists where the matches are */
+int aesd_client_filter(struct aesd_client* client, const char* patterns, bool offsets,
+                       void* response_buf, size_t response_capacity, aesd_client_callback callback, void* user_data);
+/* waits for every request submitted so far */
+int aesd_client_flush(struct aesd_client* client);
+
+/* blocking versions, response_size may be NULL */
+int aesd_client_append_sync(struct aesd_client* client, const void* data, size_t size,
+                            void* response_buf, size_t response_capacity, size_t* response_size);
+/* up to length bytes starting at that write command and offset, bytes_read is how many there were */
+int aesd_client_read_range(struct aesd_client* client, uint32_t write_cmd, uint32_t offset,
+                           void* buf, size_t length, size_t* bytes_read);
+
+#endif /* AESDSOCKET_AESDCLIENT_H */
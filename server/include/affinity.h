@@ -0,0 +1,39 @@
+#ifndef AESDSOCKET_AFFINITY_H
+#define AESDSOCKET_AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+
+/**
+ * CPU placement of the server threads. Each role has its own CPU set, an empty set means the
+ * scheduler is free to place the thread anywhere (the default).
+ */
+struct affinity_config {
+    cpu_set_t acceptor_cpus;
+    cpu_set_t worker_cpus;
+    cpu_set_t flusher_cpus;
+    /* pin each connection thread to the CPU that received the connection (SO_INCOMING_CPU) */
+    bool steer_to_incoming_cpu;
+};
+
+/* Tracks on which CPU a thread ran last to count cross-core migrations between packets */
+struct cpu_tracker {
+    int last_cpu;
+    unsigned long migrations;
+};
+
+extern struct affinity_config affinity_config;
+
+int parse_cpu_list(const char* list, cpu_set_t* set);
+int pin_current_thread(const cpu_set_t* set);
+int set_thread_attr_affinity(pthread_attr_t* attr, const cpu_set_t* set);
+int worker_cpu_for_socket(int socketd, cpu_set_t* set);
+void cpu_tracker_init(struct cpu_tracker* tracker);
+void cpu_tracker_sample(struct cpu_tracker* tracker);
+unsigned long affinity_total_migrations(void);
+
+#endif /* AESDSOCKET_AFFINITY_H */
@@ -0,0 +1,32 @@
+#ifndef AESDSOCKET_BUSY_POLL_H
+#define AESDSOCKET_BUSY_POLL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* a spin budget that covers a loopback round trip and a short critical section */
+#define BUSY_POLL_US_DEFAULT 200
+
+/**
+ * Busy polling for latency critical deployments (-b): rather than going to sleep as soon as
+ * there's nothing to read, to accept or the channel lock is taken, and paying for a wakeup when
+ * there is, threads spin for up to busy_poll_us first, and only then block as they normally
+ * would. Meant for workers pinned to cores of their own (-w, -a), it burns CPU otherwise.
+ * Off (0) unless asked for.
+ */
+extern unsigned int busy_poll_us;
+
+/* when spinning started now has to give up, 0 when busy polling is off */
+uint64_t busy_poll_deadline(void);
+/* one round of a spin loop, false once the deadline passed and it's time to block */
+bool busy_poll_spin(uint64_t deadline);
+/* lets the kernel poll the device queue of a connection while its reads spin (SO_BUSY_POLL) */
+void busy_poll_socket(int socketd);
+/* read() of a connection socket, spinning on non-blocking reads for a while before blocking */
+ssize_t busy_poll_read(int socketd, void* buf, size_t size);
+/* for the listening socket, returns once a connection is waiting or the budget is spent */
+void busy_poll_wait_readable(int fd);
+
+#endif /* AESDSOCKET_BUSY_POLL_H */
@@ -0,0 +1,41 @@
+#ifndef AESDSOCKET_CAPTURE_H
+#define AESDSOCKET_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* "AECP", followed by the format version, native byte order like the rest of our files */
+#define CAPTURE_MAGIC 0x50434541
+#define CAPTURE_VERSION 1
+/* packets longer than this are recorded by size only, the replayer pads them back */
+#define CAPTURE_PAYLOAD_MAX 4096
+
+enum capture_event_type {
+    CAPTURE_OPEN = 1,
+    CAPTURE_PACKET = 2,
+    CAPTURE_CLOSE = 3
+};
+
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/**
+ * One event of the trace, followed by `captured` bytes of payload. time_ns counts from the
+ * moment the capture started, length is the full size of a packet, captured the part of it
+ * kept in the trace.
+ */
+struct capture_event {
+    uint64_t time_ns;
+    uint64_t connection_id;
+    uint32_t type;
+    uint32_t captured;
+    uint64_t length;
+};
+
+int capture_open(const char* path);
+void capture_record(enum capture_event_type type, unsigned long connection_id, const char* payload, size_t payload_size, size_t length);
+void capture_close(void);
+
+#endif /* AESDSOCKET_CAPTURE_H */
@@ -0,0 +1,81 @@
+#ifndef AESDSOCKET_CHANNEL_H
+#define AESDSOCKET_CHANNEL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "record_index.h"
+#include "fair_lock.h"
+#include "rate_limit.h"
+#include "staging.h"
+#include "shared_log.h"
+#include "frame_log.h"
+#include "send_policy.h"
+#include "tiering.h"
+#include "filter.h"
+#include "shard.h"
+#include "combine.h"
+#include "protocol.h"
+
+#define CHANNEL_TABLE_BUCKETS 64
+/* named channels can't live on the char device, so in that case they're kept as plain files in here */
+#define CHANNEL_FALLBACK_PATH "/var/tmp/aesdsocketdata"
+
+/**
+ * A channel is an independent log: it has its own storage, its own lock and its own version
+ * counter, so connections on different channels never contend with each other.
+ * The default channel (empty name) is the one every connection starts on and uses the
+ * output file passed with -f.
+ */
+struct channel {
+    char* name;
+    char* file_name;
+    /* storage is the aesdchar device, which has its own idea of offsets, so no index either */
+    bool is_device;
+    pthread_mutex_t mutex;
+    /* orders the connections queuing for mutex across clients, see channel_lock() */
+    struct fair_lock gate;
+    /* packets waiting for a connection holding the lock to append them (-B) */
+    struct append_combiner combiner;
+    /* packets/s and bytes/s budget shared by every connection on the channel */
+    struct rate_limiter limiter;
+    /* bumped once per packet appended, only modified while holding mutex */
+    unsigned long version;
+    /* command boundaries of the stored data, regular files only, only accessed while holding mutex */
+    struct record_index index;
+    /* set when other processes append to the same storage (prefork mode), NULL otherwise */
+    struct shared_log* shared;
+    /* length and checksum of every append when records are framed (-C), filed is -1 otherwise */
+    struct frame_log frames;
+    /* history the device evicted (-H), NULL when the storage is not the device or it's not kept */
+    struct cold_tier* tier;
+    /* set on every shard of a sharded channel (-N), shard is the index in it */
+    struct shard_set* shards;
+    unsigned int shard;
+    struct channel* next;
+};
+
+/* cleared through the admin socket to stop syncing every append, faster but a crash may lose the tail */
+extern bool durable_appends;
+
+typedef void (*channel_callback)(struct channel* channel, void* args);
+
+int channel_table_init(const char* default_file_name);
+void channel_table_destroy(bool remove_files);
+int channel_table_discover(void);
+int channel_table_shard(const char* paths, enum shard_routing routing);
+struct channel* channel_get_default(void);
+struct channel* channel_get_or_create(const char* name);
+bool channel_name_is_valid(const char* name);
+void channel_for_each(channel_callback callback, void* args);
+int channel_lock(struct channel* channel, const char* client, size_t cost);
+void channel_unlock(struct channel* channel);
+int channel_append(struct channel* channel, int filed, char* buf, size_t size);
+int channel_append_staged(struct channel* channel, int filed, struct packet_stage* stage, char* buf, size_t size);
+bool channel_can_combine(struct channel* channel);
+int channel_append_combined(struct channel* channel, int filed, struct combine_slot* slot);
+int channel_seek(struct channel* channel, int filed, struct aesd_seekto* seek, uint64_t* dump_from);
+int channel_dump(struct channel* channel, int filed, int socketd, struct send_policy* policy, uint64_t dump_from);
+int channel_filter(struct channel* channel, int filed, struct filter* filter);
+
+#endif /* AESDSOCKET_CHANNEL_H */
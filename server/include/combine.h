@@ -0,0 +1,51 @@
+#ifndef AESDSOCKET_COMBINE_H
+#define AESDSOCKET_COMBINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* packets a combiner writes at most in one go, the writev() limit */
+#define COMBINE_BATCH_MAX 1024
+
+/* a packet waiting to be appended, owned by its connection, which waits until done is set */
+struct combine_slot {
+    char* buf;
+    size_t size;
+    bool taken;
+    bool done;
+    int result;
+    struct combine_slot* next;
+};
+
+/**
+ * Flat combining of the appends to one channel (-B). Connections publish their packet here
+ * before queuing for the channel lock, whoever gets the lock first then takes every packet
+ * published so far and appends them with a single write, and a single sync, on behalf of all.
+ * The connections behind it find their packet stored when their turn comes and go straight to
+ * the dump, which also holds whatever was combined with theirs.
+ */
+struct append_combiner {
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    struct combine_slot* head;
+    struct combine_slot* tail;
+    /* batches written and packets in them, for the stats at exit */
+    unsigned long batches;
+    unsigned long packets;
+};
+
+extern bool combine_appends;
+
+int combiner_init(struct append_combiner* combiner);
+void combiner_destroy(struct append_combiner* combiner);
+void combiner_publish(struct append_combiner* combiner, struct combine_slot* slot, char* buf, size_t size);
+/* true when a combiner already appended the slot, result then tells how that went */
+bool combiner_is_done(struct append_combiner* combiner, struct combine_slot* slot, int* result);
+/* detaches up to COMBINE_BATCH_MAX pending slots, in publishing order, returns how many */
+size_t combiner_take(struct append_combiner* combiner, struct combine_slot** batch);
+void combiner_finish(struct append_combiner* combiner, struct combine_slot** batch, size_t count, int result);
+/* for a connection giving up on its packet before it got the lock, waits out a combiner holding it */
+void combiner_withdraw(struct append_combiner* combiner, struct combine_slot* slot);
+
+#endif /* AESDSOCKET_COMBINE_H */
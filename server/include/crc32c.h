@@ -0,0 +1,13 @@
+#ifndef AESDSOCKET_CRC32C_H
+#define AESDSOCKET_CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli), pass 0 as crc to start a new checksum, the previous result to continue one */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+/* true when crc32c() runs on the CPU crc instructions rather than tables */
+bool crc32c_hardware(void);
+
+#endif /* AESDSOCKET_CRC32C_H */
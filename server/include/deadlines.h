@@ -0,0 +1,42 @@
+#ifndef AESDSOCKET_DEADLINES_H
+#define AESDSOCKET_DEADLINES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+/* connection timeouts in milliseconds, 0 disables the corresponding check */
+struct timeout_config {
+    /* longest silence allowed while waiting for packet bytes */
+    unsigned int idle_ms;
+    /* time a new connection gets to deliver its first complete packet */
+    unsigned int header_ms;
+    /* time a packet gets from its first byte to its '\n' */
+    unsigned int packet_ms;
+};
+
+/**
+ * Deadlines of one connection, backed by a single timer of the timing wheel that's always armed
+ * for the earliest of them. When it fires the socket is shut down, which kicks the connection
+ * thread out of its read so it frees the partial packet and goes away.
+ */
+struct connection_deadlines {
+    struct wheel_timer timer;
+    int socketd;
+    uint64_t header_deadline_ms;
+    uint64_t packet_deadline_ms;
+    bool expired;
+};
+
+extern struct timeout_config timeout_config;
+
+bool timeouts_enabled(void);
+int parse_timeouts(const char* spec, struct timeout_config* config);
+void deadlines_init(struct connection_deadlines* deadlines, int socketd);
+void deadlines_wait_for_bytes(struct connection_deadlines* deadlines, bool packet_started);
+void deadlines_packet_done(struct connection_deadlines* deadlines);
+bool deadlines_expired(struct connection_deadlines* deadlines);
+void deadlines_cancel(struct connection_deadlines* deadlines);
+
+#endif /* AESDSOCKET_DEADLINES_H */
@@ -0,0 +1,45 @@
+#ifndef AESDSOCKET_FAIR_LOCK_H
+#define AESDSOCKET_FAIR_LOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/* credit every waiting client gets per round, in bytes */
+#define FAIR_LOCK_QUANTUM 4096
+/* what a request costs on top of its payload, there's always a full dump back to the client */
+#define FAIR_LOCK_REQUEST_COST 512
+
+struct fair_waiter;
+
+/* the waiters of one client, served in arrival order */
+struct fair_flow {
+    char key[INET6_ADDRSTRLEN];
+    long deficit;
+    struct fair_waiter* head;
+    struct fair_waiter* tail;
+    struct fair_flow* next;
+};
+
+/**
+ * Mutual exclusion handed over with deficit round robin across clients instead of in whatever
+ * order the scheduler wakes threads up: every client with someone waiting gets FAIR_LOCK_QUANTUM
+ * bytes of credit per round, so a client flooding the lock from many connections gets the same
+ * share as one sending a packet now and then. With busy polling, a thread finding it taken spins
+ * until it's free before queuing, but never takes it ahead of the waiters already queued.
+ */
+struct fair_lock {
+    pthread_mutex_t mutex;
+    bool held;
+    /* clients with waiters, in round robin order */
+    struct fair_flow* active_head;
+    struct fair_flow* active_tail;
+};
+
+int fair_lock_init(struct fair_lock* lock);
+void fair_lock_destroy(struct fair_lock* lock);
+int fair_lock_acquire(struct fair_lock* lock, const char* key, size_t cost);
+void fair_lock_release(struct fair_lock* lock);
+
+#endif /* AESDSOCKET_FAIR_LOCK_H */
@@ -0,0 +1,42 @@
+#ifndef AESDSOCKET_FILTER_H
+#define AESDSOCKET_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "send_policy.h"
+#include "protocol.h"
+
+/* the commands themselves are FILTER_COMMAND and FILTER_OFFSETS_COMMAND, see protocol.h */
+#define FILTER_PATTERNS_MAX 16
+/* data searched by each thread at least, smaller regions are searched on the connection's thread */
+#define FILTER_PART_MIN (1024 * 1024)
+#define FILTER_THREADS_MAX 8
+
+struct filter {
+    /* point into the command packet */
+    const char* patterns[FILTER_PATTERNS_MAX];
+    size_t pattern_sizes[FILTER_PATTERNS_MAX];
+    unsigned int pattern_count;
+    bool offsets;
+    /* commands and bytes in the regions searched so far, where the next region starts in the log */
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t matches;
+    /* the response, only as large as the matches */
+    char* out;
+    size_t out_size;
+    size_t out_capacity;
+};
+
+bool is_filter_command(const char* buf, size_t size);
+int filter_init(struct filter* filter, const char* buf, size_t size);
+void filter_free(struct filter* filter);
+/* regions are searched in log order and must end where a command does */
+int filter_search(struct filter* filter, const char* data, size_t size);
+/* a region read from filed, mapped when it's a regular file, up to limit bytes */
+int filter_search_file(struct filter* filter, int filed, uint64_t limit);
+int filter_send(struct filter* filter, int socketd, struct send_policy* policy);
+
+#endif /* AESDSOCKET_FILTER_H */
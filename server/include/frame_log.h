@@ -0,0 +1,38 @@
+#ifndef AESDSOCKET_FRAME_LOG_H
+#define AESDSOCKET_FRAME_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FRAME_LOG_SUFFIX ".frames"
+#define FRAME_MAGIC 0x46534541 /* "AESF" */
+#define FRAME_READ_SIZE (64 * 1024)
+
+/**
+ * Length and CRC32C of one append to a channel data file. Frames are kept in "<file>.frames"
+ * rather than interleaved with the data, so the data file stays exactly what clients are sent
+ * and everything reading it directly (dumps, index, snapshots, replication) is unaffected.
+ */
+struct record_frame {
+    uint32_t magic;
+    uint32_t payload_crc;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t reserved;
+    /* covers the fields above, a torn frame write never passes for a valid frame */
+    uint32_t frame_crc;
+};
+
+struct frame_log {
+    int filed;
+};
+
+/* set by -C, data files are then framed and checked on open */
+extern bool record_frames_enabled;
+
+int frame_log_open(struct frame_log* log, const char* data_file_name, uint64_t* recovered_length);
+void frame_log_close(struct frame_log* log);
+void frame_log_remove(const char* data_file_name);
+int frame_log_append(struct frame_log* log, uint64_t offset, uint64_t length, uint32_t payload_crc, bool sync);
+
+#endif /* AESDSOCKET_FRAME_LOG_H */
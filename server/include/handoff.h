@@ -0,0 +1,46 @@
+#ifndef AESDSOCKET_HANDOFF_H
+#define AESDSOCKET_HANDOFF_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "channel.h"
+
+/* how long a replaced server keeps serving its in-flight connections before giving up on them */
+#define HANDOFF_DRAIN_TIMEOUT_SEC 30
+/* signal used to kick the acceptor and connection threads out of blocking calls during a handoff */
+#define HANDOFF_SIGNAL SIGUSR2
+
+enum handoff_message_type {
+    HANDOFF_REQUEST,
+    HANDOFF_LISTENER,
+    HANDOFF_CLIENT,
+    HANDOFF_DONE
+};
+
+/* what travels over the handoff UNIX socket, along with at most one descriptor (SCM_RIGHTS) */
+struct handoff_message {
+    unsigned int type;
+    /* HANDOFF_REQUEST: the new server is also willing to take over live client connections */
+    bool want_clients;
+    char ip_address[INET6_ADDRSTRLEN];
+    char channel[CHANNEL_NAME_MAX_LEN + 1];
+};
+
+typedef void (*handoff_client_callback)(int socketd, const char* ip_address, const char* channel);
+
+/* new server side */
+int handoff_acquire(const char* path, bool want_clients, int* listen_fd);
+int handoff_start_receiver(handoff_client_callback callback, int listen_fd, pthread_t acceptor);
+
+/* old server side */
+int handoff_listen(const char* path, int listen_fd, pthread_t acceptor);
+bool handoff_requested(void);
+void handoff_acceptor_stopped(void);
+bool handoff_clients_wanted(void);
+int handoff_send_client(int socketd, const char* ip_address, const char* channel);
+void handoff_finish(void);
+void handoff_cleanup(void);
+
+#endif /* AESDSOCKET_HANDOFF_H */
@@ -0,0 +1,38 @@
+#ifndef AESDSOCKET_OVERLOAD_H
+#define AESDSOCKET_OVERLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* CoDel's defaults, queue delay it aims for and how long it must stay above before acting */
+#define OVERLOAD_TARGET_MS_DEFAULT 5
+#define OVERLOAD_INTERVAL_MS_DEFAULT 100
+
+/**
+ * Overload control after CoDel (-O). Every packet reports how long it queued for its channel
+ * lock. Once that delay has stayed above the target for a whole interval, the server sheds:
+ * packets get OVERLOAD_BUSY_REPLY instead of being stored and dumped, at a rate growing with the
+ * square root of the drops so far until the delay is back under target, and connections are
+ * accepted only one per interval meanwhile. Off (target 0) unless asked for.
+ */
+struct overload_config {
+    uint64_t target_ms;
+    uint64_t interval_ms;
+};
+
+extern struct overload_config overload_config;
+
+int overload_parse(const char* value, struct overload_config* config);
+void overload_set(const struct overload_config* config);
+/* false when the packet has to be shed */
+bool overload_admit(void);
+/* bracket the wait for the channel lock, enter returns 0 when overload control is off */
+uint64_t overload_queue_enter(void);
+void overload_queue_leave(uint64_t entered_ns);
+/* while shedding, slows the acceptor down to a connection per interval */
+void overload_wait_to_accept(void);
+unsigned long overload_shed_count(void);
+
+#endif /* AESDSOCKET_OVERLOAD_H */
@@ -0,0 +1,64 @@
+#ifndef AESDSOCKET_PHASE_TRACE_H
+#define AESDSOCKET_PHASE_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+/* "AEPT", followed by the format version, native byte order */
+#define PHASE_TRACE_MAGIC 0x54504541
+#define PHASE_TRACE_VERSION 1
+/* latest requests each connection thread remembers */
+#define PHASE_TRACE_RING 1024
+#define PHASE_TRACE_DIRECTORY "/var/tmp"
+#define PHASE_TRACE_SIGNAL SIGUSR1
+
+/* points of a request, in the order thread_run_function goes through them */
+enum phase_mark {
+    PHASE_READ_START,   /* first byte of the packet read */
+    PHASE_READ_DONE,    /* its '\n' read */
+    PHASE_PARSED,       /* channel commands told apart */
+    PHASE_ADMITTED,     /* out of the rate limits */
+    PHASE_LOCKED,       /* channel lock held */
+    PHASE_WRITTEN,      /* appended to the storage */
+    PHASE_SYNCED,       /* fsync done */
+    PHASE_DUMPED,       /* response sent */
+    PHASE_UNLOCKED,     /* channel lock released */
+    PHASE_MARKS
+};
+
+struct phase_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t marks;
+};
+
+/**
+ * One sampled request. Marks are CLOCK_MONOTONIC nanoseconds, 0 for the points the request
+ * didn't go through (a seek doesn't write, a channel command stops after parsing). send_ns is
+ * the part of the dump spent handing the response to the socket.
+ */
+struct phase_record {
+    uint64_t connection_id;
+    uint64_t packet;
+    uint64_t size;
+    uint64_t send_ns;
+    uint64_t marks[PHASE_MARKS];
+};
+
+/* 0 turns tracing off, otherwise one request out of this many per connection is traced */
+extern unsigned int phase_trace_sample_every;
+
+int phase_trace_start(void);
+int phase_trace_dump(void);
+void phase_trace_thread_start(unsigned long connection_id);
+void phase_trace_thread_end(void);
+void phase_trace_begin(void);
+void phase_trace_mark(enum phase_mark mark);
+uint64_t phase_trace_clock(void);
+void phase_trace_add_send(uint64_t started_ns);
+void phase_trace_end(size_t size);
+
+#endif /* AESDSOCKET_PHASE_TRACE_H */
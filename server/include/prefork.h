@@ -0,0 +1,18 @@
+#ifndef AESDSOCKET_PREFORK_H
+#define AESDSOCKET_PREFORK_H
+
+#include <stdbool.h>
+
+/* a worker dying this soon after being forked is respawned after a pause, not in a tight loop */
+#define PREFORK_RESPAWN_DELAY_SEC 1
+/* SIGTTIN adds a worker and SIGTTOU retires one, within 1 and this many */
+#define PREFORK_MAX_WORKERS 64
+
+int prefork_start(unsigned int workers);
+void prefork_stop(void);
+bool prefork_is_master(void);
+bool prefork_is_worker(void);
+bool prefork_is_leader(void);
+int prefork_worker_index(void);
+
+#endif /* AESDSOCKET_PREFORK_H */
@@ -0,0 +1,29 @@
+#ifndef AESDSOCKET_PROBES_H
+#define AESDSOCKET_PROBES_H
+
+/**
+ * USDT tracepoints under the "aesdsocket" provider, see tracing/ for bpftrace scripts using them.
+ * With <sys/sdt.h> around each probe is a single nop in the code plus a note in the ELF file, the
+ * arguments are only fetched by a tracer once it attaches. Without it (or built with
+ * DISABLE_PROBES=1) they compile to nothing.
+ *
+ * Every connection probe takes the connection id as its first argument.
+ */
+#if !defined(AESDSOCKET_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESDSOCKET_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef AESDSOCKET_HAVE_PROBES
+#define AESD_PROBE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define AESD_PROBE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#define AESD_PROBE3(name, a, b, c) DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#else
+#define AESD_PROBE1(name, a) do { (void)(a); } while (0)
+#define AESD_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define AESD_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif /* AESDSOCKET_PROBES_H */
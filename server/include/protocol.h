@@ -0,0 +1,46 @@
+#ifndef AESDSOCKET_PROTOCOL_H
+#define AESDSOCKET_PROTOCOL_H
+
+/**
+ * What goes over the wire between aesdsocket and its clients, kept apart from the server
+ * headers so aesdreplay and libaesdclient build against it alone. A packet ending with '\n'
+ * is stored and answered with the channel contents, unless it is one of these commands.
+ */
+
+/* command used by a client to pick the channel its packets go to, e.g. "AESDCHAR_CHANNEL:sensors\n" */
+#define CHANNEL_COMMAND "AESDCHAR_CHANNEL:"
+#define CHANNEL_NAME_MAX_LEN 64
+
+/**
+ * "AESDCHAR_IOCSEEKTO:<write command>,<offset>\n", the response is the channel from there on,
+ * or empty when there's no such command or offset.
+ */
+#define SEEK_COMMAND "AESDCHAR_IOCSEEKTO:"
+
+/**
+ * Command switching a connection to framed responses, e.g. for pipelining clients. Every
+ * response is then sent as chunks, each a 32 bit big endian length followed by that many bytes,
+ * and ends with an empty chunk. Commands get an empty response, and packets sent back to back
+ * are split at every '\n' instead of being taken as one.
+ */
+#define FRAMED_COMMAND "AESDCHAR_FRAMED:1"
+#define FRAME_HEADER_SIZE 4
+
+/**
+ * Commands searching the channel instead of dumping it, e.g. "AESDCHAR_FILTER:error|warn\n".
+ * The response is every stored command holding one of the patterns, in log order. With the
+ * offsets variant it's one "<command>,<byte offset>,<size>\n" line per match instead, command
+ * being the index AESDCHAR_IOCSEEKTO takes, so clients can fetch the matches they want later.
+ * Patterns are separated by '|' and can't hold one, nor a '\n'. A malformed filter gets an
+ * empty response.
+ */
+#define FILTER_COMMAND "AESDCHAR_FILTER:"
+#define FILTER_OFFSETS_COMMAND "AESDCHAR_FILTER_OFFSETS:"
+#define FILTER_PATTERN_SEPARATOR '|'
+
+/* answer to a packet shed under overload, it was not stored and can be sent again later */
+#define OVERLOAD_BUSY_REPLY "AESDCHAR_BUSY\n"
+/* answer to a packet sent to a read-only replica, it was not stored, the primary takes writes */
+#define READ_ONLY_REPLY "AESDCHAR_READONLY\n"
+
+#endif /* AESDSOCKET_PROTOCOL_H */
@@ -0,0 +1,44 @@
+#ifndef AESDSOCKET_RATE_LIMIT_H
+#define AESDSOCKET_RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define RATE_LIMIT_TABLE_BUCKETS 256
+
+/* 0 means unlimited */
+struct rate_limits {
+    unsigned long packets_per_sec;
+    unsigned long bytes_per_sec;
+};
+
+/* classic token bucket, refilled at rate tokens per second up to burst (one second worth) */
+struct token_bucket {
+    double tokens;
+    double rate;
+    double burst;
+    uint64_t last_ns;
+};
+
+/* packets/s and bytes/s budget of one client or one channel */
+struct rate_limiter {
+    pthread_mutex_t mutex;
+    struct token_bucket packets;
+    struct token_bucket bytes;
+};
+
+extern struct rate_limits client_rate_limits;
+extern struct rate_limits channel_rate_limits;
+
+int parse_rate_limits(const char* spec, struct rate_limits* limits);
+void rate_limiter_init(struct rate_limiter* limiter, const struct rate_limits* limits);
+void rate_limiter_destroy(struct rate_limiter* limiter);
+void rate_limiter_set(struct rate_limiter* limiter, const struct rate_limits* limits);
+void rate_limit_set_clients(const struct rate_limits* limits);
+struct rate_limiter* rate_limiter_for_client(const char* ip_address);
+void rate_limit_wait(struct rate_limiter* client, struct rate_limiter* channel, size_t bytes);
+void rate_limit_cleanup(void);
+
+#endif /* AESDSOCKET_RATE_LIMIT_H */
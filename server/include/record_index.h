@@ -0,0 +1,38 @@
+#ifndef AESDSOCKET_RECORD_INDEX_H
+#define AESDSOCKET_RECORD_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Start offset of every command (newline terminated record) stored in a regular file channel.
+ * The oldest part of the index can be mapped straight from a snapshot file (see snapshot.h),
+ * the records appended since are kept on the heap.
+ * Only accessed while holding the owning channel mutex.
+ */
+struct record_index {
+    /* offsets restored from a snapshot, read-only */
+    const uint64_t* base;
+    size_t base_count;
+    void* base_map;
+    size_t base_map_length;
+    /* offsets of the records added after the snapshot */
+    uint64_t* tail;
+    size_t tail_count;
+    size_t tail_capacity;
+    /* bytes of the data file covered by the index */
+    uint64_t length;
+    /* true when the next byte stored starts a new record */
+    bool at_boundary;
+};
+
+void record_index_init(struct record_index* index);
+void record_index_free(struct record_index* index);
+size_t record_index_count(const struct record_index* index);
+uint64_t record_index_get(const struct record_index* index, size_t position);
+size_t record_index_find(const struct record_index* index, uint64_t offset);
+int record_index_add(struct record_index* index, const char* buf, size_t size);
+int record_index_catch_up(struct record_index* index, int filed);
+
+#endif /* AESDSOCKET_RECORD_INDEX_H */
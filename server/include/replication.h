@@ -0,0 +1,54 @@
+#ifndef AESDSOCKET_REPLICATION_H
+#define AESDSOCKET_REPLICATION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "channel.h"
+
+#define REPLICATION_MAGIC 0x50455241 /* "AREP" */
+#define REPLICATION_PROTOCOL_VERSION 1
+/* largest entry the primary sends, bigger appends are split */
+#define REPLICATION_CHUNK_SIZE (256 * 1024)
+/* the primary sends an empty entry when idle this long, a replica gives up after three missed */
+#define REPLICATION_HEARTBEAT_SEC 1
+#define REPLICATION_RETRY_SEC 1
+
+/**
+ * Wire format, native byte order as both ends are expected to run on the same kind of host.
+ * A replica opens with a hello and one position per file channel it already holds, the primary
+ * then streams every channel from there on as entries, each followed by its data.
+ */
+struct replication_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t channel_count;
+    uint32_t reserved;
+};
+
+struct replication_position {
+    char channel[CHANNEL_NAME_MAX_LEN + 1];
+    uint8_t reserved[7];
+    uint64_t length;
+    /* records started before length, lets the primary notice a replica that diverged */
+    uint64_t records;
+};
+
+struct replication_entry {
+    uint32_t magic;
+    uint32_t reserved;
+    /* records of the channel started before offset, the replica must have exactly as many */
+    uint64_t sequence;
+    uint64_t offset;
+    /* 0 for a heartbeat */
+    uint64_t length;
+    char channel[CHANNEL_NAME_MAX_LEN + 1];
+    uint8_t reserved_2[7];
+};
+
+int replication_serve(const char* address);
+int replication_follow(const char* address);
+bool replication_is_replica(void);
+void replication_notify(void);
+
+#endif /* AESDSOCKET_REPLICATION_H */
@@ -0,0 +1,42 @@
+#ifndef AESDSOCKET_SEND_POLICY_H
+#define AESDSOCKET_SEND_POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zerocopy.h"
+#include "protocol.h"
+
+/* never grow the socket send buffer past this */
+#define SEND_BUFFER_MAX (4 * 1024 * 1024)
+
+/**
+ * Per connection state of the adaptive send policy: responses spanning several chunks, and
+ * framed responses from their first chunk, are corked while they're assembled and flushed at
+ * once at the end (the socket runs with TCP_NODELAY), and SO_SNDBUF follows the average
+ * response size.
+ */
+struct send_policy {
+    bool corked;
+    /* the client asked for FRAMED_COMMAND */
+    bool framed;
+    int send_buffer_size;
+    /* exponentially weighted average of the response sizes, in bytes */
+    size_t average_response_size;
+    uint32_t segments_out_at_start;
+    unsigned long responses;
+    unsigned long segments;
+    unsigned long bytes;
+    struct zerocopy zerocopy;
+};
+
+extern bool send_policy_enabled;
+
+void send_policy_init(struct send_policy* policy, int socketd);
+void send_policy_begin(struct send_policy* policy, int socketd);
+void send_policy_more_coming(struct send_policy* policy, int socketd);
+int send_policy_frame(struct send_policy* policy, int socketd, size_t chunk_size);
+void send_policy_end(struct send_policy* policy, int socketd, size_t response_size);
+
+#endif /* AESDSOCKET_SEND_POLICY_H */
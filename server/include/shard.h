@@ -0,0 +1,74 @@
+#ifndef AESDSOCKET_SHARD_H
+#define AESDSOCKET_SHARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "send_policy.h"
+#include "filter.h"
+
+#define SHARD_SEQ_SUFFIX ".seq"
+#define SHARD_MAX 16
+#define SHARD_PATH_SEPARATOR ','
+
+struct channel;
+
+enum shard_routing {
+    /* a connection always appends to the same shard, its packets land in one file in order */
+    SHARD_BY_CONNECTION,
+    /* each packet goes to the shard its contents hash to */
+    SHARD_BY_PACKET
+};
+
+/* one per append to a shard, kept in "<shard storage>.seq" */
+struct shard_entry {
+    uint64_t seq;
+    uint64_t size;
+};
+
+/**
+ * What a shard has stored, in append order. mutex is held from the moment an append starts
+ * writing to the storage until its entry is added, so whoever reads the storage while holding it
+ * finds exactly the bytes the entries describe. It nests inside the shard's channel mutex.
+ */
+struct shard_log {
+    pthread_mutex_t mutex;
+    struct shard_entry* entries;
+    size_t count;
+    size_t capacity;
+    /* sum of the entry sizes, every byte appended while sharded */
+    uint64_t length;
+    int seq_filed;
+};
+
+/**
+ * The default channel striped over several storages (-N), the default channel itself being the
+ * first shard. Every shard is a channel of its own, with its own lock, so appends to different
+ * shards never wait for each other. Appends take the next number of a single sequence, dumps
+ * and filters read all shards and merge them back in sequence order.
+ */
+struct shard_set {
+    struct channel* shards[SHARD_MAX];
+    struct shard_log logs[SHARD_MAX];
+    unsigned int count;
+    enum shard_routing routing;
+    uint64_t next_seq;
+};
+
+/* -N, the storages besides -f, and -M */
+extern const char* shard_paths;
+extern enum shard_routing shard_routing;
+
+int shard_set_init(struct shard_set* set, enum shard_routing routing);
+int shard_set_add(struct shard_set* set, struct channel* shard);
+void shard_set_destroy(struct shard_set* set, bool remove_files);
+struct channel* shard_pick(struct channel* channel, unsigned long connection_id, const char* buf, size_t size);
+/* brackets the storage writes of an append to a shard, see struct shard_log */
+void shard_append_begin(struct channel* shard);
+int shard_append_end(struct channel* shard, int filed, uint64_t size, bool stored);
+int shard_dump(struct shard_set* set, int socketd, struct send_policy* policy);
+int shard_filter(struct shard_set* set, struct filter* filter);
+
+#endif /* AESDSOCKET_SHARD_H */
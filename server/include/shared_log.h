@@ -0,0 +1,56 @@
+#ifndef AESDSOCKET_SHARED_LOG_H
+#define AESDSOCKET_SHARED_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "send_policy.h"
+
+#define SHARED_LOG_SUFFIX ".shm"
+#define SHARED_LOG_MAGIC 0x4c534541 /* "AESL" */
+#define SHARED_LOG_FORMAT_VERSION 1
+/* address space the data file is mapped with, appends past it are refused */
+#define SHARED_LOG_MAP_SIZE (sizeof(void*) == 8 ? (1ULL << 36) : (1ULL << 28))
+#define SHARED_LOG_SEND_SIZE (64 * 1024)
+
+/* lives in "<data file>.shm", mapped by every process appending to the data file */
+struct shared_log_header {
+    uint32_t magic;
+    uint32_t format_version;
+    /* process the header was set up for, one left over from an earlier run is reset */
+    pid_t owner;
+    /* robust and process-shared, serializes appends across processes */
+    pthread_mutex_t mutex;
+    /* data file bytes readers may use, only ever grows while holding mutex */
+    uint64_t published_length;
+};
+
+/**
+ * A data file shared by several processes. Appends take the robust mutex in the header and
+ * make the new bytes visible by bumping the published length afterwards, readers don't lock
+ * at all: they load the published length and copy that much straight out of the mapping.
+ * A process dying mid-append leaves its bytes past the published length, the next process
+ * taking the mutex cuts them off.
+ */
+struct shared_log {
+    struct shared_log_header* header;
+    int header_fd;
+    const char* data;
+    int data_fd;
+};
+
+/* processes share data files only when set, see prefork.h */
+extern pid_t shared_log_owner;
+
+struct shared_log* shared_log_open(const char* file_name);
+void shared_log_close(struct shared_log* log);
+void shared_log_remove(const char* file_name);
+int shared_log_lock(struct shared_log* log);
+void shared_log_unlock(struct shared_log* log);
+int shared_log_publish(struct shared_log* log, uint64_t length);
+uint64_t shared_log_length(const struct shared_log* log);
+int shared_log_dump(struct shared_log* log, int socketd, struct send_policy* policy, uint64_t from);
+
+#endif /* AESDSOCKET_SHARED_LOG_H */
@@ -0,0 +1,43 @@
+#ifndef AESDSOCKET_SNAPSHOT_H
+#define AESDSOCKET_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "channel.h"
+#include "record_index.h"
+
+#define SNAPSHOT_MAGIC 0x50534541 /* "AESP" */
+#define SNAPSHOT_FORMAT_VERSION 1
+#define SNAPSHOT_SUFFIX ".snap"
+/* how many bytes at the end of the covered data are checksummed to detect a replaced data file */
+#define SNAPSHOT_TAIL_CHECK_SIZE 4096
+
+/**
+ * On disk layout of a channel snapshot: this header followed by record_count 64 bit record start
+ * offsets, so that the offsets can be used in place once the file is memory-mapped.
+ */
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t format_version;
+    uint64_t channel_version;
+    /* bytes of the data file covered by the snapshot */
+    uint64_t data_length;
+    uint64_t record_count;
+    uint32_t at_boundary;
+    /* crc32c of the last SNAPSHOT_TAIL_CHECK_SIZE bytes covered */
+    uint32_t tail_crc;
+    uint32_t offsets_crc;
+    /* crc32c of all the fields above */
+    uint32_t header_crc;
+};
+
+int snapshot_load(struct record_index* index, const char* data_file_name, unsigned long* version);
+int snapshot_write(struct channel* channel, bool wait_for_lock);
+void snapshot_write_all(bool wait_for_lock);
+void snapshot_remove(const char* data_file_name);
+int snapshot_start(unsigned int interval_sec);
+void snapshot_stop(bool write_final);
+bool snapshot_enabled(void);
+
+#endif /* AESDSOCKET_SNAPSHOT_H */
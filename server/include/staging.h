@@ -0,0 +1,53 @@
+#ifndef AESDSOCKET_STAGING_H
+#define AESDSOCKET_STAGING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* how much of a packet a connection may hold in memory before the rest is staged on disk */
+#define INGEST_MEMORY_CAP_DEFAULT (1024 * 1024)
+/* where packets over the cap are staged, must not be on a tmpfs for constant memory */
+#define STAGING_DIRECTORY "/var/tmp"
+#define STAGING_COPY_SIZE (64 * 1024)
+/* socket bytes spliced at once, what the pipe holds by default */
+#define STAGING_SPLICE_SIZE (64 * 1024)
+
+/**
+ * Staging area of one connection for packets too large to keep in memory. The head of such a
+ * packet is written here as it arrives, and only copied to the channel storage once its
+ * delimiter shows up, so readers never see half a packet. The file is anonymous and reused
+ * by the connection for every large packet.
+ */
+struct packet_stage {
+    int filed;
+    size_t length;
+    /* crc32c of the staged bytes, only kept up when records are framed */
+    uint32_t crc;
+    /* carries spliced bytes from the socket to the file, -1 until the first splice */
+    int pipe_fds[2];
+    /**
+     * Bytes an exact splice moved past the delimiter, the start of the next packets. The caller
+     * takes them over for its carry, see read_str_from_socket(), with one byte to spare.
+     */
+    char* overrun;
+    size_t overrun_size;
+    /* the socket or the file system turned splice() down, the rest is read() */
+    bool splice_failed;
+};
+
+/* 0 lifts the cap, packets are then always buffered whole */
+extern size_t ingest_memory_cap;
+/* past the cap, move the rest of a packet with splice() rather than through the heap buffer */
+extern bool ingest_splice;
+
+void packet_stage_init(struct packet_stage* stage);
+int packet_stage_write(struct packet_stage* stage, const char* buf, size_t size);
+bool packet_stage_can_splice(const struct packet_stage* stage);
+ssize_t packet_stage_splice(struct packet_stage* stage, int socketd, bool exact, bool* complete);
+int packet_stage_publish(struct packet_stage* stage, int filed);
+void packet_stage_reset(struct packet_stage* stage);
+void packet_stage_close(struct packet_stage* stage);
+
+#endif /* AESDSOCKET_STAGING_H */
@@ -0,0 +1,72 @@
+#ifndef AESDSOCKET_TIERING_H
+#define AESDSOCKET_TIERING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "record_index.h"
+#include "staging.h"
+#include "send_policy.h"
+#include "filter.h"
+#include "../../aesd-char-driver/aesd_ioctl.h"
+
+/* commands the device keeps, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED in the driver */
+#define TIER_HOT_ENTRIES 10
+/* cold segments are <base>.cold.<n>, a new one is started once the last grows past this */
+#define TIER_SEGMENT_SUFFIX ".cold"
+#define TIER_SEGMENT_SIZE (16 * 1024 * 1024)
+/* commands evicted but not in a segment yet, appends wait for the spill thread past this */
+#define TIER_SPILL_QUEUE_MAX (16 * 1024 * 1024)
+/* where a dump starts when a seek landed in the device, the cold tier is skipped */
+#define TIER_DUMP_HOT_ONLY UINT64_MAX
+
+struct tier_spill {
+    char* data;
+    size_t size;
+    struct tier_spill* next;
+};
+
+/**
+ * Hot and cold tiers of a device channel (-H). The device is the hot tier and only keeps the last
+ * TIER_HOT_ENTRIES commands; the ones an append is about to evict are read back from it first and
+ * queued, and the spill thread appends them to the cold segments. A dump sends the segments, then
+ * the queue, then the device, so clients see the whole history as one log.
+ * The hot_ fields are only accessed while holding the channel mutex, the others under mutex.
+ */
+struct cold_tier {
+    char* base_path;
+    /* read only handle on the device, to read the commands about to be evicted */
+    int device_filed;
+    size_t hot_sizes[TIER_HOT_ENTRIES];
+    unsigned int hot_first;
+    unsigned int hot_count;
+
+    pthread_mutex_t mutex;
+    /* something was queued, spilled, or we're stopping */
+    pthread_cond_t changed;
+    struct tier_spill* queue_head;
+    struct tier_spill* queue_tail;
+    size_t queued_bytes;
+    /* bytes in the segments, and the offset each segment starts at in the cold log */
+    uint64_t cold_length;
+    uint64_t* segment_starts;
+    unsigned int segment_count;
+    /* command offsets in the cold log, queued commands included */
+    struct record_index index;
+    bool stopping;
+    /* only used by the spill thread */
+    int segment_filed;
+    pthread_t spiller;
+};
+
+extern bool tiered_storage_enabled;
+
+struct cold_tier* tier_open(const char* device_path, const char* base_path);
+void tier_close(struct cold_tier* tier);
+int tier_append(struct cold_tier* tier, struct packet_stage* stage, const char* buf, size_t size);
+int tier_seek(struct cold_tier* tier, int filed, struct aesd_seekto* seek, uint64_t* dump_from);
+int tier_dump(struct cold_tier* tier, int filed, int socketd, struct send_policy* policy, uint64_t dump_from);
+int tier_filter(struct cold_tier* tier, int filed, struct filter* filter);
+
+#endif /* AESDSOCKET_TIERING_H */
@@ -0,0 +1,33 @@
+#ifndef AESDSOCKET_TIMER_WHEEL_H
+#define AESDSOCKET_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_TICK_MS 100
+
+struct wheel_timer;
+/* runs on the wheel thread with the wheel locked, keep it short and don't touch the wheel from it */
+typedef void (*wheel_timer_callback)(struct wheel_timer* timer);
+
+/**
+ * A timer of the hierarchical timing wheel. Embed it in the object it times out and get back
+ * to the object from the callback with container_of style arithmetic, no allocation involved.
+ */
+struct wheel_timer {
+    struct wheel_timer* next;
+    struct wheel_timer* prev;
+    uint64_t expires;
+    wheel_timer_callback callback;
+    bool pending;
+};
+
+int timer_wheel_start(void);
+void wheel_timer_init(struct wheel_timer* timer, wheel_timer_callback callback);
+void wheel_timer_schedule(struct wheel_timer* timer, unsigned int delay_ms);
+void wheel_timer_cancel(struct wheel_timer* timer);
+
+#endif /* AESDSOCKET_TIMER_WHEEL_H */
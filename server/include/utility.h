@@ -1,16 +1,66 @@
+#ifndef AESDSOCKET_UTILITY_H
+#define AESDSOCKET_UTILITY_H
+
 #include <stdlib.h>
+#include <stdbool.h>
 #include <pthread.h>
 
+#include "channel.h"
+#include "affinity.h"
+#include "send_policy.h"
+#include "deadlines.h"
+#include "staging.h"
+
+/* defaults of the read and dump chunk sizes, see read_chunk_size and dump_buffer_size */
+#define CHUNK_SIZE 512
+#define TMP_BUF_SIZE 1024
+/* responses are read into a stack buffer of this size, dump_buffer_size can't go past it */
+#define DUMP_BUFFER_MAX (64 * 1024)
+
+/* bytes read past the end of a framed packet, the start of the packets pipelined after it */
+struct packet_carry {
+    char* data;
+    size_t size;
+};
+
 struct thread_information {
     pthread_t thread_id;
-    pthread_mutex_t* mutex_ptr;
+    /* unique for the life of the server, identifies the connection in the tracepoints */
+    unsigned long connection_id;
+    /* channel the connection is currently writing to, the default one until the client asks otherwise */
+    struct channel* channel;
     char* ip_address;
     int socketd;
-    char* file_name;
+    unsigned long packets;
+    struct cpu_tracker cpu_tracker;
+    struct send_policy send_policy;
+    struct connection_deadlines deadlines;
+    struct packet_stage stage;
+    struct packet_carry carry;
+    /* the packet this connection has waiting in its channel combiner, see combine.h */
+    struct combine_slot combine_slot;
+    /* shared by every connection from the same address, NULL when clients aren't rate limited */
+    struct rate_limiter* rate_limiter;
+    /* set by the acceptor when a new server wants this connection, see drain_after_handoff() */
+    bool handoff_requested;
+    /* set by the thread itself right before it returns */
+    bool finished;
     int thread_return_value;
 };
 
-int read_str_from_socket(int socketd, char** buf_ptr, size_t* buf_size);
+extern size_t read_chunk_size;
+extern size_t dump_buffer_size;
+
+int read_str_from_socket(int socketd, char** buf_ptr, size_t* buf_size, struct connection_deadlines* deadlines, struct packet_stage* stage, struct packet_carry* carry);
 int dump_buffer_to_file(char* buf_ptr, size_t buf_size, int filed);
-int dump_file_to_socket(int filed, int socketd);
+int dump_file_to_socket(int filed, int socketd, struct send_policy* policy, uint64_t from);
+int send_response_chunk(int socketd, struct send_policy* policy, const char* buf, size_t size, size_t* response_size);
+int send_file_contents(int filed, int socketd, struct send_policy* policy, uint64_t limit, size_t* response_size);
+int send_response_end(int socketd, struct send_policy* policy, size_t response_size);
+int send_busy_reply(int socketd, struct send_policy* policy);
+int send_read_only_reply(int socketd, struct send_policy* policy);
+int send_empty_reply(int socketd, struct send_policy* policy);
+bool is_char_device(int filed);
 void* thread_run_function(void* args);
+
+#endif /* AESDSOCKET_UTILITY_H */
@@ -0,0 +1,50 @@
+#ifndef AESDSOCKET_ZEROCOPY_H
+#define AESDSOCKET_ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* below this the copy is cheaper than pinning the pages and reading the completion back */
+#define ZEROCOPY_THRESHOLD_DEFAULT (16 * 1024)
+/* bounce buffers for responses read from a file or the device, each one pinned while in flight */
+#define ZEROCOPY_BUFFER_SIZE (64 * 1024)
+#define ZEROCOPY_BUFFERS 8
+/* how long to wait for the peer to acknowledge data still pinned before giving up on it */
+#define ZEROCOPY_WAIT_TIMEOUT_MS 5000
+
+struct zerocopy_buffer {
+    char* data;
+    /* id of the last send reading from it, it can't be refilled until that one completes */
+    uint32_t last_send;
+    bool in_flight;
+};
+
+/**
+ * MSG_ZEROCOPY state of one connection. The kernel numbers every zero copy send from 0 and
+ * reports them back on the socket error queue once the pages are no longer referenced, which
+ * for TCP happens in order as the peer acknowledges the data.
+ */
+struct zerocopy {
+    bool enabled;
+    /* zero copy sends issued, and how many of those the kernel reported back */
+    uint32_t sends;
+    uint32_t completed;
+    struct zerocopy_buffer buffers[ZEROCOPY_BUFFERS];
+    unsigned int next_buffer;
+    unsigned long bytes;
+    /* completions where the kernel had to copy anyway (loopback, no scatter-gather NIC) */
+    unsigned long copied;
+};
+
+/* 0 keeps every send a plain copy, otherwise sends of at least this many bytes skip the copy */
+extern size_t zerocopy_threshold;
+
+void zerocopy_init(struct zerocopy* zc, int socketd);
+ssize_t zerocopy_send(struct zerocopy* zc, int socketd, const void* buf, size_t size);
+struct zerocopy_buffer* zerocopy_next_buffer(struct zerocopy* zc, int socketd);
+void zerocopy_buffer_sent(struct zerocopy* zc, struct zerocopy_buffer* buffer);
+void zerocopy_close(struct zerocopy* zc, int socketd);
+
+#endif /* AESDSOCKET_ZEROCOPY_H */
@@ -0,0 +1,172 @@
+#include "overload.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+struct overload_config overload_config = { 0, 0 };
+
+/* CoDel state, only accessed while holding state_mutex */
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* when the delay went above target, plus an interval, 0 while it's below */
+static uint64_t first_above_ns = 0;
+static bool dropping = false;
+static uint64_t drop_next_ns = 0;
+static unsigned long drop_count = 0;
+/* last sample above target, shedding stops once nothing queues anymore */
+static uint64_t last_above_ns = 0;
+static unsigned long shed_total = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t isqrt(uint64_t value) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/* CoDel's control law, drops come closer together the longer the delay stays high */
+static uint64_t next_drop(uint64_t now, unsigned long count) {
+    uint64_t interval_ns = overload_config.interval_ms * 1000000ULL;
+    return now + interval_ns / (count > 1 ? isqrt(count) : 1);
+}
+
+/* "<target ms>,<interval ms>", a target of 0 turns overload control off */
+int overload_parse(const char* value, struct overload_config* config) {
+    char* end = NULL;
+    long target = strtol(value, &end, 10);
+    if (end == value || target < 0) {
+        return EINVAL;
+    }
+    long interval = OVERLOAD_INTERVAL_MS_DEFAULT;
+    if (*end == ',') {
+        const char* interval_str = end + 1;
+        interval = strtol(interval_str, &end, 10);
+        if (end == interval_str || interval <= 0) {
+            return EINVAL;
+        }
+    }
+    if (*end != '\0') {
+        return EINVAL;
+    }
+    config->target_ms = target;
+    config->interval_ms = interval;
+    return 0;
+}
+
+void overload_set(const struct overload_config* config) {
+    pthread_mutex_lock(&state_mutex);
+    overload_config = *config;
+    first_above_ns = 0;
+    dropping = false;
+    drop_count = 0;
+    pthread_mutex_unlock(&state_mutex);
+}
+
+/* a quiet interval means whoever was queuing is gone, don't keep shedding on old news */
+static bool still_dropping(uint64_t now) {
+    if (dropping && now - last_above_ns > overload_config.interval_ms * 1000000ULL) {
+        dropping = false;
+        first_above_ns = 0;
+    }
+    return dropping;
+}
+
+bool overload_admit(void) {
+    if (__atomic_load_n(&overload_config.target_ms, __ATOMIC_RELAXED) == 0) {
+        return true;
+    }
+    bool admit = true;
+    pthread_mutex_lock(&state_mutex);
+    uint64_t now = now_ns();
+    if (still_dropping(now) && now >= drop_next_ns) {
+        admit = false;
+        drop_count++;
+        shed_total++;
+        drop_next_ns = next_drop(drop_next_ns, drop_count);
+        if (drop_next_ns < now) {
+            /* a lull between packets doesn't bank drops for later */
+            drop_next_ns = next_drop(now, drop_count);
+        }
+    }
+    pthread_mutex_unlock(&state_mutex);
+    return admit;
+}
+
+uint64_t overload_queue_enter(void) {
+    return __atomic_load_n(&overload_config.target_ms, __ATOMIC_RELAXED) ? now_ns() : 0;
+}
+
+/**
+ * An admitted packet got its lock. Only the delay staying above target for a whole interval
+ * starts shedding, bursts that drain on their own are left alone.
+ */
+void overload_queue_leave(uint64_t entered_ns) {
+    if (entered_ns == 0) {
+        return;
+    }
+    pthread_mutex_lock(&state_mutex);
+    uint64_t now = now_ns();
+    uint64_t queued_ns = now - entered_ns;
+    if (overload_config.target_ms == 0 || queued_ns < overload_config.target_ms * 1000000ULL) {
+        first_above_ns = 0;
+        dropping = false;
+    }
+    else {
+        last_above_ns = now;
+        if (first_above_ns == 0) {
+            first_above_ns = now + overload_config.interval_ms * 1000000ULL;
+        }
+        else if (!dropping && now >= first_above_ns) {
+            dropping = true;
+            /* picking up where the last episode left off if it was recent, as CoDel does */
+            drop_count = drop_count > 2 && now - drop_next_ns < 16 * overload_config.interval_ms * 1000000ULL ? drop_count - 2 : 1;
+            drop_next_ns = now;
+        }
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+void overload_wait_to_accept(void) {
+    if (__atomic_load_n(&overload_config.target_ms, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&state_mutex);
+    bool shedding = still_dropping(now_ns());
+    uint64_t interval_ms = overload_config.interval_ms;
+    pthread_mutex_unlock(&state_mutex);
+    if (!shedding) {
+        return;
+    }
+    /**
+     * One connection per interval while shedding, new ones wait in the listen backlog meanwhile
+     * and the kernel turns away the rest. Holding them all until the load is gone would starve
+     * whoever connected last, as the connections already in keep it up.
+     */
+    struct timespec pause = { .tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000L };
+    nanosleep(&pause, NULL);
+}
+
+unsigned long overload_shed_count(void) {
+    pthread_mutex_lock(&state_mutex);
+    unsigned long count = shed_total;
+    pthread_mutex_unlock(&state_mutex);
+    return count;
+}
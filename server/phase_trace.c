@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include "phase_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Each connection thread writes its sampled requests into a ring only it writes to, publishing
+ * them by bumping head. Readers copy a ring without stopping the writer and drop whatever the
+ * writer may have lapped in the meantime. Rings are pooled, a new connection picks up the ring
+ * of a finished one so its history is still there to dump.
+ */
+struct phase_ring {
+    uint64_t head;
+    struct phase_record records[PHASE_TRACE_RING];
+    struct phase_ring* next;
+    struct phase_ring* next_free;
+};
+
+unsigned int phase_trace_sample_every = 0;
+
+/* every ring ever allocated, and the ones no connection is using right now */
+static struct phase_ring* rings = NULL;
+static struct phase_ring* free_rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static sem_t dump_requests;
+static pthread_t dumper_thread;
+static bool started = false;
+
+/* state of the connection thread, the record is only copied to the ring once complete */
+static __thread struct phase_ring* thread_ring = NULL;
+static __thread struct phase_record current;
+static __thread bool sampling = false;
+static __thread uint64_t thread_packets = 0;
+
+uint64_t phase_trace_clock(void) {
+    if (!sampling) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void phase_trace_thread_start(unsigned long connection_id) {
+    if (!__atomic_load_n(&phase_trace_sample_every, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&rings_mutex);
+    struct phase_ring* ring = free_rings;
+    if (ring != NULL) {
+        free_rings = ring->next_free;
+    }
+    else {
+        ring = calloc(1, sizeof(*ring));
+        if (ring != NULL) {
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    thread_ring = ring;
+    thread_packets = 0;
+    current.connection_id = connection_id;
+}
+
+void phase_trace_thread_end(void) {
+    if (thread_ring == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&rings_mutex);
+    thread_ring->next_free = free_rings;
+    free_rings = thread_ring;
+    pthread_mutex_unlock(&rings_mutex);
+    thread_ring = NULL;
+    sampling = false;
+}
+
+/* called before reading every packet, decides whether this one is traced */
+void phase_trace_begin(void) {
+    /* sampling may be changed (or turned off) through the admin socket at any time */
+    unsigned int every = __atomic_load_n(&phase_trace_sample_every, __ATOMIC_RELAXED);
+    if (thread_ring == NULL || every == 0) {
+        sampling = false;
+        return;
+    }
+    sampling = thread_packets++ % every == 0;
+    if (sampling) {
+        uint64_t connection_id = current.connection_id;
+        memset(&current, 0, sizeof(current));
+        current.connection_id = connection_id;
+        current.packet = thread_packets;
+    }
+}
+
+void phase_trace_mark(enum phase_mark mark) {
+    if (sampling) {
+        current.marks[mark] = phase_trace_clock();
+    }
+}
+
+/* pass the phase_trace_clock() taken right before the send */
+void phase_trace_add_send(uint64_t started_ns) {
+    if (sampling && started_ns) {
+        current.send_ns += phase_trace_clock() - started_ns;
+    }
+}
+
+void phase_trace_end(size_t size) {
+    if (!sampling) {
+        return;
+    }
+    current.size = size;
+    uint64_t head = thread_ring->head;
+    thread_ring->records[head % PHASE_TRACE_RING] = current;
+    __atomic_store_n(&thread_ring->head, head + 1, __ATOMIC_RELEASE);
+    sampling = false;
+}
+
+/* copies what's left of a ring that may be written to meanwhile, returns the records kept */
+static size_t copy_ring(struct phase_ring* ring, struct phase_record* out) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > PHASE_TRACE_RING ? head - PHASE_TRACE_RING : 0;
+    for (uint64_t i = first; i < head; i++) {
+        out[i - first] = ring->records[i % PHASE_TRACE_RING];
+    }
+    /* the writer got this far while we copied, the slots it reused may be torn */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t new_head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t valid_from = new_head >= PHASE_TRACE_RING ? new_head - PHASE_TRACE_RING + 1 : 0;
+    if (valid_from <= first) {
+        return head - first;
+    }
+    if (valid_from >= head) {
+        return 0;
+    }
+    memmove(out, out + (valid_from - first), (head - valid_from) * sizeof(*out));
+    return head - valid_from;
+}
+
+/* writes the records of every ring to PHASE_TRACE_DIRECTORY/aesdsocket-<pid>.phases */
+int phase_trace_dump(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/aesdsocket-%d.phases", PHASE_TRACE_DIRECTORY, (int)getpid());
+    struct phase_record* records = malloc(PHASE_TRACE_RING * sizeof(*records));
+    if (records == NULL) {
+        return ENOMEM;
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        syslog(LOG_ERR, "Could not create phase trace file %s, error: %s", path, strerror(errno));
+        free(records);
+        return errno;
+    }
+    struct phase_trace_header header = {
+        .magic = PHASE_TRACE_MAGIC, .version = PHASE_TRACE_VERSION, .pid = getpid(), .marks = PHASE_MARKS
+    };
+    int ret_val = fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : EIO;
+    unsigned long total = 0;
+    /* rings are only ever added at the head of the list, walking it needs no lock */
+    pthread_mutex_lock(&rings_mutex);
+    struct phase_ring* ring = rings;
+    pthread_mutex_unlock(&rings_mutex);
+    for (; ring != NULL && !ret_val; ring = ring->next) {
+        size_t count = copy_ring(ring, records);
+        if (count && fwrite(records, sizeof(*records), count, file) != count) {
+            ret_val = EIO;
+        }
+        total += count;
+    }
+    if (fclose(file) != 0 && !ret_val) {
+        ret_val = errno;
+    }
+    free(records);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not write phase trace file %s, error: %s", path, strerror(ret_val));
+        return ret_val;
+    }
+    syslog(LOG_NOTICE, "Dumped %lu traced requests to %s", total, path);
+    return 0;
+}
+
+static void dump_signal_handler(int signal_number) {
+    sem_post(&dump_requests);
+}
+
+static void* dumper_run(void* args) {
+    while (true) {
+        if (sem_wait(&dump_requests) == 0) {
+            phase_trace_dump();
+        }
+    }
+    return NULL;
+}
+
+/* dumps happen on PHASE_TRACE_SIGNAL, from a thread of their own since files and signals don't mix */
+int phase_trace_start(void) {
+    if (started) {
+        return 0;
+    }
+    if (sem_init(&dump_requests, 0, 0) < 0) {
+        syslog(LOG_ERR, "Could not create the phase trace semaphore, error: %s", strerror(errno));
+        return errno;
+    }
+    int ret_val = pthread_create(&dumper_thread, NULL, dumper_run, NULL);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not start the phase trace dumper, error: %s", strerror(ret_val));
+        return ret_val;
+    }
+    pthread_detach(dumper_thread);
+    struct sigaction sigact;
+    memset(&sigact, 0, sizeof(sigact));
+    sigact.sa_handler = dump_signal_handler;
+    /* the connection threads must not notice */
+    sigact.sa_flags = SA_RESTART;
+    if (sigaction(PHASE_TRACE_SIGNAL, &sigact, NULL) != 0) {
+        syslog(LOG_ERR, "Could not register the phase trace dump signal, error: %s", strerror(errno));
+        return errno;
+    }
+    started = true;
+    syslog(LOG_NOTICE, "Tracing one request out of %u, send signal %d to dump them", phase_trace_sample_every, PHASE_TRACE_SIGNAL);
+    return 0;
+}
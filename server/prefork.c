@@ -0,0 +1,166 @@
+#include "prefork.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* slots in the worker tables, workers at or past desired_workers are retired as they exit */
+static unsigned int worker_count = 0;
+static pid_t* worker_pids = NULL;
+static time_t* worker_started = NULL;
+static bool* worker_retiring = NULL;
+static volatile sig_atomic_t desired_workers = 0;
+/* -1 in the master, the worker number otherwise */
+static int worker_index = -1;
+static volatile sig_atomic_t stopping = 0;
+
+/* the way other preforking servers do it, no SA_RESTART so the master's waitpid() notices */
+static void worker_count_handler(int signal_number) {
+    if (signal_number == SIGTTIN && desired_workers < PREFORK_MAX_WORKERS) {
+        desired_workers++;
+    }
+    else if (signal_number == SIGTTOU && desired_workers > 1) {
+        desired_workers--;
+    }
+}
+
+/* returns 0 in the new worker, its pid (or -1) in the master */
+static pid_t spawn_worker(unsigned int index) {
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "Failed to fork worker %u, error: %s", index, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        worker_index = index;
+        /* a worker is no use without its master, and would keep the port busy */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master) {
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+    worker_pids[index] = pid;
+    worker_started[index] = time(NULL);
+    worker_retiring[index] = false;
+    syslog(LOG_NOTICE, "Started worker %u with PID %d", index, pid);
+    return pid;
+}
+
+/**
+ * Turns the process into the master of workers processes, which all accept on the listening
+ * socket inherited from it and share the channel data files through shared logs. Only returns
+ * in the workers: the master stays in here respawning the workers that die until it's
+ * terminated, so one crashing worker only takes its own connections down.
+ * Call before any thread is started.
+ */
+int prefork_start(unsigned int workers) {
+    worker_count = PREFORK_MAX_WORKERS;
+    desired_workers = workers < PREFORK_MAX_WORKERS ? workers : PREFORK_MAX_WORKERS;
+    worker_pids = calloc(worker_count, sizeof(pid_t));
+    worker_started = calloc(worker_count, sizeof(time_t));
+    worker_retiring = calloc(worker_count, sizeof(bool));
+    if (worker_pids == NULL || worker_started == NULL || worker_retiring == NULL) {
+        syslog(LOG_ERR, "Failed to allocate worker table, error: %s", strerror(errno));
+        return ENOMEM;
+    }
+    struct sigaction sigact;
+    memset(&sigact, 0, sizeof(sigact));
+    sigact.sa_handler = worker_count_handler;
+    if (sigaction(SIGTTIN, &sigact, NULL) != 0 || sigaction(SIGTTOU, &sigact, NULL) != 0) {
+        syslog(LOG_WARNING, "Could not register the worker count signals, error: %s", strerror(errno));
+    }
+
+    while (true) {
+        /* bring the workers in line with the count asked for */
+        unsigned int desired = desired_workers;
+        for (unsigned int i = 0; i < worker_count && !stopping; i++) {
+            if (i < desired && worker_pids[i] == 0) {
+                if (spawn_worker(i) == 0) {
+                    return 0;
+                }
+            }
+            else if (i >= desired && worker_pids[i] > 0 && !worker_retiring[i]) {
+                syslog(LOG_NOTICE, "Retiring worker %u (PID %d)", i, worker_pids[i]);
+                worker_retiring[i] = true;
+                kill(worker_pids[i], SIGTERM);
+            }
+        }
+
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR || stopping) {
+                continue;
+            }
+            syslog(LOG_ERR, "Waiting for workers failed, error: %s", strerror(errno));
+            sleep(PREFORK_RESPAWN_DELAY_SEC);
+            continue;
+        }
+        for (unsigned int i = 0; i < worker_count; i++) {
+            if (worker_pids[i] != pid) {
+                continue;
+            }
+            if (worker_retiring[i] || i >= (unsigned int)desired_workers) {
+                syslog(LOG_NOTICE, "Worker %u (PID %d) retired", i, pid);
+                worker_pids[i] = 0;
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                syslog(LOG_ERR, "Worker %u (PID %d) killed by signal %d, respawning it", i, pid, WTERMSIG(status));
+            }
+            else {
+                syslog(LOG_WARNING, "Worker %u (PID %d) exited with status %d, respawning it", i, pid, WEXITSTATUS(status));
+            }
+            worker_pids[i] = 0;
+            if (time(NULL) - worker_started[i] < PREFORK_RESPAWN_DELAY_SEC) {
+                sleep(PREFORK_RESPAWN_DELAY_SEC);
+            }
+            if (!stopping && spawn_worker(i) == 0) {
+                return 0;
+            }
+        }
+    }
+}
+
+/* master only, terminates the workers and waits for them to be gone */
+void prefork_stop(void) {
+    stopping = 1;
+    for (unsigned int i = 0; i < worker_count; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], SIGTERM);
+        }
+    }
+    for (unsigned int i = 0; i < worker_count; i++) {
+        if (worker_pids[i] > 0) {
+            while (waitpid(worker_pids[i], NULL, 0) < 0 && errno == EINTR) {
+            }
+            worker_pids[i] = 0;
+        }
+    }
+}
+
+/* -1 outside of the workers */
+int prefork_worker_index(void) {
+    return worker_index;
+}
+
+bool prefork_is_master(void) {
+    return worker_count && worker_index < 0;
+}
+
+bool prefork_is_worker(void) {
+    return worker_index >= 0;
+}
+
+/* the one process doing housekeeping like time stamps and snapshots, worker 0 in prefork mode */
+bool prefork_is_leader(void) {
+    return worker_count == 0 || worker_index == 0;
+}
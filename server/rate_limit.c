@@ -0,0 +1,189 @@
+#include "rate_limit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+
+struct rate_limits client_rate_limits;
+struct rate_limits channel_rate_limits;
+
+struct client_entry {
+    char* ip_address;
+    struct rate_limiter limiter;
+    struct client_entry* next;
+};
+
+/* one limiter per remote address, kept for the lifetime of the server */
+static struct client_entry* client_table[RATE_LIMIT_TABLE_BUCKETS];
+static pthread_mutex_t client_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* "<packets/s>,<bytes/s>", 0 leaves that dimension unlimited */
+int parse_rate_limits(const char* spec, struct rate_limits* limits) {
+    char* end = NULL;
+    long packets = strtol(spec, &end, 10);
+    if (end == spec || *end != ',' || packets < 0) {
+        return EINVAL;
+    }
+    const char* bytes_str = end + 1;
+    long bytes = strtol(bytes_str, &end, 10);
+    if (end == bytes_str || *end != '\0' || bytes < 0) {
+        return EINVAL;
+    }
+    limits->packets_per_sec = packets;
+    limits->bytes_per_sec = bytes;
+    return 0;
+}
+
+static void bucket_init(struct token_bucket* bucket, unsigned long rate) {
+    bucket->rate = rate;
+    bucket->burst = rate;
+    bucket->tokens = rate;
+    bucket->last_ns = now_ns();
+}
+
+/**
+ * Takes cost tokens, letting the bucket go into debt, and returns how long the caller has to
+ * wait for the debt to be paid back. Reserving instead of polling keeps waiters in FIFO order.
+ */
+static uint64_t bucket_reserve(struct token_bucket* bucket, double cost, uint64_t now) {
+    if (bucket->rate == 0) {
+        return 0;
+    }
+    bucket->tokens += (now - bucket->last_ns) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last_ns = now;
+    bucket->tokens -= cost;
+    return bucket->tokens >= 0 ? 0 : (uint64_t)(-bucket->tokens * 1e9 / bucket->rate);
+}
+
+void rate_limiter_init(struct rate_limiter* limiter, const struct rate_limits* limits) {
+    pthread_mutex_init(&limiter->mutex, NULL);
+    bucket_init(&limiter->packets, limits->packets_per_sec);
+    bucket_init(&limiter->bytes, limits->bytes_per_sec);
+}
+
+void rate_limiter_destroy(struct rate_limiter* limiter) {
+    pthread_mutex_destroy(&limiter->mutex);
+}
+
+static void bucket_set(struct token_bucket* bucket, unsigned long rate) {
+    bucket->rate = rate;
+    bucket->burst = rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+}
+
+/* new budget for a limiter in use, waiters already holding a reservation keep it */
+void rate_limiter_set(struct rate_limiter* limiter, const struct rate_limits* limits) {
+    pthread_mutex_lock(&limiter->mutex);
+    bucket_set(&limiter->packets, limits->packets_per_sec);
+    bucket_set(&limiter->bytes, limits->bytes_per_sec);
+    pthread_mutex_unlock(&limiter->mutex);
+}
+
+/**
+ * Changes the per client budget, for the addresses seen so far too. Connections made while
+ * clients weren't limited at all have no limiter and stay unlimited until they reconnect.
+ */
+void rate_limit_set_clients(const struct rate_limits* limits) {
+    pthread_mutex_lock(&client_table_mutex);
+    client_rate_limits = *limits;
+    for (int i = 0; i < RATE_LIMIT_TABLE_BUCKETS; i++) {
+        for (struct client_entry* entry = client_table[i]; entry != NULL; entry = entry->next) {
+            rate_limiter_set(&entry->limiter, limits);
+        }
+    }
+    pthread_mutex_unlock(&client_table_mutex);
+}
+
+static uint64_t limiter_reserve(struct rate_limiter* limiter, size_t bytes) {
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&limiter->mutex);
+    uint64_t packets_wait = bucket_reserve(&limiter->packets, 1, now);
+    uint64_t bytes_wait = bucket_reserve(&limiter->bytes, bytes, now);
+    pthread_mutex_unlock(&limiter->mutex);
+    return packets_wait > bytes_wait ? packets_wait : bytes_wait;
+}
+
+static unsigned long hash_address(const char* ip_address) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = (unsigned char)*ip_address++) != 0) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+/* NULL when clients are not rate limited */
+struct rate_limiter* rate_limiter_for_client(const char* ip_address) {
+    unsigned long bucket = hash_address(ip_address) % RATE_LIMIT_TABLE_BUCKETS;
+    pthread_mutex_lock(&client_table_mutex);
+    if (client_rate_limits.packets_per_sec == 0 && client_rate_limits.bytes_per_sec == 0) {
+        pthread_mutex_unlock(&client_table_mutex);
+        return NULL;
+    }
+    struct client_entry* entry = client_table[bucket];
+    while (entry != NULL && strcmp(entry->ip_address, ip_address) != 0) {
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct client_entry));
+        if (entry == NULL || (entry->ip_address = strdup(ip_address)) == NULL) {
+            syslog(LOG_ERR, "Failed to allocate rate limiter for %s, not limiting it, error: %s", ip_address, strerror(errno));
+            free(entry);
+            pthread_mutex_unlock(&client_table_mutex);
+            return NULL;
+        }
+        rate_limiter_init(&entry->limiter, &client_rate_limits);
+        entry->next = client_table[bucket];
+        client_table[bucket] = entry;
+    }
+    pthread_mutex_unlock(&client_table_mutex);
+    return &entry->limiter;
+}
+
+/**
+ * Blocks until both the client and the channel budget allow a packet of bytes. While we sleep
+ * the connection isn't read, so TCP flow control pushes back on the producer.
+ */
+void rate_limit_wait(struct rate_limiter* client, struct rate_limiter* channel, size_t bytes) {
+    uint64_t wait_ns = 0;
+    if (client != NULL) {
+        wait_ns = limiter_reserve(client, bytes);
+    }
+    if (channel != NULL) {
+        uint64_t channel_wait_ns = limiter_reserve(channel, bytes);
+        wait_ns = channel_wait_ns > wait_ns ? channel_wait_ns : wait_ns;
+    }
+    if (wait_ns) {
+        struct timespec delay = { .tv_sec = wait_ns / 1000000000ULL, .tv_nsec = wait_ns % 1000000000ULL };
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+void rate_limit_cleanup(void) {
+    pthread_mutex_lock(&client_table_mutex);
+    for (int i = 0; i < RATE_LIMIT_TABLE_BUCKETS; i++) {
+        struct client_entry* entry = client_table[i];
+        while (entry != NULL) {
+            struct client_entry* next = entry->next;
+            rate_limiter_destroy(&entry->limiter);
+            free(entry->ip_address);
+            free(entry);
+            entry = next;
+        }
+        client_table[i] = NULL;
+    }
+    pthread_mutex_unlock(&client_table_mutex);
+}
@@ -0,0 +1,124 @@
+#include "record_index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_INITIAL_CAPACITY 1024
+#define INDEX_SCAN_CHUNK (64 * 1024)
+
+void record_index_init(struct record_index* index) {
+    memset(index, 0, sizeof(*index));
+    index->at_boundary = true;
+}
+
+void record_index_free(struct record_index* index) {
+    if (index->base_map != NULL && munmap(index->base_map, index->base_map_length) < 0) {
+        syslog(LOG_WARNING, "Failed to unmap index snapshot, error: %s", strerror(errno));
+    }
+    free(index->tail);
+    record_index_init(index);
+}
+
+size_t record_index_count(const struct record_index* index) {
+    return index->base_count + index->tail_count;
+}
+
+uint64_t record_index_get(const struct record_index* index, size_t position) {
+    if (position < index->base_count) {
+        return index->base[position];
+    }
+    return index->tail[position - index->base_count];
+}
+
+/* number of records starting before offset, binary search as offsets only ever grow */
+size_t record_index_find(const struct record_index* index, uint64_t offset) {
+    size_t low = 0;
+    size_t high = record_index_count(index);
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (record_index_get(index, middle) < offset) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static int push_offset(struct record_index* index, uint64_t offset) {
+    if (index->tail_count == index->tail_capacity) {
+        size_t capacity = index->tail_capacity ? index->tail_capacity * 2 : INDEX_INITIAL_CAPACITY;
+        uint64_t* tmp_ptr = realloc(index->tail, capacity * sizeof(uint64_t));
+        if (tmp_ptr == NULL) {
+            syslog(LOG_ERR, "Failed to grow record index, error: %s", strerror(errno));
+            return ENOMEM;
+        }
+        index->tail = tmp_ptr;
+        index->tail_capacity = capacity;
+    }
+    index->tail[index->tail_count++] = offset;
+    return 0;
+}
+
+/* indexes buf, which was stored right after the bytes already covered */
+int record_index_add(struct record_index* index, const char* buf, size_t size) {
+    const char* ptr = buf;
+    const char* end = buf + size;
+
+    while (ptr < end) {
+        if (index->at_boundary) {
+            int ret_val = push_offset(index, index->length + (ptr - buf));
+            if (ret_val) {
+                return ret_val;
+            }
+            index->at_boundary = false;
+        }
+        const char* newline = memchr(ptr, '\n', end - ptr);
+        if (newline == NULL) {
+            break;
+        }
+        ptr = newline + 1;
+        index->at_boundary = true;
+    }
+    index->length += size;
+    return 0;
+}
+
+/* indexes whatever was stored in filed past the bytes already covered */
+int record_index_catch_up(struct record_index* index, int filed) {
+    struct stat file_stat;
+    if (fstat(filed, &file_stat) < 0) {
+        syslog(LOG_ERR, "Could not stat data file to update its index, error: %s", strerror(errno));
+        return errno;
+    }
+    if ((uint64_t)file_stat.st_size < index->length) {
+        /* the file was truncated or replaced behind our back, start over */
+        syslog(LOG_WARNING, "Data file shrank below its index, rebuilding it");
+        record_index_free(index);
+    }
+
+    char buf[INDEX_SCAN_CHUNK];
+    while (index->length < (uint64_t)file_stat.st_size) {
+        ssize_t bytes_read = pread(filed, buf, sizeof(buf), index->length);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read data file while indexing it, error: %s", strerror(errno));
+            return errno;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        int ret_val = record_index_add(index, buf, bytes_read);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include "replication.h"
+#include "utility.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define REPLICATION_BACKLOG 8
+
+/* primary side, woken up whenever something is appended to any channel */
+static bool serving = false;
+static unsigned long generation = 0;
+static pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+
+/* replica side */
+static bool following = false;
+static char* primary_address = NULL;
+
+/* how far one channel has been sent to a replica */
+struct replica_stream {
+    struct channel* channel;
+    uint64_t sent;
+    struct replica_stream* next;
+};
+
+struct replica {
+    int socketd;
+    char peer[INET6_ADDRSTRLEN];
+    struct replica_stream* streams;
+};
+
+/* positions a replica reports in its hello */
+struct position_list {
+    struct replication_position* items;
+    size_t count;
+    size_t capacity;
+    int error;
+};
+
+/* "/path" is a UNIX socket, "host:port" or just "port" (listening on any address) is TCP */
+static int open_socket(const char* address, bool listening) {
+    if (address[0] == '/') {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, address);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            unlink(address);
+        }
+        if ((listening && (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, REPLICATION_BACKLOG) < 0)) ||
+            (!listening && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256] = {0};
+    const char* port = address;
+    const char* colon = strrchr(address, ':');
+    if (colon != NULL) {
+        if ((size_t)(colon - address) >= sizeof(host)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, address, colon - address);
+        port = colon + 1;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0 };
+    struct addrinfo* result = NULL;
+    int ret_val = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not resolve replication address %s, error: %s", address, gai_strerror(ret_val));
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = -1;
+    int err = 0;
+    for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        if (listening) {
+            int opt_val = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, REPLICATION_BACKLOG) == 0) {
+                break;
+            }
+        }
+        else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        errno = err;
+    }
+    return fd;
+}
+
+static int send_all(int socketd, const void* buf, size_t size) {
+    const char* ptr = buf;
+    while (size) {
+        ssize_t ret_val = send(socketd, ptr, size, MSG_NOSIGNAL);
+        if (ret_val < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        ptr += ret_val;
+        size -= ret_val;
+    }
+    return 0;
+}
+
+static int recv_all(int socketd, void* buf, size_t size) {
+    char* ptr = buf;
+    while (size) {
+        ssize_t ret_val = recv(socketd, ptr, size, 0);
+        if (ret_val < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (ret_val == 0) {
+            return ECONNRESET;
+        }
+        ptr += ret_val;
+        size -= ret_val;
+    }
+    return 0;
+}
+
+void replication_notify(void) {
+    if (!serving) {
+        return;
+    }
+    pthread_mutex_lock(&notify_mutex);
+    generation++;
+    pthread_cond_broadcast(&notify_cond);
+    pthread_mutex_unlock(&notify_mutex);
+}
+
+static struct replica_stream* find_stream(struct replica* replica, struct channel* channel) {
+    struct replica_stream* stream = replica->streams;
+    while (stream != NULL && stream->channel != channel) {
+        stream = stream->next;
+    }
+    return stream;
+}
+
+static struct replica_stream* add_stream(struct replica* replica, struct channel* channel, uint64_t sent) {
+    struct replica_stream* stream = calloc(1, sizeof(struct replica_stream));
+    if (stream != NULL) {
+        stream->channel = channel;
+        stream->sent = sent;
+        stream->next = replica->streams;
+        replica->streams = stream;
+    }
+    return stream;
+}
+
+/* channel_for_each() callback, channels created since the last pass are sent from their start */
+static void track_channel(struct channel* channel, void* args) {
+    struct replica* replica = args;
+    if (!channel->is_device && find_stream(replica, channel) == NULL && add_stream(replica, channel, 0) == NULL) {
+        syslog(LOG_ERR, "Failed to track channel %s for replica %s, error: %s", channel->name, replica->peer, strerror(errno));
+    }
+}
+
+/* picks up each channel where the replica left it, refusing replicas that hold data we don't */
+static int receive_hello(struct replica* replica) {
+    struct replication_hello hello;
+    int ret_val = recv_all(replica->socketd, &hello, sizeof(hello));
+    if (ret_val) {
+        return ret_val;
+    }
+    if (hello.magic != REPLICATION_MAGIC || hello.version != REPLICATION_PROTOCOL_VERSION) {
+        syslog(LOG_ERR, "Replica %s speaks an unknown protocol, dropping it", replica->peer);
+        return EPROTO;
+    }
+    for (uint32_t i = 0; i < hello.channel_count; i++) {
+        struct replication_position position;
+        ret_val = recv_all(replica->socketd, &position, sizeof(position));
+        if (ret_val) {
+            return ret_val;
+        }
+        position.channel[CHANNEL_NAME_MAX_LEN] = '\0';
+        struct channel* channel = channel_get_or_create(position.channel);
+        if (channel == NULL || channel->is_device) {
+            syslog(LOG_ERR, "Replica %s holds channel \"%s\" we can't replicate, dropping it", replica->peer, position.channel);
+            return EPROTO;
+        }
+        pthread_mutex_lock(&channel->mutex);
+        bool consistent = position.length <= channel->index.length &&
+                          record_index_find(&channel->index, position.length) == position.records;
+        pthread_mutex_unlock(&channel->mutex);
+        if (!consistent) {
+            syslog(LOG_ERR, "Replica %s diverged on channel \"%s\" (%lu bytes, %lu records), dropping it",
+                   replica->peer, position.channel, (unsigned long)position.length, (unsigned long)position.records);
+            return EPROTO;
+        }
+        if (add_stream(replica, channel, position.length) == NULL) {
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/* sends whatever the replica is missing of a channel, in entries of up to REPLICATION_CHUNK_SIZE */
+static int stream_channel(struct replica* replica, struct replica_stream* stream, char* buf, bool* sent_any) {
+    struct channel* channel = stream->channel;
+    int filed = -1;
+    int err = 0;
+    while (err == 0) {
+        /* everything up to the indexed length is on disk and never changes again */
+        pthread_mutex_lock(&channel->mutex);
+        uint64_t end = channel->index.length;
+        uint64_t sequence = record_index_find(&channel->index, stream->sent);
+        pthread_mutex_unlock(&channel->mutex);
+        if (stream->sent >= end) {
+            break;
+        }
+        if (filed < 0 && (filed = open(channel->file_name, O_RDONLY | O_CLOEXEC)) < 0) {
+            err = errno;
+            break;
+        }
+        size_t length = end - stream->sent < REPLICATION_CHUNK_SIZE ? end - stream->sent : REPLICATION_CHUNK_SIZE;
+        size_t total_read = 0;
+        while (total_read < length) {
+            ssize_t read_bytes = pread(filed, buf + total_read, length - total_read, stream->sent + total_read);
+            if (read_bytes <= 0) {
+                if (read_bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+                err = read_bytes < 0 ? errno : EIO;
+                break;
+            }
+            total_read += read_bytes;
+        }
+        if (err) {
+            break;
+        }
+        struct replication_entry entry = { .magic = REPLICATION_MAGIC, .sequence = sequence, .offset = stream->sent, .length = length };
+        strncpy(entry.channel, channel->name, CHANNEL_NAME_MAX_LEN);
+        err = send_all(replica->socketd, &entry, sizeof(entry));
+        if (err == 0) {
+            err = send_all(replica->socketd, buf, length);
+        }
+        if (err == 0) {
+            stream->sent += length;
+            *sent_any = true;
+        }
+    }
+    if (filed >= 0) {
+        close(filed);
+    }
+    return err;
+}
+
+static void* replica_sender_function(void* args) {
+    struct replica* replica = args;
+    char* buf = malloc(REPLICATION_CHUNK_SIZE);
+    int ret_val = buf == NULL ? ENOMEM : receive_hello(replica);
+    if (ret_val == 0) {
+        syslog(LOG_NOTICE, "Replica %s subscribed", replica->peer);
+    }
+
+    while (ret_val == 0) {
+        pthread_mutex_lock(&notify_mutex);
+        unsigned long seen = generation;
+        pthread_mutex_unlock(&notify_mutex);
+
+        channel_for_each(track_channel, replica);
+        bool sent_any = false;
+        for (struct replica_stream* stream = replica->streams; stream != NULL && ret_val == 0; stream = stream->next) {
+            ret_val = stream_channel(replica, stream, buf, &sent_any);
+        }
+        if (ret_val || sent_any) {
+            continue;
+        }
+
+        /* replica is up to date, wait for the next append or send a heartbeat */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REPLICATION_HEARTBEAT_SEC;
+        int wait_ret = 0;
+        pthread_mutex_lock(&notify_mutex);
+        while (generation == seen && wait_ret != ETIMEDOUT) {
+            wait_ret = pthread_cond_timedwait(&notify_cond, &notify_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&notify_mutex);
+        if (wait_ret == ETIMEDOUT) {
+            struct replication_entry heartbeat = { .magic = REPLICATION_MAGIC };
+            ret_val = send_all(replica->socketd, &heartbeat, sizeof(heartbeat));
+        }
+    }
+
+    syslog(LOG_NOTICE, "Replica %s disconnected, error: %s", replica->peer, strerror(ret_val));
+    close(replica->socketd);
+    while (replica->streams != NULL) {
+        struct replica_stream* next = replica->streams->next;
+        free(replica->streams);
+        replica->streams = next;
+    }
+    free(buf);
+    free(replica);
+    return NULL;
+}
+
+static void* replication_acceptor_function(void* args) {
+    int listen_fd = (int)(intptr_t)args;
+    while (true) {
+        struct sockaddr_storage peer;
+        socklen_t peer_length = sizeof(peer);
+        int socketd = accept4(listen_fd, (struct sockaddr*)&peer, &peer_length, SOCK_CLOEXEC);
+        if (socketd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                syslog(LOG_ERR, "Failed to accept replica connection, error: %s", strerror(errno));
+                sleep(REPLICATION_RETRY_SEC);
+            }
+            continue;
+        }
+        struct replica* replica = calloc(1, sizeof(struct replica));
+        if (replica == NULL) {
+            syslog(LOG_ERR, "Failed to allocate replica, error: %s", strerror(errno));
+            close(socketd);
+            continue;
+        }
+        replica->socketd = socketd;
+        if (peer.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr, replica->peer, sizeof(replica->peer));
+        }
+        else if (peer.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr, replica->peer, sizeof(replica->peer));
+        }
+        else {
+            strcpy(replica->peer, "local");
+        }
+
+        pthread_t thread_id;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int ret_val = pthread_create(&thread_id, &attr, replica_sender_function, replica);
+        pthread_attr_destroy(&attr);
+        if (ret_val) {
+            syslog(LOG_ERR, "Could not spawn thread for replica %s, error: %s", replica->peer, strerror(ret_val));
+            close(socketd);
+            free(replica);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Primary side: accepts replicas on address and streams every file channel to them, starting
+ * wherever each replica already is. The char device has no offsets of its own, so a default
+ * channel living on it is not replicated.
+ */
+int replication_serve(const char* address) {
+    int listen_fd = open_socket(address, true);
+    if (listen_fd < 0) {
+        int err = errno;
+        syslog(LOG_ERR, "Could not listen for replicas on %s, error: %s", address, strerror(err));
+        return err;
+    }
+    serving = true;
+
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret_val = pthread_create(&thread_id, &attr, replication_acceptor_function, (void*)(intptr_t)listen_fd);
+    pthread_attr_destroy(&attr);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn replication acceptor thread, error: %s", strerror(ret_val));
+        serving = false;
+        close(listen_fd);
+        return ret_val;
+    }
+    if (channel_get_default()->is_device) {
+        syslog(LOG_WARNING, "Default channel is stored on the char device and won't be replicated");
+    }
+    syslog(LOG_NOTICE, "Serving replicas on %s", address);
+    return 0;
+}
+
+/* channel_for_each() callback, what the replica holds of each channel */
+static void add_position(struct channel* channel, void* args) {
+    struct position_list* list = args;
+    if (channel->is_device || list->error) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 8;
+        struct replication_position* tmp_ptr = realloc(list->items, capacity * sizeof(struct replication_position));
+        if (tmp_ptr == NULL) {
+            list->error = ENOMEM;
+            return;
+        }
+        list->items = tmp_ptr;
+        list->capacity = capacity;
+    }
+    struct replication_position* position = &list->items[list->count++];
+    memset(position, 0, sizeof(*position));
+    strncpy(position->channel, channel->name, CHANNEL_NAME_MAX_LEN);
+    pthread_mutex_lock(&channel->mutex);
+    position->length = channel->index.length;
+    position->records = record_index_count(&channel->index);
+    pthread_mutex_unlock(&channel->mutex);
+}
+
+static int send_hello(int socketd) {
+    struct position_list list = {0};
+    channel_for_each(add_position, &list);
+    int ret_val = list.error;
+    if (ret_val == 0) {
+        struct replication_hello hello = { .magic = REPLICATION_MAGIC, .version = REPLICATION_PROTOCOL_VERSION, .channel_count = list.count };
+        ret_val = send_all(socketd, &hello, sizeof(hello));
+    }
+    if (ret_val == 0 && list.count) {
+        ret_val = send_all(socketd, list.items, list.count * sizeof(struct replication_position));
+    }
+    free(list.items);
+    return ret_val;
+}
+
+/* appends an entry exactly where the primary had it, anything else means we diverged */
+static int apply_entry(struct replication_entry* entry, char* buf) {
+    struct channel* channel = channel_get_or_create(entry->channel);
+    if (channel == NULL) {
+        syslog(LOG_ERR, "Primary sent an entry for invalid channel \"%s\"", entry->channel);
+        return EPROTO;
+    }
+    if (channel->is_device) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&channel->mutex);
+    int filed = open(channel->file_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    int ret_val = filed < 0 ? errno : record_index_catch_up(&channel->index, filed);
+    if (ret_val == 0 && (channel->index.length != entry->offset || record_index_count(&channel->index) != entry->sequence)) {
+        syslog(LOG_ERR, "Replica diverged from the primary on channel \"%s\": holding %lu bytes in %zu records, primary sent %lu bytes in %lu",
+               channel->name, (unsigned long)channel->index.length, record_index_count(&channel->index),
+               (unsigned long)entry->offset, (unsigned long)entry->sequence);
+        ret_val = EPROTO;
+    }
+    if (ret_val == 0) {
+        ret_val = channel_append(channel, filed, buf, entry->length);
+    }
+    if (ret_val == 0 && fsync(filed) < 0) {
+        ret_val = errno;
+    }
+    if (filed >= 0) {
+        close(filed);
+    }
+    pthread_mutex_unlock(&channel->mutex);
+    return ret_val;
+}
+
+static int follow_primary(char* buf) {
+    int socketd = open_socket(primary_address, false);
+    if (socketd < 0) {
+        return errno;
+    }
+    /* heartbeats stopping means the primary is gone even if the connection isn't torn down */
+    struct timeval timeout = { .tv_sec = 3 * REPLICATION_HEARTBEAT_SEC };
+    setsockopt(socketd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int ret_val = send_hello(socketd);
+    if (ret_val == 0) {
+        syslog(LOG_NOTICE, "Replicating from %s", primary_address);
+    }
+    while (ret_val == 0) {
+        struct replication_entry entry;
+        ret_val = recv_all(socketd, &entry, sizeof(entry));
+        if (ret_val) {
+            break;
+        }
+        if (entry.magic != REPLICATION_MAGIC || entry.length > REPLICATION_CHUNK_SIZE) {
+            syslog(LOG_ERR, "Malformed entry from primary %s", primary_address);
+            ret_val = EPROTO;
+            break;
+        }
+        if (entry.length == 0) {
+            continue;
+        }
+        entry.channel[CHANNEL_NAME_MAX_LEN] = '\0';
+        ret_val = recv_all(socketd, buf, entry.length);
+        if (ret_val == 0) {
+            ret_val = apply_entry(&entry, buf);
+        }
+    }
+    close(socketd);
+    return ret_val;
+}
+
+static void* replication_follower_function(void* args) {
+    char* buf = args;
+    while (true) {
+        int ret_val = follow_primary(buf);
+        syslog(LOG_WARNING, "Lost replication stream from %s, error: %s, retrying", primary_address, strerror(ret_val));
+        sleep(REPLICATION_RETRY_SEC);
+    }
+    return NULL;
+}
+
+/**
+ * Replica side: keeps the local channels a copy of the primary at address, reconnecting as
+ * needed. The hello tells the primary how much we already hold, which after a restart is what
+ * the snapshot and the data file say, so only what we missed is sent again.
+ * Clients of a replica can read but not write.
+ */
+int replication_follow(const char* address) {
+    primary_address = strdup(address);
+    char* buf = malloc(REPLICATION_CHUNK_SIZE);
+    if (primary_address == NULL || buf == NULL) {
+        syslog(LOG_ERR, "Failed to allocate replication buffers, error: %s", strerror(errno));
+        free(primary_address);
+        free(buf);
+        return ENOMEM;
+    }
+    following = true;
+    /* the hello must cover every channel we hold, not just the ones clients asked for so far */
+    channel_table_discover();
+
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret_val = pthread_create(&thread_id, &attr, replication_follower_function, buf);
+    pthread_attr_destroy(&attr);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn replication thread, error: %s", strerror(ret_val));
+        following = false;
+        free(buf);
+        return ret_val;
+    }
+    return 0;
+}
+
+bool replication_is_replica(void) {
+    return following;
+}
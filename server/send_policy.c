@@ -0,0 +1,110 @@
+#include "send_policy.h"
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+/* netinet/tcp.h lacks the newer tcp_info counters */
+#include <linux/tcp.h>
+
+/* cleared with -n, plain writes so segment counts can be compared against the policy */
+bool send_policy_enabled = true;
+
+static uint32_t segments_out(int socketd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(socketd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return 0;
+    }
+    return info.tcpi_segs_out;
+}
+
+static void set_cork(struct send_policy* policy, int socketd, bool cork) {
+    int opt_val = cork;
+    if (setsockopt(socketd, IPPROTO_TCP, TCP_CORK, &opt_val, sizeof(opt_val)) < 0) {
+        syslog(LOG_WARNING, "Could not %s socket, error: %s", cork ? "cork" : "uncork", strerror(errno));
+        return;
+    }
+    policy->corked = cork;
+}
+
+void send_policy_init(struct send_policy* policy, int socketd) {
+    memset(policy, 0, sizeof(*policy));
+    zerocopy_init(&policy->zerocopy, socketd);
+    socklen_t len = sizeof(policy->send_buffer_size);
+    getsockopt(socketd, SOL_SOCKET, SO_SNDBUF, &policy->send_buffer_size, &len);
+    if (send_policy_enabled) {
+        /* end of response flushes must not wait for the ack of the previous segment */
+        int opt_val = 1;
+        if (setsockopt(socketd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val)) < 0) {
+            syslog(LOG_WARNING, "Could not disable Nagle on connection, error: %s", strerror(errno));
+        }
+    }
+}
+
+void send_policy_begin(struct send_policy* policy, int socketd) {
+    policy->segments_out_at_start = segments_out(socketd);
+}
+
+/* the response does not fit in a single chunk, hold partial segments back until it is complete */
+void send_policy_more_coming(struct send_policy* policy, int socketd) {
+    if (send_policy_enabled && !policy->corked) {
+        set_cork(policy, socketd, true);
+    }
+}
+
+/* on framed connections, announces the next chunk_size bytes of the response, 0 ends it */
+int send_policy_frame(struct send_policy* policy, int socketd, size_t chunk_size) {
+    if (!policy->framed) {
+        return 0;
+    }
+    if (chunk_size) {
+        /* header, chunk and the closing empty frame would go out as three segments, hold them for one flush */
+        send_policy_more_coming(policy, socketd);
+    }
+    uint32_t header = htonl(chunk_size);
+    size_t sent = 0;
+    while (sent < sizeof(header)) {
+        ssize_t bytes_wrote = write(socketd, (char*)&header + sent, sizeof(header) - sent);
+        if (bytes_wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_wrote < 0) {
+            syslog(LOG_ERR, "Failed to write a frame header to socket, error: %s", strerror(errno));
+            return errno;
+        }
+        sent += bytes_wrote;
+    }
+    return 0;
+}
+
+void send_policy_end(struct send_policy* policy, int socketd, size_t response_size) {
+    if (policy->corked) {
+        /* uncorking pushes out whatever is pending right away */
+        set_cork(policy, socketd, false);
+    }
+
+    policy->responses++;
+    policy->bytes += response_size;
+    policy->segments += segments_out(socketd) - policy->segments_out_at_start;
+    policy->average_response_size = policy->responses == 1 ? response_size :
+                                    (policy->average_response_size * 7 + response_size) / 8;
+
+    /* let a whole typical response sit in the send buffer so the writer never blocks halfway */
+    if (send_policy_enabled && policy->average_response_size > (size_t)policy->send_buffer_size &&
+        policy->send_buffer_size < SEND_BUFFER_MAX) {
+        /* setting SO_SNDBUF turns autotuning off for good, only do it when autotuning fell short */
+        socklen_t len = sizeof(policy->send_buffer_size);
+        getsockopt(socketd, SOL_SOCKET, SO_SNDBUF, &policy->send_buffer_size, &len);
+        int size = policy->average_response_size * 2 < SEND_BUFFER_MAX ? policy->average_response_size * 2 : SEND_BUFFER_MAX;
+        if (policy->average_response_size > (size_t)policy->send_buffer_size && size > policy->send_buffer_size &&
+            setsockopt(socketd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0) {
+            len = sizeof(policy->send_buffer_size);
+            getsockopt(socketd, SOL_SOCKET, SO_SNDBUF, &policy->send_buffer_size, &len);
+            syslog(LOG_DEBUG, "Send buffer grown to %d bytes for average response of %zu bytes", policy->send_buffer_size, policy->average_response_size);
+        }
+    }
+}
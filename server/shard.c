@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include "shard.h"
+#include "channel.h"
+#include "crc32c.h"
+#include "utility.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHARD_READ_CHUNK (64 * 1024)
+/* merged runs shorter than this are gathered before being sent */
+#define SHARD_SEND_BUFFER (64 * 1024)
+
+const char* shard_paths = NULL;
+enum shard_routing shard_routing = SHARD_BY_CONNECTION;
+
+/* what a dump or a filter reads of one shard */
+struct shard_view {
+    /* mapped for a regular file, read in for the device */
+    const char* data;
+    void* map;
+    size_t map_length;
+    char* buffer;
+    struct shard_entry* entries;
+    size_t count;
+    size_t next;
+};
+
+typedef int (*shard_run_callback)(void* args, const char* data, size_t size);
+
+static int write_all(int filed, const void* buf, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t ret_val = write(filed, (const char*)buf + written, size - written);
+        if (ret_val < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret_val < 0) {
+            return errno;
+        }
+        written += ret_val;
+    }
+    return 0;
+}
+
+/* the device can't have a file next to it, its entries live with the fallback storage */
+static void seq_path(const struct channel* shard, char* path, size_t size) {
+    if (shard->is_device) {
+        char device_path[4096] = {0};
+        strncpy(device_path, shard->file_name, sizeof(device_path) - 1);
+        snprintf(path, size, "%s.%s%s", CHANNEL_FALLBACK_PATH, basename(device_path), SHARD_SEQ_SUFFIX);
+    }
+    else {
+        snprintf(path, size, "%s%s", shard->file_name, SHARD_SEQ_SUFFIX);
+    }
+}
+
+static int add_entry(struct shard_log* log, uint64_t seq, uint64_t size) {
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 1024;
+        struct shard_entry* tmp_ptr = realloc(log->entries, capacity * sizeof(*tmp_ptr));
+        if (tmp_ptr == NULL) {
+            return ENOMEM;
+        }
+        log->entries = tmp_ptr;
+        log->capacity = capacity;
+    }
+    log->entries[log->count++] = (struct shard_entry){ seq, size };
+    log->length += size;
+    return 0;
+}
+
+static int record_entry(struct shard_set* set, struct shard_log* log, uint64_t size) {
+    uint64_t seq = __atomic_fetch_add(&set->next_seq, 1, __ATOMIC_RELAXED);
+    int ret_val = add_entry(log, seq, size);
+    if (ret_val) {
+        return ret_val;
+    }
+    ret_val = write_all(log->seq_filed, &log->entries[log->count - 1], sizeof(struct shard_entry));
+    if (ret_val == 0 && __atomic_load_n(&durable_appends, __ATOMIC_RELAXED) && fdatasync(log->seq_filed) < 0) {
+        ret_val = errno;
+    }
+    return ret_val;
+}
+
+/**
+ * Loads the entries a previous run left, trimmed to the data actually stored. Data stored without
+ * an entry, because sharding was just turned on or an append was cut short, gets one now.
+ */
+static int load_entries(struct shard_set* set, struct channel* shard, struct shard_log* log) {
+    char path[4096];
+    seq_path(shard, path, sizeof(path));
+    log->seq_filed = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (log->seq_filed < 0) {
+        syslog(LOG_ERR, "Could not open shard sequence file %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+    struct shard_entry entry;
+    ssize_t bytes_read;
+    while ((bytes_read = read(log->seq_filed, &entry, sizeof(entry))) == sizeof(entry)) {
+        int ret_val = add_entry(log, entry.seq, entry.size);
+        if (ret_val) {
+            return ret_val;
+        }
+        if (entry.seq >= set->next_seq) {
+            set->next_seq = entry.seq + 1;
+        }
+    }
+    if (bytes_read < 0) {
+        syslog(LOG_ERR, "Could not read shard sequence file %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+    /* the device drops its oldest commands, only a file has to hold every entry */
+    struct stat file_stat = { 0 };
+    if (!shard->is_device && (stat(shard->file_name, &file_stat) == 0 || errno == ENOENT)) {
+        while (log->count && log->length > (uint64_t)file_stat.st_size) {
+            log->length -= log->entries[--log->count].size;
+        }
+    }
+    if (ftruncate(log->seq_filed, log->count * sizeof(struct shard_entry)) < 0) {
+        syslog(LOG_ERR, "Could not trim shard sequence file %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+    if (!shard->is_device && (uint64_t)file_stat.st_size > log->length) {
+        syslog(LOG_NOTICE, "Shard %s has %llu bytes without a sequence number, appending them to the sequence", shard->file_name,
+               (unsigned long long)(file_stat.st_size - log->length));
+        return record_entry(set, log, file_stat.st_size - log->length);
+    }
+    return 0;
+}
+
+int shard_set_init(struct shard_set* set, enum shard_routing routing) {
+    memset(set, 0, sizeof(*set));
+    set->routing = routing;
+    return 0;
+}
+
+int shard_set_add(struct shard_set* set, struct channel* shard) {
+    if (set->count == SHARD_MAX) {
+        return E2BIG;
+    }
+    struct shard_log* log = &set->logs[set->count];
+    log->seq_filed = -1;
+    int ret_val = pthread_mutex_init(&log->mutex, NULL);
+    if (ret_val) {
+        return ret_val;
+    }
+    ret_val = load_entries(set, shard, log);
+    if (ret_val) {
+        if (log->seq_filed >= 0) {
+            close(log->seq_filed);
+        }
+        free(log->entries);
+        pthread_mutex_destroy(&log->mutex);
+        memset(log, 0, sizeof(*log));
+        return ret_val;
+    }
+    shard->shards = set;
+    shard->shard = set->count;
+    set->shards[set->count++] = shard;
+    return 0;
+}
+
+/* the shard channels themselves belong to the channel table */
+void shard_set_destroy(struct shard_set* set, bool remove_files) {
+    char path[4096];
+    for (unsigned int i = 0; i < set->count; i++) {
+        struct shard_log* log = &set->logs[i];
+        close(log->seq_filed);
+        if (remove_files) {
+            seq_path(set->shards[i], path, sizeof(path));
+            if (unlink(path) < 0 && errno != ENOENT) {
+                syslog(LOG_WARNING, "Failed to remove shard sequence file %s, error: %s", path, strerror(errno));
+            }
+        }
+        free(log->entries);
+        pthread_mutex_destroy(&log->mutex);
+    }
+    set->count = 0;
+}
+
+/* the shard a packet is appended to, channel itself when it isn't sharded */
+struct channel* shard_pick(struct channel* channel, unsigned long connection_id, const char* buf, size_t size) {
+    struct shard_set* set = channel->shards;
+    if (set == NULL || set->count < 2) {
+        return channel;
+    }
+    if (set->routing == SHARD_BY_PACKET) {
+        return set->shards[crc32c(0, buf, size) % set->count];
+    }
+    return set->shards[connection_id % set->count];
+}
+
+void shard_append_begin(struct channel* shard) {
+    pthread_mutex_lock(&shard->shards->logs[shard->shard].mutex);
+}
+
+/* a failed append may still have stored part of the packet, a file's entries keep covering it */
+int shard_append_end(struct channel* shard, int filed, uint64_t size, bool stored) {
+    struct shard_set* set = shard->shards;
+    struct shard_log* log = &set->logs[shard->shard];
+    int ret_val = 0;
+    if (!stored && !shard->is_device) {
+        struct stat file_stat;
+        size = fstat(filed, &file_stat) == 0 && (uint64_t)file_stat.st_size > log->length ? file_stat.st_size - log->length : 0;
+    }
+    if (size) {
+        ret_val = record_entry(set, log, size);
+        if (ret_val) {
+            syslog(LOG_ERR, "Could not record the sequence number of an append to %s, error: %s", shard->file_name, strerror(ret_val));
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return ret_val;
+}
+
+static int read_device(const char* path, char** data, size_t* size) {
+    int filed = open(path, O_RDONLY | O_CLOEXEC);
+    if (filed < 0) {
+        return errno;
+    }
+    *data = NULL;
+    *size = 0;
+    int ret_val = 0;
+    while (true) {
+        char* tmp_ptr = realloc(*data, *size + SHARD_READ_CHUNK);
+        if (tmp_ptr == NULL) {
+            ret_val = ENOMEM;
+            break;
+        }
+        *data = tmp_ptr;
+        ssize_t bytes_read = read(filed, *data + *size, SHARD_READ_CHUNK);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            ret_val = bytes_read < 0 ? errno : 0;
+            break;
+        }
+        *size += bytes_read;
+    }
+    close(filed);
+    return ret_val;
+}
+
+/**
+ * Takes what a shard holds right now. The device only keeps its last commands: the entries are
+ * matched from the newest back, a command only partly left on it is skipped.
+ */
+static int open_view(struct shard_set* set, unsigned int index, struct shard_view* view) {
+    struct channel* shard = set->shards[index];
+    struct shard_log* log = &set->logs[index];
+    int ret_val = 0;
+    size_t device_size = 0;
+    pthread_mutex_lock(&log->mutex);
+    uint64_t length = log->length;
+    view->count = log->count;
+    view->entries = malloc((log->count ? log->count : 1) * sizeof(struct shard_entry));
+    if (view->entries == NULL) {
+        ret_val = ENOMEM;
+    }
+    else {
+        memcpy(view->entries, log->entries, log->count * sizeof(struct shard_entry));
+        if (shard->is_device) {
+            ret_val = read_device(shard->file_name, &view->buffer, &device_size);
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not read shard %s, error: %s", shard->file_name, strerror(ret_val));
+        return ret_val;
+    }
+    if (shard->is_device) {
+        uint64_t kept = 0;
+        size_t first = view->count;
+        while (first > 0 && kept + view->entries[first - 1].size <= device_size) {
+            kept += view->entries[--first].size;
+        }
+        view->next = first;
+        view->data = view->buffer + (device_size - kept);
+        return 0;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    int filed = open(shard->file_name, O_RDONLY | O_CLOEXEC);
+    if (filed < 0) {
+        syslog(LOG_ERR, "Could not open shard %s, error: %s", shard->file_name, strerror(errno));
+        return errno;
+    }
+    /* appends only ever go past length, what's mapped doesn't change under us */
+    view->map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, filed, 0);
+    close(filed);
+    if (view->map == MAP_FAILED) {
+        view->map = NULL;
+        syslog(LOG_ERR, "Could not map shard %s, error: %s", shard->file_name, strerror(errno));
+        return errno;
+    }
+    view->map_length = length;
+    view->data = view->map;
+    madvise(view->map, length, MADV_SEQUENTIAL);
+    return 0;
+}
+
+static void close_view(struct shard_view* view) {
+    if (view->map != NULL) {
+        munmap(view->map, view->map_length);
+    }
+    free(view->buffer);
+    free(view->entries);
+}
+
+/**
+ * Hands every run of consecutive appends to callback in sequence order. A run is as long as its
+ * shard holds the lowest sequence numbers, one callback covers it since it's contiguous there.
+ */
+static int merge(struct shard_set* set, shard_run_callback callback, void* args) {
+    struct shard_view views[SHARD_MAX];
+    memset(views, 0, sizeof(views));
+    int ret_val = 0;
+    for (unsigned int i = 0; !ret_val && i < set->count; i++) {
+        ret_val = open_view(set, i, &views[i]);
+    }
+    while (!ret_val) {
+        int lowest = -1;
+        uint64_t lowest_seq = UINT64_MAX;
+        uint64_t second_seq = UINT64_MAX;
+        for (unsigned int i = 0; i < set->count; i++) {
+            if (views[i].next == views[i].count) {
+                continue;
+            }
+            uint64_t seq = views[i].entries[views[i].next].seq;
+            if (seq < lowest_seq) {
+                second_seq = lowest_seq;
+                lowest_seq = seq;
+                lowest = i;
+            }
+            else if (seq < second_seq) {
+                second_seq = seq;
+            }
+        }
+        if (lowest < 0) {
+            break;
+        }
+        struct shard_view* view = &views[lowest];
+        const char* run = view->data;
+        size_t size = 0;
+        do {
+            size += view->entries[view->next++].size;
+        } while (view->next < view->count && view->entries[view->next].seq < second_seq);
+        view->data += size;
+        ret_val = callback(args, run, size);
+    }
+    for (unsigned int i = 0; i < set->count; i++) {
+        close_view(&views[i]);
+    }
+    return ret_val;
+}
+
+struct dump_state {
+    int socketd;
+    struct send_policy* policy;
+    char* buffer;
+    size_t buffered;
+    size_t response_size;
+};
+
+/**
+ * The gather buffer is refilled and the views unmapped as soon as a send returns, so they go out
+ * as plain copies through send_response_chunk(), never with MSG_ZEROCOPY.
+ */
+static int flush_dump(struct dump_state* state) {
+    int ret_val = send_response_chunk(state->socketd, state->policy, state->buffer, state->buffered, &state->response_size);
+    state->buffered = 0;
+    return ret_val;
+}
+
+/* interleaved shards make for short runs, those are gathered so they don't cost a send each */
+static int dump_run(void* args, const char* data, size_t size) {
+    struct dump_state* state = args;
+    if (state->buffered + size > SHARD_SEND_BUFFER) {
+        int ret_val = flush_dump(state);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    if (size >= SHARD_SEND_BUFFER) {
+        return send_response_chunk(state->socketd, state->policy, data, size, &state->response_size);
+    }
+    memcpy(state->buffer + state->buffered, data, size);
+    state->buffered += size;
+    return 0;
+}
+
+int shard_dump(struct shard_set* set, int socketd, struct send_policy* policy) {
+    struct dump_state state = { .socketd = socketd, .policy = policy };
+    state.buffer = malloc(SHARD_SEND_BUFFER);
+    if (state.buffer == NULL) {
+        return ENOMEM;
+    }
+    send_policy_begin(policy, socketd);
+    int ret_val = merge(set, dump_run, &state);
+    if (!ret_val) {
+        ret_val = flush_dump(&state);
+    }
+    free(state.buffer);
+    if (ret_val) {
+        return ret_val;
+    }
+    return send_response_end(socketd, policy, state.response_size);
+}
+
+static int filter_run(void* args, const char* data, size_t size) {
+    return filter_search(args, data, size);
+}
+
+int shard_filter(struct shard_set* set, struct filter* filter) {
+    return merge(set, filter_run, filter);
+}
@@ -0,0 +1,181 @@
+#include "shared_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+pid_t shared_log_owner = 0;
+
+static int header_path(const char* file_name, char* path, size_t size) {
+    int ret_val = snprintf(path, size, "%s%s", file_name, SHARED_LOG_SUFFIX);
+    return ret_val < 0 || (size_t)ret_val >= size ? ENAMETOOLONG : 0;
+}
+
+/* sets the header up for this run, call holding the header file lock */
+static int reset_header(struct shared_log* log) {
+    struct stat data_stat;
+    if (fstat(log->data_fd, &data_stat) < 0) {
+        return errno;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int ret_val = pthread_mutex_init(&log->header->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret_val) {
+        return ret_val;
+    }
+    log->header->published_length = data_stat.st_size;
+    log->header->owner = shared_log_owner;
+    log->header->format_version = SHARED_LOG_FORMAT_VERSION;
+    log->header->magic = SHARED_LOG_MAGIC;
+    return 0;
+}
+
+struct shared_log* shared_log_open(const char* file_name) {
+    char path[4096];
+    struct shared_log* log = calloc(1, sizeof(struct shared_log));
+    if (log == NULL) {
+        syslog(LOG_ERR, "Failed to allocate shared log for %s, error: %s", file_name, strerror(errno));
+        return NULL;
+    }
+    log->header_fd = -1;
+    log->data_fd = -1;
+    log->header = MAP_FAILED;
+    log->data = MAP_FAILED;
+
+    int ret_val = header_path(file_name, path, sizeof(path));
+    if (ret_val == 0) {
+        log->header_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        log->data_fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+        ret_val = log->header_fd < 0 || log->data_fd < 0 ? errno : 0;
+    }
+    /* several workers may open the same channel at once, only one of them sets the header up */
+    if (ret_val == 0 && flock(log->header_fd, LOCK_EX) < 0) {
+        ret_val = errno;
+    }
+    if (ret_val == 0) {
+        struct stat header_stat;
+        if (fstat(log->header_fd, &header_stat) < 0 ||
+            ((size_t)header_stat.st_size < sizeof(struct shared_log_header) && ftruncate(log->header_fd, sizeof(struct shared_log_header)) < 0)) {
+            ret_val = errno;
+        }
+        else if ((log->header = mmap(NULL, sizeof(struct shared_log_header), PROT_READ | PROT_WRITE, MAP_SHARED, log->header_fd, 0)) == MAP_FAILED) {
+            ret_val = errno;
+        }
+        else if (log->header->magic != SHARED_LOG_MAGIC || log->header->format_version != SHARED_LOG_FORMAT_VERSION ||
+                 log->header->owner != shared_log_owner) {
+            ret_val = reset_header(log);
+        }
+        flock(log->header_fd, LOCK_UN);
+    }
+    /* readers only ever touch what's been published, which is always inside the file */
+    if (ret_val == 0 && (log->data = mmap(NULL, SHARED_LOG_MAP_SIZE, PROT_READ, MAP_SHARED, log->data_fd, 0)) == MAP_FAILED) {
+        ret_val = errno;
+    }
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not share %s between processes, error: %s", file_name, strerror(ret_val));
+        shared_log_close(log);
+        return NULL;
+    }
+    return log;
+}
+
+void shared_log_close(struct shared_log* log) {
+    if (log->data != MAP_FAILED) {
+        munmap((void*)log->data, SHARED_LOG_MAP_SIZE);
+    }
+    if (log->header != MAP_FAILED) {
+        munmap(log->header, sizeof(struct shared_log_header));
+    }
+    if (log->data_fd >= 0) {
+        close(log->data_fd);
+    }
+    if (log->header_fd >= 0) {
+        close(log->header_fd);
+    }
+    free(log);
+}
+
+void shared_log_remove(const char* file_name) {
+    char path[4096];
+    if (header_path(file_name, path, sizeof(path)) == 0 && remove(path) < 0 && errno != ENOENT) {
+        syslog(LOG_WARNING, "Failed to remove shared log header %s, error: %s", path, strerror(errno));
+    }
+}
+
+int shared_log_lock(struct shared_log* log) {
+    int ret_val = pthread_mutex_lock(&log->header->mutex);
+    if (ret_val == EOWNERDEAD) {
+        /* the previous owner died mid-append, drop whatever it didn't get to publish */
+        uint64_t published = shared_log_length(log);
+        syslog(LOG_WARNING, "Recovering shared log after a worker died appending, truncating to %lu bytes", (unsigned long)published);
+        if (ftruncate(log->data_fd, published) < 0) {
+            syslog(LOG_ERR, "Failed to drop unpublished data, error: %s", strerror(errno));
+        }
+        pthread_mutex_consistent(&log->header->mutex);
+        ret_val = 0;
+    }
+    return ret_val;
+}
+
+void shared_log_unlock(struct shared_log* log) {
+    pthread_mutex_unlock(&log->header->mutex);
+}
+
+/* makes the data file up to length visible to readers, call holding the lock */
+int shared_log_publish(struct shared_log* log, uint64_t length) {
+    if (length > SHARED_LOG_MAP_SIZE) {
+        syslog(LOG_ERR, "Shared log grew past %llu bytes, it can't be mapped any further", (unsigned long long)SHARED_LOG_MAP_SIZE);
+        return EFBIG;
+    }
+    __atomic_store_n(&log->header->published_length, length, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint64_t shared_log_length(const struct shared_log* log) {
+    return __atomic_load_n(&log->header->published_length, __ATOMIC_ACQUIRE);
+}
+
+/* sends everything published so far straight from the mapping, without any lock */
+int shared_log_dump(struct shared_log* log, int socketd, struct send_policy* policy, uint64_t from) {
+    uint64_t length = shared_log_length(log);
+    uint64_t sent = from < length ? from : length;
+    send_policy_begin(policy, socketd);
+    while (sent < length) {
+        if (sent > from) {
+            send_policy_more_coming(policy, socketd);
+        }
+        size_t chunk = length - sent < SHARED_LOG_SEND_SIZE ? length - sent : SHARED_LOG_SEND_SIZE;
+        int ret_val = send_policy_frame(policy, socketd, chunk);
+        if (ret_val) {
+            return ret_val;
+        }
+        uint64_t chunk_end = sent + chunk;
+        while (sent < chunk_end) {
+            /* the mapping outlives the connection, pages sent without a copy need no tracking */
+            ssize_t bytes_wrote = zerocopy_send(&policy->zerocopy, socketd, log->data + sent, chunk_end - sent);
+            if (bytes_wrote < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                syslog(LOG_ERR, "Failed to write a chunk of information to socket, error: %s", strerror(errno));
+                return errno;
+            }
+            sent += bytes_wrote;
+        }
+    }
+    int ret_val = send_policy_frame(policy, socketd, 0);
+    if (ret_val) {
+        return ret_val;
+    }
+    send_policy_end(policy, socketd, length - (from < length ? from : length));
+    return 0;
+}
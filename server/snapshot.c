@@ -0,0 +1,311 @@
+#include "snapshot.h"
+#include "crc32c.h"
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static unsigned int snapshot_interval = 0;
+static pthread_t snapshot_thread;
+static pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;
+/* whether the snapshot thread writes one last snapshot of every channel before it exits */
+static bool final_snapshot = false;
+
+static int snapshot_path(const char* data_file_name, char* path, size_t path_size) {
+    int ret_val = snprintf(path, path_size, "%s%s", data_file_name, SNAPSHOT_SUFFIX);
+    if (ret_val < 0 || (size_t)ret_val >= path_size) {
+        syslog(LOG_ERR, "Snapshot path for %s is too long", data_file_name);
+        return ENAMETOOLONG;
+    }
+    return 0;
+}
+
+static uint32_t header_crc(const struct snapshot_header* header) {
+    return crc32c(0, header, offsetof(struct snapshot_header, header_crc));
+}
+
+/* crc32c over the last bytes covered, cheap way to tell the data file is still the one the snapshot was taken from */
+static int data_tail_crc(int filed, uint64_t data_length, uint32_t* crc) {
+    char buf[SNAPSHOT_TAIL_CHECK_SIZE];
+    size_t size = data_length < sizeof(buf) ? data_length : sizeof(buf);
+    ssize_t bytes_read = pread(filed, buf, size, data_length - size);
+    if (bytes_read != (ssize_t)size) {
+        return EIO;
+    }
+    *crc = crc32c(0, buf, size);
+    return 0;
+}
+
+/**
+ * Maps the snapshot of data_file_name and uses its offsets as the base of index, if it is valid
+ * and matches the data file. The records stored after the snapshot was taken still need to be
+ * indexed by the caller, see record_index_catch_up().
+ * The offsets crc makes this O(records) rather than constant: 8 bytes a record through crc32c,
+ * still far from the data scan it saves, and a bad offset would otherwise only show as a seek
+ * answered with the wrong bytes, long after the index could have been rebuilt.
+ */
+int snapshot_load(struct record_index* index, const char* data_file_name, unsigned long* version) {
+    char path[4096];
+    struct timespec start, end;
+    int ret_val = snapshot_path(data_file_name, path, sizeof(path));
+    if (ret_val) {
+        return ret_val;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int snap_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (snap_fd < 0) {
+        return errno;
+    }
+    struct stat snap_stat;
+    if (fstat(snap_fd, &snap_stat) < 0 || (size_t)snap_stat.st_size < sizeof(struct snapshot_header)) {
+        syslog(LOG_WARNING, "Ignoring truncated snapshot %s", path);
+        close(snap_fd);
+        return EINVAL;
+    }
+    void* map = mmap(NULL, snap_stat.st_size, PROT_READ, MAP_PRIVATE, snap_fd, 0);
+    close(snap_fd);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Could not map snapshot %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+
+    const struct snapshot_header* header = map;
+    const uint64_t* offsets = (const uint64_t*)(header + 1);
+    ret_val = EINVAL;
+    if (header->magic != SNAPSHOT_MAGIC || header->format_version != SNAPSHOT_FORMAT_VERSION ||
+        header->header_crc != header_crc(header)) {
+        syslog(LOG_WARNING, "Ignoring snapshot %s, bad header", path);
+    }
+    else if ((uint64_t)snap_stat.st_size != sizeof(*header) + header->record_count * sizeof(uint64_t) ||
+             header->offsets_crc != crc32c(0, offsets, header->record_count * sizeof(uint64_t))) {
+        syslog(LOG_WARNING, "Ignoring snapshot %s, corrupted offsets", path);
+    }
+    else {
+        int data_fd = open(data_file_name, O_RDONLY | O_CLOEXEC);
+        struct stat data_stat;
+        uint32_t crc = 0;
+        if (data_fd < 0 || fstat(data_fd, &data_stat) < 0 || (uint64_t)data_stat.st_size < header->data_length ||
+            data_tail_crc(data_fd, header->data_length, &crc) || crc != header->tail_crc) {
+            syslog(LOG_WARNING, "Ignoring snapshot %s, it does not match %s", path, data_file_name);
+        }
+        else {
+            ret_val = 0;
+        }
+        if (data_fd >= 0) {
+            close(data_fd);
+        }
+    }
+    if (ret_val) {
+        munmap(map, snap_stat.st_size);
+        return ret_val;
+    }
+
+    record_index_free(index);
+    index->base_map = map;
+    index->base_map_length = snap_stat.st_size;
+    index->base = offsets;
+    index->base_count = header->record_count;
+    index->length = header->data_length;
+    index->at_boundary = header->at_boundary;
+    *version = header->channel_version;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    syslog(LOG_NOTICE, "Restored index of %s from snapshot, %lu records in %ld us", data_file_name,
+           (unsigned long)header->record_count, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+    return 0;
+}
+
+static int write_all(int fd, const void* buf, size_t size) {
+    const char* ptr = buf;
+    while (size > 0) {
+        ssize_t bytes_wrote = write(fd, ptr, size);
+        if (bytes_wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        ptr += bytes_wrote;
+        size -= bytes_wrote;
+    }
+    return 0;
+}
+
+/**
+ * Writes the index of channel next to its data file. The offsets are copied while holding the
+ * channel mutex, the mapped base of the index may be unmapped as soon as it's released.
+ */
+int snapshot_write(struct channel* channel, bool wait_for_lock) {
+    char path[4096], tmp_path[4096 + 8];
+    struct snapshot_header header;
+    uint64_t* offsets = NULL;
+    size_t base_count = 0, tail_count = 0;
+
+    if (channel->is_device) {
+        return 0;
+    }
+    int ret_val = snapshot_path(channel->file_name, path, sizeof(path));
+    if (ret_val) {
+        return ret_val;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    ret_val = wait_for_lock ? pthread_mutex_lock(&channel->mutex) : pthread_mutex_trylock(&channel->mutex);
+    if (ret_val) {
+        syslog(LOG_WARNING, "Skipping snapshot of channel %s, could not lock it, error: %s", channel->name, strerror(ret_val));
+        return ret_val;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.format_version = SNAPSHOT_FORMAT_VERSION;
+    header.channel_version = channel->version;
+    header.data_length = channel->index.length;
+    header.at_boundary = channel->index.at_boundary;
+    base_count = channel->index.base_count;
+    tail_count = channel->index.tail_count;
+    if (base_count + tail_count) {
+        offsets = malloc((base_count + tail_count) * sizeof(uint64_t));
+        if (offsets == NULL) {
+            pthread_mutex_unlock(&channel->mutex);
+            syslog(LOG_ERR, "Failed to allocate memory for snapshot of channel %s, error: %s", channel->name, strerror(errno));
+            return ENOMEM;
+        }
+        memcpy(offsets, channel->index.base, base_count * sizeof(uint64_t));
+        memcpy(offsets + base_count, channel->index.tail, tail_count * sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&channel->mutex);
+
+    header.record_count = base_count + tail_count;
+    header.offsets_crc = crc32c(0, offsets, header.record_count * sizeof(uint64_t));
+
+    int data_fd = open(channel->file_name, O_RDONLY | O_CLOEXEC);
+    if (data_fd < 0 || data_tail_crc(data_fd, header.data_length, &header.tail_crc)) {
+        /* nothing stored yet */
+        if (data_fd >= 0) {
+            close(data_fd);
+        }
+        free(offsets);
+        return 0;
+    }
+    close(data_fd);
+    header.header_crc = header_crc(&header);
+
+    /* write aside and rename, a crash never leaves a half written snapshot behind */
+    int snap_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (snap_fd < 0) {
+        syslog(LOG_ERR, "Could not create snapshot %s, error: %s", tmp_path, strerror(errno));
+        int open_error = errno;
+        free(offsets);
+        return open_error;
+    }
+    ret_val = write_all(snap_fd, &header, sizeof(header));
+    if (ret_val == 0) {
+        ret_val = write_all(snap_fd, offsets, header.record_count * sizeof(uint64_t));
+    }
+    if (ret_val == 0 && fsync(snap_fd) < 0) {
+        ret_val = errno;
+    }
+    close(snap_fd);
+    free(offsets);
+    if (ret_val == 0 && rename(tmp_path, path) < 0) {
+        ret_val = errno;
+    }
+    if (ret_val) {
+        syslog(LOG_ERR, "Failed to write snapshot %s, error: %s", path, strerror(ret_val));
+        unlink(tmp_path);
+    }
+    return ret_val;
+}
+
+static void write_channel_snapshot(struct channel* channel, void* args) {
+    snapshot_write(channel, *(bool*)args);
+}
+
+void snapshot_write_all(bool wait_for_lock) {
+    if (snapshot_interval) {
+        channel_for_each(write_channel_snapshot, &wait_for_lock);
+    }
+}
+
+void snapshot_remove(const char* data_file_name) {
+    char path[4096];
+    if (snapshot_path(data_file_name, path, sizeof(path)) == 0 && unlink(path) < 0 && errno != ENOENT) {
+        syslog(LOG_WARNING, "Failed to remove snapshot %s, error: %s", path, strerror(errno));
+    }
+}
+
+static void* snapshot_thread_function(void* args) {
+    /* terminate() runs from the signal handlers and joins this thread, it must not run on it */
+    sigset_t termination_signals;
+    sigemptyset(&termination_signals);
+    sigaddset(&termination_signals, SIGINT);
+    sigaddset(&termination_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &termination_signals, NULL);
+    pin_current_thread(&affinity_config.flusher_cpus);
+
+    pthread_mutex_lock(&stop_mutex);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += snapshot_interval;
+        while (!stopping && pthread_cond_timedwait(&stop_cond, &stop_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&stop_mutex);
+        snapshot_write_all(true);
+        pthread_mutex_lock(&stop_mutex);
+    }
+    bool write_final = final_snapshot;
+    pthread_mutex_unlock(&stop_mutex);
+    if (write_final) {
+        /* don't wait for connections that may never let go of their channel */
+        snapshot_write_all(false);
+    }
+    return NULL;
+}
+
+bool snapshot_enabled(void) {
+    return snapshot_interval != 0;
+}
+
+/* writes snapshots of every channel each interval_sec seconds, until snapshot_stop() */
+int snapshot_start(unsigned int interval_sec) {
+    snapshot_interval = interval_sec;
+    int ret_val = pthread_create(&snapshot_thread, NULL, snapshot_thread_function, NULL);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn snapshot thread, error: %s", strerror(ret_val));
+        snapshot_interval = 0;
+    }
+    return ret_val;
+}
+
+/* joins the snapshot thread, after one last snapshot if write_final, must come before the channels are destroyed */
+void snapshot_stop(bool write_final) {
+    if (!snapshot_interval) {
+        return;
+    }
+    pthread_mutex_lock(&stop_mutex);
+    stopping = true;
+    final_snapshot = write_final;
+    pthread_cond_broadcast(&stop_cond);
+    pthread_mutex_unlock(&stop_mutex);
+    int ret_val = pthread_join(snapshot_thread, NULL);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not join the snapshot thread, error: %s", strerror(ret_val));
+    }
+    snapshot_interval = 0;
+}
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include "staging.h"
+#include "crc32c.h"
+#include "frame_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+size_t ingest_memory_cap = INGEST_MEMORY_CAP_DEFAULT;
+bool ingest_splice = true;
+
+void packet_stage_init(struct packet_stage* stage) {
+    stage->filed = -1;
+    stage->length = 0;
+    stage->crc = 0;
+    stage->pipe_fds[0] = stage->pipe_fds[1] = -1;
+    stage->overrun = NULL;
+    stage->overrun_size = 0;
+    stage->splice_failed = false;
+}
+
+static int open_stage_file(void) {
+    int filed = open(STAGING_DIRECTORY, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (filed >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+        return filed;
+    }
+    /* file system without O_TMPFILE support, fall back to a named file unlinked right away */
+    char path[] = STAGING_DIRECTORY "/aesdsocket-stage-XXXXXX";
+    filed = mkostemp(path, O_CLOEXEC);
+    if (filed >= 0) {
+        unlink(path);
+    }
+    return filed;
+}
+
+int packet_stage_write(struct packet_stage* stage, const char* buf, size_t size) {
+    if (stage->filed < 0) {
+        stage->filed = open_stage_file();
+        if (stage->filed < 0) {
+            int err = errno;
+            syslog(LOG_ERR, "Failed to create staging file in %s, error: %s", STAGING_DIRECTORY, strerror(err));
+            return err;
+        }
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t ret_val = pwrite(stage->filed, buf + written, size - written, stage->length + written);
+        if (ret_val < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            syslog(LOG_ERR, "Failed to stage %zu bytes of a large packet, error: %s", size, strerror(err));
+            return err;
+        }
+        written += ret_val;
+    }
+    stage->length += size;
+    if (record_frames_enabled) {
+        stage->crc = crc32c(stage->crc, buf, size);
+    }
+    return 0;
+}
+
+/* only the rest of a packet already over the cap is spliced, the head was written from the buffer */
+bool packet_stage_can_splice(const struct packet_stage* stage) {
+    return stage->length && stage->filed >= 0 && !stage->splice_failed && __atomic_load_n(&ingest_splice, __ATOMIC_RELAXED);
+}
+
+static void close_pipe(struct packet_stage* stage) {
+    if (stage->pipe_fds[0] >= 0) {
+        close(stage->pipe_fds[0]);
+        close(stage->pipe_fds[1]);
+    }
+    stage->pipe_fds[0] = stage->pipe_fds[1] = -1;
+}
+
+/* turns splicing off for the connection, the caller reads the bytes in as before */
+static ssize_t splice_unsupported(struct packet_stage* stage, int err) {
+    syslog(LOG_NOTICE, "Can't splice packets into the staging file, reading them instead, error: %s", strerror(err));
+    stage->splice_failed = true;
+    close_pipe(stage);
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/* the framed crc needs the bytes themselves, they're still in the page cache */
+static int crc_staged(struct packet_stage* stage, off_t offset, size_t size) {
+    char buf[STAGING_COPY_SIZE / 4];
+    while (size) {
+        ssize_t read_bytes = pread(stage->filed, buf, size < sizeof(buf) ? size : sizeof(buf), offset);
+        if (read_bytes <= 0) {
+            if (read_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            return read_bytes < 0 ? errno : EIO;
+        }
+        stage->crc = crc32c(stage->crc, buf, read_bytes);
+        offset += read_bytes;
+        size -= read_bytes;
+    }
+    return 0;
+}
+
+/**
+ * Looks for the first '\n' in the size bytes just staged at offset, through a mapping of the page
+ * cache rather than a copy. Whatever follows it is moved to stage->overrun and *size cut down to
+ * the packet bytes. *complete is set when the delimiter was there.
+ */
+static int split_staged(struct packet_stage* stage, off_t offset, size_t* size, bool* complete) {
+    off_t map_offset = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    size_t map_size = offset - map_offset + *size;
+    char* map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, stage->filed, map_offset);
+    if (map == MAP_FAILED) {
+        return errno;
+    }
+    const char* staged = map + (offset - map_offset);
+    const char* delimiter = memchr(staged, '\n', *size);
+    int err = 0;
+    if (delimiter != NULL) {
+        size_t rest = *size - (delimiter + 1 - staged);
+        if (rest && (stage->overrun = malloc(rest + 1)) == NULL) {
+            err = ENOMEM;
+        }
+        else if (rest) {
+            memcpy(stage->overrun, delimiter + 1, rest);
+            stage->overrun_size = rest;
+        }
+        *size -= rest;
+        *complete = true;
+    }
+    if (err == 0 && record_frames_enabled) {
+        stage->crc = crc32c(stage->crc, staged, *size);
+    }
+    munmap(map, map_size);
+    return err;
+}
+
+/**
+ * Moves the next bytes of a packet from the socket to the staging file through a pipe, they never
+ * land in a user space buffer. Returns how many were moved, 0 when the peer closed the connection,
+ * -1 with errno set otherwise (EOPNOTSUPP when splice() can't be used and the bytes must be read).
+ * complete is set once the packet is staged whole. Without exact, a packet ends wherever a read
+ * ends with '\n', as read_str_from_socket() has it, so only the last byte moved is looked at.
+ * With exact it ends at the first '\n', which is searched for in the staged bytes, and what came
+ * along after it is left in stage->overrun: only the next packets' bytes are copied.
+ */
+ssize_t packet_stage_splice(struct packet_stage* stage, int socketd, bool exact, bool* complete) {
+    *complete = false;
+    if (stage->pipe_fds[0] < 0 && pipe2(stage->pipe_fds, O_CLOEXEC) < 0) {
+        return splice_unsupported(stage, errno);
+    }
+    ssize_t moved = splice(socketd, NULL, stage->pipe_fds[1], NULL, STAGING_SPLICE_SIZE, SPLICE_F_MOVE);
+    if (moved < 0 && (errno == EINVAL || errno == ENOSYS) && stage->length) {
+        return splice_unsupported(stage, errno);
+    }
+    if (moved <= 0) {
+        return moved;
+    }
+    loff_t offset = stage->length;
+    size_t left = moved;
+    while (left) {
+        ssize_t written = splice(stage->pipe_fds[0], NULL, stage->filed, &offset, left, SPLICE_F_MOVE);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            /* the bytes are out of the socket already, the packet is lost either way */
+            int err = written < 0 ? errno : EIO;
+            syslog(LOG_ERR, "Failed to stage %zd bytes of a large packet, error: %s", moved, strerror(err));
+            close_pipe(stage);
+            errno = err;
+            return -1;
+        }
+        left -= written;
+    }
+    size_t packet_bytes = moved;
+    int err = exact ? split_staged(stage, stage->length, &packet_bytes, complete)
+                    : record_frames_enabled ? crc_staged(stage, stage->length, moved) : 0;
+    if (err) {
+        syslog(LOG_ERR, "Failed to stage %zd bytes of a large packet, error: %s", moved, strerror(err));
+        errno = err;
+        return -1;
+    }
+    stage->length += packet_bytes;
+    if (!exact) {
+        char last;
+        if (pread(stage->filed, &last, 1, stage->length - 1) != 1) {
+            return -1;
+        }
+        *complete = last == '\n';
+    }
+    return moved;
+}
+
+/* plain read/write loop for storage that can't be spliced into, like the aesdchar device */
+static int copy_stage(struct packet_stage* stage, off_t offset, int filed) {
+    char* buf = malloc(STAGING_COPY_SIZE);
+    if (buf == NULL) {
+        return errno;
+    }
+    int err = 0;
+    while ((size_t)offset < stage->length && err == 0) {
+        size_t wanted = stage->length - offset < STAGING_COPY_SIZE ? stage->length - offset : STAGING_COPY_SIZE;
+        ssize_t read_bytes = pread(stage->filed, buf, wanted, offset);
+        if (read_bytes <= 0) {
+            if (read_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            err = read_bytes < 0 ? errno : EIO;
+            break;
+        }
+        ssize_t written = 0;
+        while (written < read_bytes) {
+            ssize_t ret_val = write(filed, buf + written, read_bytes - written);
+            if (ret_val < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                err = errno;
+                break;
+            }
+            written += ret_val;
+        }
+        offset += written;
+    }
+    free(buf);
+    return err;
+}
+
+/**
+ * Appends the staged head of a packet to the storage behind filed. Regular files get it through
+ * sendfile() so the data never goes through user space, anything else is copied in chunks.
+ * sendfile() turns O_APPEND outputs down, which the channel storage is opened with, so the flag is
+ * dropped for the call and the bytes go at the end of the file by hand. Call with the channel mutex
+ * held, in prefork mode with the shared log lock too, nothing else may append meanwhile.
+ */
+int packet_stage_publish(struct packet_stage* stage, int filed) {
+    off_t offset = 0;
+    struct stat file_stat;
+    int flags = fcntl(filed, F_GETFL);
+    if (flags >= 0 && fstat(filed, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+        (!(flags & O_APPEND) || fcntl(filed, F_SETFL, flags & ~O_APPEND) == 0)) {
+        int err = 0;
+        if (lseek(filed, 0, SEEK_END) < 0) {
+            err = errno;
+        }
+        while (err == 0 && (size_t)offset < stage->length) {
+            ssize_t ret_val = sendfile(filed, stage->filed, &offset, stage->length - offset);
+            if (ret_val < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret_val < 0 && errno != EINVAL && errno != ENOSYS) {
+                err = errno;
+            }
+            if (ret_val <= 0) {
+                break;
+            }
+        }
+        if ((flags & O_APPEND) && fcntl(filed, F_SETFL, flags) < 0 && err == 0) {
+            err = errno;
+        }
+        if (err) {
+            syslog(LOG_ERR, "Failed to publish staged packet, error: %s", strerror(err));
+            return err;
+        }
+    }
+    if ((size_t)offset < stage->length) {
+        int err = copy_stage(stage, offset, filed);
+        if (err) {
+            syslog(LOG_ERR, "Failed to publish staged packet, error: %s", strerror(err));
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* gives the disk space back, the connection keeps the file for its next large packet */
+void packet_stage_reset(struct packet_stage* stage) {
+    if (stage->filed >= 0 && stage->length && ftruncate(stage->filed, 0) < 0) {
+        syslog(LOG_WARNING, "Failed to truncate staging file, error: %s", strerror(errno));
+    }
+    stage->length = 0;
+    stage->crc = 0;
+    free(stage->overrun);
+    stage->overrun = NULL;
+    stage->overrun_size = 0;
+}
+
+void packet_stage_close(struct packet_stage* stage) {
+    if (stage->filed >= 0) {
+        close(stage->filed);
+    }
+    close_pipe(stage);
+    free(stage->overrun);
+    packet_stage_init(stage);
+}
@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+#include "tiering.h"
+#include "channel.h"
+#include "utility.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/* a segment that can't be written to is retried this often, its commands stay queued meanwhile */
+#define TIER_RETRY_SEC 1
+#define TIER_READ_CHUNK (64 * 1024)
+
+bool tiered_storage_enabled = false;
+
+static void segment_path(const struct cold_tier* tier, unsigned int segment, char* path, size_t size) {
+    snprintf(path, size, "%s%s.%06u", tier->base_path, TIER_SEGMENT_SUFFIX, segment);
+}
+
+static int add_segment(struct cold_tier* tier, uint64_t start) {
+    uint64_t* tmp_ptr = realloc(tier->segment_starts, (tier->segment_count + 1) * sizeof(uint64_t));
+    if (tmp_ptr == NULL) {
+        return ENOMEM;
+    }
+    tier->segment_starts = tmp_ptr;
+    tier->segment_starts[tier->segment_count++] = start;
+    return 0;
+}
+
+/* opens the last segment for appending, or a new one once it is full */
+static int open_segment(struct cold_tier* tier, bool roll) {
+    char path[4096];
+    if (roll) {
+        pthread_mutex_lock(&tier->mutex);
+        int ret_val = add_segment(tier, tier->cold_length);
+        pthread_mutex_unlock(&tier->mutex);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    segment_path(tier, tier->segment_count - 1, path, sizeof(path));
+    int filed = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (filed < 0) {
+        syslog(LOG_ERR, "Could not open cold segment %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+    if (tier->segment_filed >= 0) {
+        close(tier->segment_filed);
+    }
+    tier->segment_filed = filed;
+    return 0;
+}
+
+/* indexes the segments left by previous runs, the cold log goes on after them */
+static int load_segments(struct cold_tier* tier) {
+    char path[4096];
+    char buf[TIER_READ_CHUNK];
+    for (unsigned int segment = 0; ; segment++) {
+        segment_path(tier, segment, path, sizeof(path));
+        int filed = open(path, O_RDONLY | O_CLOEXEC);
+        if (filed < 0 && errno == ENOENT) {
+            break;
+        }
+        if (filed < 0) {
+            syslog(LOG_ERR, "Could not open cold segment %s, error: %s", path, strerror(errno));
+            return errno;
+        }
+        int ret_val = add_segment(tier, tier->cold_length);
+        ssize_t bytes_read = 0;
+        while (!ret_val && (bytes_read = read(filed, buf, sizeof(buf))) != 0) {
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read < 0) {
+                ret_val = errno;
+                break;
+            }
+            ret_val = record_index_add(&tier->index, buf, bytes_read);
+            tier->cold_length += bytes_read;
+        }
+        close(filed);
+        if (ret_val) {
+            syslog(LOG_ERR, "Could not load cold segment %s, error: %s", path, strerror(ret_val));
+            return ret_val;
+        }
+    }
+    if (tier->segment_count == 0 && add_segment(tier, 0)) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static void push_hot(struct cold_tier* tier, size_t size) {
+    if (tier->hot_count == TIER_HOT_ENTRIES) {
+        tier->hot_first = (tier->hot_first + 1) % TIER_HOT_ENTRIES;
+        tier->hot_count--;
+    }
+    tier->hot_sizes[(tier->hot_first + tier->hot_count) % TIER_HOT_ENTRIES] = size;
+    tier->hot_count++;
+}
+
+/* the device may still hold commands from before we started, learn their sizes */
+static int load_hot_sizes(struct cold_tier* tier) {
+    char buf[TIER_READ_CHUNK];
+    size_t command_size = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read(tier->device_filed, buf, sizeof(buf))) != 0) {
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            syslog(LOG_ERR, "Could not read the device contents, error: %s", strerror(errno));
+            return errno;
+        }
+        for (ssize_t i = 0; i < bytes_read; i++) {
+            command_size++;
+            if (buf[i] == '\n') {
+                push_hot(tier, command_size);
+                command_size = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int write_all(int filed, const char* buf, size_t size) {
+    while (size) {
+        ssize_t bytes_wrote = write(filed, buf, size);
+        if (bytes_wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_wrote < 0) {
+            return errno;
+        }
+        buf += bytes_wrote;
+        size -= bytes_wrote;
+    }
+    return 0;
+}
+
+static int spill(struct cold_tier* tier, const struct tier_spill* item) {
+    /* only this thread moves cold_length, it can be read without the mutex */
+    if (tier->cold_length - tier->segment_starts[tier->segment_count - 1] >= TIER_SEGMENT_SIZE) {
+        int ret_val = open_segment(tier, true);
+        if (ret_val) {
+            return ret_val;
+        }
+    }
+    int ret_val = write_all(tier->segment_filed, item->data, item->size);
+    if (ret_val) {
+        return ret_val;
+    }
+    if (__atomic_load_n(&durable_appends, __ATOMIC_RELAXED) && fdatasync(tier->segment_filed) < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+static void* spill_run(void* args) {
+    struct cold_tier* tier = args;
+    pthread_mutex_lock(&tier->mutex);
+    while (true) {
+        while (tier->queue_head == NULL && !tier->stopping) {
+            pthread_cond_wait(&tier->changed, &tier->mutex);
+        }
+        /* the queue is drained before stopping, nothing evicted gets lost on a clean shutdown */
+        if (tier->queue_head == NULL) {
+            break;
+        }
+        struct tier_spill* item = tier->queue_head;
+        pthread_mutex_unlock(&tier->mutex);
+
+        int ret_val = spill(tier, item);
+        pthread_mutex_lock(&tier->mutex);
+        if (ret_val) {
+            /* dumps keep sending it from the queue meanwhile */
+            syslog(LOG_ERR, "Could not spill %zu bytes to the cold tier, retrying, error: %s", item->size, strerror(ret_val));
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += TIER_RETRY_SEC;
+            pthread_cond_timedwait(&tier->changed, &tier->mutex, &deadline);
+            continue;
+        }
+        tier->queue_head = item->next;
+        if (tier->queue_head == NULL) {
+            tier->queue_tail = NULL;
+        }
+        tier->cold_length += item->size;
+        tier->queued_bytes -= item->size;
+        pthread_cond_broadcast(&tier->changed);
+        free(item->data);
+        free(item);
+    }
+    pthread_mutex_unlock(&tier->mutex);
+    return NULL;
+}
+
+struct cold_tier* tier_open(const char* device_path, const char* base_path) {
+    struct cold_tier* tier = calloc(1, sizeof(*tier));
+    if (tier == NULL || (tier->base_path = strdup(base_path)) == NULL) {
+        syslog(LOG_ERR, "Failed to allocate the cold tier of %s", device_path);
+        free(tier);
+        return NULL;
+    }
+    tier->segment_filed = -1;
+    record_index_init(&tier->index);
+    pthread_mutex_init(&tier->mutex, NULL);
+    pthread_cond_init(&tier->changed, NULL);
+    tier->device_filed = open(device_path, O_RDONLY | O_CLOEXEC);
+    if (tier->device_filed < 0) {
+        syslog(LOG_ERR, "Could not open %s to read it back, error: %s", device_path, strerror(errno));
+    }
+    int ret_val = tier->device_filed < 0 ? errno : load_segments(tier);
+    if (!ret_val) {
+        ret_val = load_hot_sizes(tier);
+    }
+    if (!ret_val) {
+        ret_val = open_segment(tier, false);
+    }
+    if (!ret_val) {
+        ret_val = pthread_create(&tier->spiller, NULL, spill_run, tier);
+    }
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not set up the cold tier at %s, error: %s", base_path, strerror(ret_val));
+        if (tier->segment_filed >= 0) {
+            close(tier->segment_filed);
+        }
+        if (tier->device_filed >= 0) {
+            close(tier->device_filed);
+        }
+        record_index_free(&tier->index);
+        pthread_cond_destroy(&tier->changed);
+        pthread_mutex_destroy(&tier->mutex);
+        free(tier->segment_starts);
+        free(tier->base_path);
+        free(tier);
+        return NULL;
+    }
+    syslog(LOG_NOTICE, "Cold tier at %s%s.*, %zu commands in %u segments, %u in the device", base_path, TIER_SEGMENT_SUFFIX,
+           record_index_count(&tier->index), tier->segment_count, tier->hot_count);
+    return tier;
+}
+
+/* waits for the queue to be spilled */
+void tier_close(struct cold_tier* tier) {
+    pthread_mutex_lock(&tier->mutex);
+    tier->stopping = true;
+    pthread_cond_broadcast(&tier->changed);
+    pthread_mutex_unlock(&tier->mutex);
+    pthread_join(tier->spiller, NULL);
+    close(tier->segment_filed);
+    close(tier->device_filed);
+    record_index_free(&tier->index);
+    pthread_cond_destroy(&tier->changed);
+    pthread_mutex_destroy(&tier->mutex);
+    free(tier->segment_starts);
+    free(tier->base_path);
+    free(tier);
+}
+
+static int queue_spill(struct cold_tier* tier, char* data, size_t size) {
+    struct tier_spill* item = calloc(1, sizeof(*item));
+    if (item == NULL) {
+        free(data);
+        return ENOMEM;
+    }
+    item->data = data;
+    item->size = size;
+    pthread_mutex_lock(&tier->mutex);
+    /* the spill thread can't keep up, hold the append back rather than grow without bounds */
+    while (tier->queued_bytes && tier->queued_bytes + size > TIER_SPILL_QUEUE_MAX) {
+        pthread_cond_wait(&tier->changed, &tier->mutex);
+    }
+    int ret_val = record_index_add(&tier->index, data, size);
+    if (ret_val) {
+        pthread_mutex_unlock(&tier->mutex);
+        free(data);
+        free(item);
+        return ret_val;
+    }
+    if (tier->queue_tail != NULL) {
+        tier->queue_tail->next = item;
+    }
+    else {
+        tier->queue_head = item;
+    }
+    tier->queue_tail = item;
+    tier->queued_bytes += size;
+    pthread_cond_broadcast(&tier->changed);
+    pthread_mutex_unlock(&tier->mutex);
+    return 0;
+}
+
+/* reads back the count oldest commands of the device */
+static int read_hot(struct cold_tier* tier, unsigned int count, char** data, size_t* size) {
+    *size = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        *size += tier->hot_sizes[(tier->hot_first + i) % TIER_HOT_ENTRIES];
+    }
+    struct aesd_seekto seek = { .write_cmd = 0, .write_cmd_offset = 0 };
+    if (ioctl(tier->device_filed, AESDCHAR_IOCSEEKTO, &seek) < 0) {
+        syslog(LOG_ERR, "Could not seek to the oldest command of the device, error: %s", strerror(errno));
+        return errno;
+    }
+    *data = malloc(*size);
+    if (*data == NULL) {
+        return ENOMEM;
+    }
+    size_t got = 0;
+    while (got < *size) {
+        ssize_t bytes_read = read(tier->device_filed, *data + got, *size - got);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            int ret_val = bytes_read < 0 ? errno : EIO;
+            syslog(LOG_ERR, "Could not read back the commands about to be evicted, error: %s", strerror(ret_val));
+            free(*data);
+            return ret_val;
+        }
+        got += bytes_read;
+    }
+    return 0;
+}
+
+/* copies bytes [0, size) of a packet, whose head may be staged */
+static char* packet_head(struct packet_stage* stage, const char* buf, size_t size) {
+    char* data = malloc(size);
+    if (data == NULL) {
+        return NULL;
+    }
+    size_t staged = stage != NULL ? stage->length : 0;
+    size_t from_stage = size < staged ? size : staged;
+    size_t got = 0;
+    while (got < from_stage) {
+        ssize_t bytes_read = pread(stage->filed, data + got, from_stage - got, got);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            free(data);
+            return NULL;
+        }
+        got += bytes_read;
+    }
+    memcpy(data + from_stage, buf, size - from_stage);
+    return data;
+}
+
+/* appends the sizes of the commands in [buf, buf + size) to sizes, partial is the current command so far */
+static int scan_commands(const char* buf, size_t size, size_t* partial, size_t** sizes, size_t* count, size_t* capacity) {
+    const char* end = buf + size;
+    while (buf < end) {
+        const char* newline = memchr(buf, '\n', end - buf);
+        if (newline == NULL) {
+            *partial += end - buf;
+            break;
+        }
+        if (*count == *capacity) {
+            size_t new_capacity = *capacity ? *capacity * 2 : TIER_HOT_ENTRIES * 2;
+            size_t* tmp_ptr = realloc(*sizes, new_capacity * sizeof(size_t));
+            if (tmp_ptr == NULL) {
+                return ENOMEM;
+            }
+            *sizes = tmp_ptr;
+            *capacity = new_capacity;
+        }
+        (*sizes)[(*count)++] = *partial + (newline + 1 - buf);
+        *partial = 0;
+        buf = newline + 1;
+    }
+    return 0;
+}
+
+/**
+ * Called with the channel mutex held right before a packet goes to the device: whatever the
+ * device is going to evict for it is queued for the cold tier first, including the packet's own
+ * commands when it has more than the device keeps.
+ */
+int tier_append(struct cold_tier* tier, struct packet_stage* stage, const char* buf, size_t size) {
+    size_t* sizes = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t partial = 0;
+    int ret_val = 0;
+    if (stage != NULL && stage->length) {
+        char chunk[TIER_READ_CHUNK];
+        for (size_t offset = 0; !ret_val && offset < stage->length; ) {
+            ssize_t bytes_read = pread(stage->filed, chunk, sizeof(chunk), offset);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                ret_val = bytes_read < 0 ? errno : EIO;
+                break;
+            }
+            ret_val = scan_commands(chunk, bytes_read, &partial, &sizes, &count, &capacity);
+            offset += bytes_read;
+        }
+    }
+    if (!ret_val) {
+        ret_val = scan_commands(buf, size, &partial, &sizes, &count, &capacity);
+    }
+    if (ret_val) {
+        free(sizes);
+        return ret_val;
+    }
+
+    /* the oldest commands of the device first, they come before the packet in the log */
+    unsigned int evicted = 0;
+    if (tier->hot_count + count > TIER_HOT_ENTRIES) {
+        size_t over = tier->hot_count + count - TIER_HOT_ENTRIES;
+        evicted = over < tier->hot_count ? over : tier->hot_count;
+    }
+    if (evicted) {
+        char* data = NULL;
+        size_t data_size = 0;
+        ret_val = read_hot(tier, evicted, &data, &data_size);
+        if (!ret_val) {
+            ret_val = queue_spill(tier, data, data_size);
+        }
+        if (ret_val) {
+            free(sizes);
+            return ret_val;
+        }
+        tier->hot_first = (tier->hot_first + evicted) % TIER_HOT_ENTRIES;
+        tier->hot_count -= evicted;
+    }
+    /* then the commands of the packet the device won't even keep */
+    size_t skipped = count > TIER_HOT_ENTRIES ? count - TIER_HOT_ENTRIES : 0;
+    if (skipped) {
+        size_t skipped_size = 0;
+        for (size_t i = 0; i < skipped; i++) {
+            skipped_size += sizes[i];
+        }
+        char* data = packet_head(stage, buf, skipped_size);
+        ret_val = data != NULL ? queue_spill(tier, data, skipped_size) : ENOMEM;
+        if (ret_val) {
+            free(sizes);
+            return ret_val;
+        }
+    }
+    for (size_t i = skipped; i < count; i++) {
+        push_hot(tier, sizes[i]);
+    }
+    free(sizes);
+    return 0;
+}
+
+/* a seek in the whole log, write_cmd counts the cold commands first */
+int tier_seek(struct cold_tier* tier, int filed, struct aesd_seekto* seek, uint64_t* dump_from) {
+    pthread_mutex_lock(&tier->mutex);
+    size_t cold_count = record_index_count(&tier->index);
+    if (seek->write_cmd >= cold_count) {
+        pthread_mutex_unlock(&tier->mutex);
+        struct aesd_seekto hot_seek = { .write_cmd = seek->write_cmd - cold_count, .write_cmd_offset = seek->write_cmd_offset };
+        if (ioctl(filed, AESDCHAR_IOCSEEKTO, &hot_seek) < 0) {
+            return errno;
+        }
+        *dump_from = TIER_DUMP_HOT_ONLY;
+        return 0;
+    }
+    uint64_t start = record_index_get(&tier->index, seek->write_cmd);
+    uint64_t end = seek->write_cmd + 1 < cold_count ? record_index_get(&tier->index, seek->write_cmd + 1) : tier->index.length;
+    pthread_mutex_unlock(&tier->mutex);
+    if (seek->write_cmd_offset >= end - start) {
+        return EINVAL;
+    }
+    *dump_from = start + seek->write_cmd_offset;
+    return 0;
+}
+
+static int dump_segment(struct cold_tier* tier, unsigned int segment, uint64_t from, int socketd, struct send_policy* policy, size_t* response_size) {
+    uint64_t start = tier->segment_starts[segment];
+    uint64_t end = segment + 1 < tier->segment_count ? tier->segment_starts[segment + 1] : tier->cold_length;
+    if (end <= from || end == start) {
+        return 0;
+    }
+    char path[4096];
+    segment_path(tier, segment, path, sizeof(path));
+    int filed = open(path, O_RDONLY | O_CLOEXEC);
+    if (filed < 0) {
+        syslog(LOG_ERR, "Could not open cold segment %s, error: %s", path, strerror(errno));
+        return errno;
+    }
+    uint64_t position = from > start ? from - start : 0;
+    int ret_val = 0;
+    if (lseek(filed, position, SEEK_SET) < 0) {
+        ret_val = errno;
+    }
+    else {
+        /* the spill thread may be writing past end right now */
+        ret_val = send_file_contents(filed, socketd, policy, end - start - position, response_size);
+    }
+    close(filed);
+    return ret_val;
+}
+
+/* sends the log from dump_from on, the device last, it reads from wherever filed is */
+int tier_dump(struct cold_tier* tier, int filed, int socketd, struct send_policy* policy, uint64_t dump_from) {
+    size_t response_size = 0;
+    int ret_val = 0;
+    send_policy_begin(policy, socketd);
+    if (dump_from != TIER_DUMP_HOT_ONLY) {
+        /* keeps the spill thread from moving commands from the queue to the segments meanwhile */
+        pthread_mutex_lock(&tier->mutex);
+        for (unsigned int segment = 0; !ret_val && segment < tier->segment_count; segment++) {
+            ret_val = dump_segment(tier, segment, dump_from, socketd, policy, &response_size);
+        }
+        uint64_t offset = tier->cold_length;
+        for (struct tier_spill* item = tier->queue_head; !ret_val && item != NULL; item = item->next) {
+            if (offset + item->size > dump_from) {
+                uint64_t skip = dump_from > offset ? dump_from - offset : 0;
+                ret_val = send_response_chunk(socketd, policy, item->data + skip, item->size - skip, &response_size);
+            }
+            offset += item->size;
+        }
+        pthread_mutex_unlock(&tier->mutex);
+    }
+    if (!ret_val) {
+        ret_val = send_file_contents(filed, socketd, policy, UINT64_MAX, &response_size);
+    }
+    if (ret_val) {
+        return ret_val;
+    }
+    return send_response_end(socketd, policy, response_size);
+}
+
+/* searches the whole history, in the order tier_dump() sends it */
+int tier_filter(struct cold_tier* tier, int filed, struct filter* filter) {
+    int ret_val = 0;
+    char path[4096];
+    pthread_mutex_lock(&tier->mutex);
+    for (unsigned int segment = 0; !ret_val && segment < tier->segment_count; segment++) {
+        uint64_t start = tier->segment_starts[segment];
+        uint64_t end = segment + 1 < tier->segment_count ? tier->segment_starts[segment + 1] : tier->cold_length;
+        if (end == start) {
+            continue;
+        }
+        segment_path(tier, segment, path, sizeof(path));
+        int segment_filed = open(path, O_RDONLY | O_CLOEXEC);
+        if (segment_filed < 0) {
+            syslog(LOG_ERR, "Could not open cold segment %s, error: %s", path, strerror(errno));
+            ret_val = errno;
+            break;
+        }
+        /* the spill thread may be writing past end right now */
+        ret_val = filter_search_file(filter, segment_filed, end - start);
+        close(segment_filed);
+    }
+    for (struct tier_spill* item = tier->queue_head; !ret_val && item != NULL; item = item->next) {
+        ret_val = filter_search(filter, item->data, item->size);
+    }
+    pthread_mutex_unlock(&tier->mutex);
+    if (ret_val) {
+        return ret_val;
+    }
+    return filter_search_file(filter, filed, UINT64_MAX);
+}
@@ -0,0 +1,160 @@
+#include "timer_wheel.h"
+#include "affinity.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+
+/**
+ * Hierarchical timing wheel: level 0 has one slot per tick, every slot of level n covers a full
+ * turn of level n - 1. Scheduling and canceling are O(1), timers get cascaded down one level
+ * each time the level below wraps around.
+ */
+struct timer_wheel {
+    /* circular doubly linked lists, the slot heads are sentinels */
+    struct wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now;
+    pthread_mutex_t mutex;
+};
+
+static struct timer_wheel wheel;
+static bool wheel_running = false;
+
+static void list_add(struct wheel_timer* head, struct wheel_timer* timer) {
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+static void list_del(struct wheel_timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/* call with the wheel mutex held */
+static void add_timer(struct wheel_timer* timer) {
+    uint64_t delta = timer->expires - wheel.now;
+    int level = 0;
+
+    /* longer than the whole wheel, park it in the farthest slot, it will come back for another turn */
+    if (delta >= (uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) {
+        timer->expires = wheel.now + ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        delta = timer->expires - wheel.now;
+    }
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (timer->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    list_add(&wheel.slots[level][slot], timer);
+    timer->pending = true;
+}
+
+/* moves the timers of the current slot of level down to the levels below */
+static void cascade(int level) {
+    int slot = (wheel.now >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    struct wheel_timer* head = &wheel.slots[level][slot];
+    while (head->next != head) {
+        struct wheel_timer* timer = head->next;
+        list_del(timer);
+        add_timer(timer);
+    }
+}
+
+static void tick(void) {
+    wheel.now++;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if ((wheel.now & ((1ULL << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        cascade(level);
+    }
+
+    struct wheel_timer* head = &wheel.slots[0][wheel.now & (TIMER_WHEEL_SLOTS - 1)];
+    while (head->next != head) {
+        struct wheel_timer* timer = head->next;
+        list_del(timer);
+        timer->pending = false;
+        timer->callback(timer);
+    }
+}
+
+static void* wheel_thread_function(void* args) {
+    struct timespec next;
+
+    pin_current_thread(&affinity_config.flusher_cpus);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (true) {
+        next.tv_nsec += TIMER_WHEEL_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        /* absolute deadlines, a late wakeup does not make the wheel drift */
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+        pthread_mutex_lock(&wheel.mutex);
+        tick();
+        pthread_mutex_unlock(&wheel.mutex);
+    }
+    return NULL;
+}
+
+int timer_wheel_start(void) {
+    pthread_t thread_id;
+    pthread_attr_t attr;
+
+    memset(&wheel, 0, sizeof(wheel));
+    pthread_mutex_init(&wheel.mutex, NULL);
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel.slots[level][slot].next = wheel.slots[level][slot].prev = &wheel.slots[level][slot];
+        }
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret_val = pthread_create(&thread_id, &attr, wheel_thread_function, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret_val) {
+        syslog(LOG_ERR, "Could not spawn timer wheel thread, error: %s", strerror(ret_val));
+        return ret_val;
+    }
+    wheel_running = true;
+    return 0;
+}
+
+void wheel_timer_init(struct wheel_timer* timer, wheel_timer_callback callback) {
+    memset(timer, 0, sizeof(*timer));
+    timer->callback = callback;
+}
+
+/* (re)arms timer to fire delay_ms from now, rounded up to the next tick */
+void wheel_timer_schedule(struct wheel_timer* timer, unsigned int delay_ms) {
+    if (!wheel_running) {
+        return;
+    }
+    uint64_t ticks = (delay_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    pthread_mutex_lock(&wheel.mutex);
+    if (timer->pending) {
+        list_del(timer);
+    }
+    timer->expires = wheel.now + (ticks ? ticks : 1);
+    add_timer(timer);
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+/* once this returns the callback is guaranteed not to be running nor to run later */
+void wheel_timer_cancel(struct wheel_timer* timer) {
+    if (!wheel_running) {
+        return;
+    }
+    pthread_mutex_lock(&wheel.mutex);
+    if (timer->pending) {
+        list_del(timer);
+        timer->pending = false;
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+}
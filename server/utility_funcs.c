@@ -1,6 +1,13 @@
+#define _GNU_SOURCE
 #include "utility.h"
+#include "handoff.h"
+#include "replication.h"
+#include "probes.h"
+#include "capture.h"
+#include "phase_trace.h"
+#include "overload.h"
+#include "busy_poll.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
-#include <sys/ioctl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <syslog.h>
@@ -12,9 +19,64 @@
 
 
 
-#define TMP_BUF_SIZE 1024
-#define CHUNK_SIZE 512
-#define USE_AESD_CHAR_DEVICE 1
+/* both can be changed at runtime through the admin socket */
+size_t read_chunk_size = CHUNK_SIZE;
+size_t dump_buffer_size = TMP_BUF_SIZE;
+
+bool is_char_device(int filed) {
+    struct stat file_stat;
+    if (fstat(filed, &file_stat) < 0) {
+        syslog(LOG_WARNING, "Could not stat output file, assuming regular file, error: %s", strerror(errno));
+        return false;
+    }
+    return S_ISCHR(file_stat.st_mode);
+}
+
+/* returns true if buffer held a channel command, in which case the connection has been moved to the requested channel */
+static bool handle_channel_command(struct thread_information* thread_info, char* buffer, size_t buffer_size) {
+    if (strncmp(buffer, CHANNEL_COMMAND, strlen(CHANNEL_COMMAND)) != 0) {
+        return false;
+    }
+    char* name = buffer + strlen(CHANNEL_COMMAND);
+    /* drop the command terminator */
+    if (buffer_size && buffer[buffer_size - 1] == '\n') {
+        buffer[buffer_size - 1] = '\0';
+    }
+    struct channel* ch = channel_get_or_create(name);
+    if (ch == NULL) {
+        syslog(LOG_WARNING, "Connection from %s asked for invalid channel %s, staying on %s", thread_info->ip_address, name, thread_info->channel->name);
+    }
+    else {
+        syslog(LOG_DEBUG, "Connection from %s switched to channel %s", thread_info->ip_address, ch->name);
+        thread_info->channel = ch;
+    }
+    return true;
+}
+
+/* returns true if buffer held the framing command, the responses to come are framed */
+static bool handle_framed_command(struct thread_information* thread_info, char* buffer, size_t buffer_size) {
+    size_t length = strlen(FRAMED_COMMAND);
+    if (buffer_size != length + 1 || strncmp(buffer, FRAMED_COMMAND, length) != 0) {
+        return false;
+    }
+    syslog(LOG_DEBUG, "Connection from %s switched to framed responses", thread_info->ip_address);
+    thread_info->send_policy.framed = true;
+    return true;
+}
+
+/* passes the connection on to the server replacing us, the thread is done with it either way */
+static void hand_connection_over(struct thread_information* thread_info) {
+    if (thread_info->send_policy.framed) {
+        /* neither the framing nor the pipelined packets would make it over, framing clients reconnect */
+        syslog(LOG_NOTICE, "Closing framed connection from %s instead of handing it over", thread_info->ip_address);
+        return;
+    }
+    if (handoff_send_client(thread_info->socketd, thread_info->ip_address, thread_info->channel->name) == 0) {
+        syslog(LOG_NOTICE, "Handed connection from %s over to the new server", thread_info->ip_address);
+        close(thread_info->socketd);
+        thread_info->socketd = 0;
+    }
+}
 
 void* thread_run_function(void* args) {
     struct thread_information* thread_info = args;
@@ -26,10 +88,30 @@ void* thread_run_function(void* args) {
     char* second_token = NULL;
     struct aesd_seekto seek_cmd = { 0 };
 
+    cpu_tracker_init(&thread_info->cpu_tracker);
+    send_policy_init(&thread_info->send_policy, thread_info->socketd);
+    deadlines_init(&thread_info->deadlines, thread_info->socketd);
+    busy_poll_socket(thread_info->socketd);
+    packet_stage_init(&thread_info->stage);
+    thread_info->rate_limiter = rate_limiter_for_client(thread_info->ip_address);
+    AESD_PROBE3(connection__open, thread_info->connection_id, thread_info->socketd, thread_info->ip_address);
+    capture_record(CAPTURE_OPEN, thread_info->connection_id, NULL, 0, 0);
+    phase_trace_thread_start(thread_info->connection_id);
     while (true) {
         buffer = NULL;
         buffer_size = 0;
-        int ret_val = read_str_from_socket(thread_info->socketd, &buffer, &buffer_size);
+        phase_trace_begin();
+        /* between packets is the only safe point to move the connection to another server */
+        if (__atomic_load_n(&thread_info->handoff_requested, __ATOMIC_ACQUIRE)) {
+            hand_connection_over(thread_info);
+            break;
+        }
+        int ret_val = read_str_from_socket(thread_info->socketd, &buffer, &buffer_size, &thread_info->deadlines, &thread_info->stage,
+                                           thread_info->send_policy.framed ? &thread_info->carry : NULL);
+        if (ret_val == EINTR) {
+            /* interrupted before the first byte of a packet, loop back to check for a handoff */
+            continue;
+        }
         if (ret_val) {
             /* something wen't wrong while reading from the socket but the memory allocated is already freed */
             /* so we can simply end thread execution here */
@@ -40,11 +122,76 @@ void* thread_run_function(void* args) {
             thread_info->thread_return_value = EXIT_FAILURE;
             break;
         }
+        thread_info->packets++;
+        phase_trace_mark(PHASE_READ_DONE);
+        cpu_tracker_sample(&thread_info->cpu_tracker);
+
+        /* commands are short, a packet too large to be kept in memory is always data */
+        size_t packet_size = thread_info->stage.length + buffer_size;
+        bool staged = thread_info->stage.length > 0;
+        AESD_PROBE3(packet__received, thread_info->connection_id, packet_size, staged);
+        /* the head of a staged packet is on disk, the trace only keeps its size */
+        capture_record(CAPTURE_PACKET, thread_info->connection_id, buffer, staged ? 0 : buffer_size, packet_size);
+
+        /* these only concern this connection, there is nothing to write nor dump */
+        if (!staged && (handle_channel_command(thread_info, buffer, buffer_size) || handle_framed_command(thread_info, buffer, buffer_size))) {
+            phase_trace_mark(PHASE_PARSED);
+            phase_trace_end(buffer_size);
+            free(buffer);
+            buffer = NULL;
+            /* framed clients count on a response to every packet */
+            if (send_policy_frame(&thread_info->send_policy, thread_info->socketd, 0)) {
+                thread_info->thread_return_value = EXIT_FAILURE;
+                break;
+            }
+            continue;
+        }
+        phase_trace_mark(PHASE_PARSED);
+
+        /* hold the packet back until both this client and the channel are within their budget */
+        struct channel* channel = thread_info->channel;
+        rate_limit_wait(thread_info->rate_limiter, &channel->limiter, packet_size);
+        phase_trace_mark(PHASE_ADMITTED);
+        /* a sharded channel is appended to one shard at a time, each with its own lock */
+        channel = shard_pick(channel, thread_info->connection_id, buffer, buffer_size);
+
+        /* under overload the packet is turned away before it adds to the queue for the lock */
+        if (!overload_admit()) {
+            AESD_PROBE2(packet__shed, thread_info->connection_id, packet_size);
+            free(buffer);
+            buffer = NULL;
+            packet_stage_reset(&thread_info->stage);
+            phase_trace_end(packet_size);
+            if (send_busy_reply(thread_info->socketd, &thread_info->send_policy)) {
+                thread_info->thread_return_value = EXIT_FAILURE;
+                break;
+            }
+            continue;
+        }
+
+        uint64_t dump_from = 0;
+        /* a seek out of range is answered with nothing rather than the whole channel */
+        bool out_of_range = false;
+        /* replicas only take writes from their primary, clients are told their packet was not stored */
+        bool read_only = false;
+        bool seeking = !staged && strstr(buffer, SEEK_COMMAND) != NULL;
+        bool filtering = !staged && is_filter_command(buffer, buffer_size);
+        /* plain data is left with the combiner before queuing, whoever gets the lock first may append it */
+        bool combined = !staged && !seeking && !filtering && !replication_is_replica() && channel_can_combine(channel);
+        if (combined) {
+            combiner_publish(&channel->combiner, &thread_info->combine_slot, buffer, buffer_size);
+        }
 
-        /* so now that we got all the string into the buffer, dump it to the file, after getting hold of the mutex */
-        ret_val = pthread_mutex_lock(thread_info->mutex_ptr);
+        /* so now that we got all the string into the buffer, dump it to the file, after getting hold of the channel mutex */
+        AESD_PROBE3(lock__requested, thread_info->connection_id, channel->name, packet_size);
+        uint64_t queue_entered_ns = overload_queue_enter();
+        ret_val = channel_lock(channel, thread_info->ip_address, packet_size);
+        overload_queue_leave(queue_entered_ns);
         if (ret_val) {
-            syslog(LOG_ERR, "Something bad happened when locking the mutex within thread ID %ld, error %s", pthread_self(), strerror(errno));
+            syslog(LOG_ERR, "Something bad happened when locking the mutex within thread ID %ld, error %s", pthread_self(), strerror(ret_val));
+            if (combined) {
+                combiner_withdraw(&channel->combiner, &thread_info->combine_slot);
+            }
             if (buffer != NULL) {
                 free(buffer);
                 buffer = NULL;
@@ -52,25 +199,30 @@ void* thread_run_function(void* args) {
             thread_info->thread_return_value = EXIT_FAILURE;
             break;
         }
-        filed = open(thread_info->file_name, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+        AESD_PROBE2(lock__acquired, thread_info->connection_id, channel->name);
+        phase_trace_mark(PHASE_LOCKED);
+        filed = open(channel->file_name, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
         if (filed < 0) {
-            syslog(LOG_ERR, "Could not open/create output file at %s, error: %s", thread_info->file_name, strerror(errno));
+            syslog(LOG_ERR, "Could not open/create output file at %s, error: %s", channel->file_name, strerror(errno));
+            if (combined) {
+                combiner_withdraw(&channel->combiner, &thread_info->combine_slot);
+            }
             if (buffer != NULL) {
                 free(buffer);
             }
             thread_info->thread_return_value = EXIT_FAILURE;
-            pthread_mutex_unlock(thread_info->mutex_ptr);
+            channel_unlock(channel);
             break;
         }
 
         /* Now let's check received buffer of seek command */
-        if (strstr(buffer, "AESDCHAR_IOCSEEKTO:") != NULL) {
+        if (seeking) {
             syslog(LOG_DEBUG, "Received IOCTL command in server... %s", buffer);
             /* 1. Let's null terminate the temporary_command_buffer */
             buffer[buffer_size] = '\0';
             syslog(LOG_DEBUG, "After terminating the string %s", buffer);
             /* Let's get a pointer to values section of the string */
-            first_token = buffer + strlen("AESDCHAR_IOCSEEKTO:");   // we want our string to parse to be only comma separated values
+            first_token = buffer + strlen(SEEK_COMMAND);   // we want our string to parse to be only comma separated values
             /* Let's get the values split by the comma */
             seek_cmd.write_cmd = (int)strtol(first_token, &second_token, 10);
             /* check for successful conversion */
@@ -79,47 +231,97 @@ void* thread_run_function(void* args) {
                 second_token++;
                 seek_cmd.write_cmd_offset = (int)strtol(second_token, &first_token, 10);
                 syslog(LOG_DEBUG, "Extracted ioctl seek command parameters extracted: %d, %d", seek_cmd.write_cmd, seek_cmd.write_cmd_offset);
+                AESD_PROBE3(seek__parsed, thread_info->connection_id, seek_cmd.write_cmd, seek_cmd.write_cmd_offset);
                 /* check for successful conversion again */
-                if (ioctl(filed, AESDCHAR_IOCSEEKTO, &seek_cmd)) {
-                    syslog(LOG_ERR, "Error with ioctl...\n");
+                ret_val = channel_seek(channel, filed, &seek_cmd, &dump_from);
+                if (ret_val == EINVAL) {
+                    syslog(LOG_NOTICE, "Seek to %d,%d out of range from %s", seek_cmd.write_cmd, seek_cmd.write_cmd_offset, thread_info->ip_address);
+                    out_of_range = true;
+                }
+                else if (ret_val) {
+                    syslog(LOG_ERR, "Error with ioctl... %s", strerror(ret_val));
+                    close(filed);
                     if (buffer != NULL) {
                         free(buffer);
                     }
                     thread_info->thread_return_value = EXIT_FAILURE;
-                    pthread_mutex_unlock(thread_info->mutex_ptr);
+                    channel_unlock(channel);
                     break;
                 }
             }
+        } else if (filtering) {
+            /* searched instead of dumped below, nothing is written */
+        } else if (replication_is_replica()) {
+            read_only = true;
         } else {
-            ret_val = dump_buffer_to_file(buffer, buffer_size, filed);
+            if (combined) {
+                ret_val = channel_append_combined(channel, filed, &thread_info->combine_slot);
+            }
+            else if (staged) {
+                ret_val = channel_append_staged(channel, filed, &thread_info->stage, buffer, buffer_size);
+            }
+            else {
+                ret_val = channel_append(channel, filed, buffer, buffer_size);
+            }
             if (ret_val) {
                 if (buffer != NULL) {
                     free(buffer);
                     buffer = NULL;
                 }
                 thread_info->thread_return_value = EXIT_FAILURE;
-                pthread_mutex_unlock(thread_info->mutex_ptr);
+                channel_unlock(channel);
                 break;
             }
+            phase_trace_mark(PHASE_WRITTEN);
             /* let's flush and make sure contents of file are there before releasing lock */
-#ifndef USE_AESD_CHAR_DEVICE
-            if (fsync(filed) < 0) {
+            if (!combined && __atomic_load_n(&durable_appends, __ATOMIC_RELAXED) && !is_char_device(filed) && fsync(filed) < 0) {
                 syslog(LOG_ERR, "Failed to sync output file from thread ID %ld, error: %s", pthread_self(), strerror(errno));
                 if (buffer != NULL) {
                     free(buffer);
                     buffer = NULL;
                 }
                 thread_info->thread_return_value = EXIT_FAILURE;
-                pthread_mutex_unlock(thread_info->mutex_ptr);
+                channel_unlock(channel);
                 break;
             }
-#endif
+            AESD_PROBE2(write__done, thread_info->connection_id, packet_size);
+            phase_trace_mark(PHASE_SYNCED);
         }
         /* now dump complete file contents to remote party */
-        ret_val = dump_file_to_socket(filed, thread_info->socketd);
+        unsigned long bytes_before_dump = thread_info->send_policy.bytes;
+        AESD_PROBE2(dump__start, thread_info->connection_id, channel->name);
+        if (out_of_range) {
+            ret_val = send_empty_reply(thread_info->socketd, &thread_info->send_policy);
+        }
+        else if (read_only) {
+            ret_val = send_read_only_reply(thread_info->socketd, &thread_info->send_policy);
+        }
+        else if (filtering) {
+            struct filter filter;
+            ret_val = filter_init(&filter, buffer, buffer_size);
+            if (ret_val) {
+                syslog(LOG_ERR, "Malformed filter command from %s", thread_info->ip_address);
+                ret_val = send_empty_reply(thread_info->socketd, &thread_info->send_policy);
+            }
+            else if ((ret_val = channel_filter(channel, filed, &filter)) == 0) {
+                AESD_PROBE3(filter__done, thread_info->connection_id, filter.records, filter.matches);
+                ret_val = filter_send(&filter, thread_info->socketd, &thread_info->send_policy);
+            }
+            filter_free(&filter);
+        }
+        else {
+            ret_val = channel_dump(channel, filed, thread_info->socketd, &thread_info->send_policy, dump_from);
+        }
+        AESD_PROBE2(dump__done, thread_info->connection_id, thread_info->send_policy.bytes - bytes_before_dump);
+        phase_trace_mark(PHASE_DUMPED);
         if (ret_val) {
+            close(filed);
+            if (buffer != NULL) {
+                free(buffer);
+                buffer = NULL;
+            }
             thread_info->thread_return_value = EXIT_FAILURE;
-            pthread_mutex_unlock(thread_info->mutex_ptr);
+            channel_unlock(channel);
             break;
         }
         /* let's close and make sure contents of file are there before releasing lock */
@@ -130,21 +332,16 @@ void* thread_run_function(void* args) {
                 buffer = NULL;
             }
             thread_info->thread_return_value = EXIT_FAILURE;
-            pthread_mutex_unlock(thread_info->mutex_ptr);
+            channel_unlock(channel);
             break;
         }
 
         /* release mutex, we're done writing to the file from this thread */
-        ret_val = pthread_mutex_unlock(thread_info->mutex_ptr);
-        if (ret_val) {
-            syslog(LOG_ERR, "Something bad happening while unlocking the mutex from thread ID %ld, error: %s", pthread_self(), strerror(errno));
-            if (buffer != NULL) {
-                free(buffer);
-                buffer = NULL;
-            }
-            thread_info->thread_return_value = EXIT_FAILURE;
-            break;
-        }
+        channel_unlock(channel);
+        AESD_PROBE2(lock__released, thread_info->connection_id, channel->name);
+        phase_trace_mark(PHASE_UNLOCKED);
+        phase_trace_end(packet_size);
+        packet_stage_reset(&thread_info->stage);
 
         if (buffer != NULL) {
             free(buffer);
@@ -152,58 +349,179 @@ void* thread_run_function(void* args) {
         }
     }
 
+    packet_stage_close(&thread_info->stage);
+    free(thread_info->carry.data);
+    zerocopy_close(&thread_info->send_policy.zerocopy, thread_info->socketd);
+    phase_trace_thread_end();
+    AESD_PROBE3(connection__close, thread_info->connection_id, thread_info->packets, thread_info->send_policy.bytes);
+    capture_record(CAPTURE_CLOSE, thread_info->connection_id, NULL, 0, 0);
+    deadlines_cancel(&thread_info->deadlines);
+    syslog(LOG_INFO, "Connection from %s done after %lu packets, %lu cross-core migrations", thread_info->ip_address, thread_info->packets, thread_info->cpu_tracker.migrations);
+    struct send_policy* policy = &thread_info->send_policy;
+    if (policy->responses) {
+        syslog(LOG_INFO, "Connection from %s got %lu responses, %lu bytes in %lu segments, %.2f segments per response (%s)",
+               thread_info->ip_address, policy->responses, policy->bytes, policy->segments,
+               (double)policy->segments / policy->responses, send_policy_enabled ? "adaptive" : "plain");
+    }
+    /* last touch of thread_info, the acceptor may join the thread and free it from here on */
+    __atomic_store_n(&thread_info->finished, true, __ATOMIC_RELEASE);
 
     /* thread_info->thread_return_value = EXIT_SUCCESS; */
     /* pthread_exit(&thread_info->thread_return_value); */ /* No more use of pthread_exit since the Yocto image is missing one library and the process will crash when calling this */
     return NULL;
 }
 
-int read_str_from_socket(int socketd, char** buf_ptr, size_t* buf_size) {
+/**
+ * Reads one packet. The buffer grows up to ingest_memory_cap, past that its contents are moved to
+ * the connection staging area and the buffer is reused, so when stage->length is not 0 on return
+ * the packet is the staged data followed by what's left in the buffer.
+ * Without a carry a packet is whatever was read once the last read ends with '\n'. With one (framed
+ * connections) it ends at the first '\n', and the bytes after it are kept in the carry for the
+ * next call.
+ */
+int read_str_from_socket(int socketd, char** buf_ptr, size_t* buf_size, struct connection_deadlines* deadlines, struct packet_stage* stage, struct packet_carry* carry) {
     *buf_ptr = NULL;
     char* tmp_ptr = NULL;
-    size_t chunk_size = CHUNK_SIZE;
+    size_t chunk_size = __atomic_load_n(&read_chunk_size, __ATOMIC_RELAXED);
+    size_t memory_cap = __atomic_load_n(&ingest_memory_cap, __ATOMIC_RELAXED);
+    size_t memory_limit = memory_cap > chunk_size ? memory_cap : chunk_size;
     size_t allocated_space = 0;
     size_t total_read = 0;
+    char* packet_end = NULL;
+    /* the last of a large packet went straight from the socket to the stage */
+    bool spliced_end = false;
+
+    if (carry != NULL && carry->size) {
+        /* the next packet already started in the last read, maybe it's even complete */
+        phase_trace_mark(PHASE_READ_START);
+        *buf_ptr = carry->data;
+        total_read = carry->size;
+        allocated_space = carry->size + 1;
+        carry->data = NULL;
+        carry->size = 0;
+        packet_end = memchr(*buf_ptr, '\n', total_read);
+    }
 
-    do {
+    while (packet_end == NULL && !spliced_end) {
         /* allocate memory / resize current allocation (if needed) */
         if ((allocated_space - total_read) < (chunk_size >> 2)) {
-            tmp_ptr = realloc(*buf_ptr, allocated_space + chunk_size);
-            if (tmp_ptr == NULL) {
-                syslog(LOG_ERR, "Failed to allocate/resize read buffer, error: %s", strerror(errno));
-                if (*buf_ptr != NULL) {
+            if (memory_cap && allocated_space >= memory_limit) {
+                /* at the cap, set what we have aside and start over with the same buffer */
+                int ret_val = packet_stage_write(stage, *buf_ptr, total_read);
+                if (ret_val) {
                     free(*buf_ptr);
                     *buf_ptr = NULL;
+                    packet_stage_reset(stage);
+                    return ret_val;
                 }
-                return errno;
+                total_read = 0;
+            }
+            else {
+                /* grow geometrically, large packets would otherwise cost a realloc every chunk */
+                size_t new_size = allocated_space ? allocated_space * 2 : chunk_size;
+                if (memory_cap && new_size > memory_limit) {
+                    new_size = memory_limit;
+                }
+                tmp_ptr = realloc(*buf_ptr, new_size);
+                if (tmp_ptr == NULL) {
+                    syslog(LOG_ERR, "Failed to allocate/resize read buffer, error: %s", strerror(errno));
+                    if (*buf_ptr != NULL) {
+                        free(*buf_ptr);
+                        *buf_ptr = NULL;
+                    }
+                    packet_stage_reset(stage);
+                    return errno;
+                }
+                *buf_ptr = tmp_ptr;
+                allocated_space = new_size;
             }
-            *buf_ptr = tmp_ptr;
-            allocated_space += chunk_size;
         }
         
         /* now that we made sure that we have enough memory, read up to chunk size into the buffer */
-        int read_bytes = read(socketd, *buf_ptr + total_read, allocated_space - total_read);
+        /* keep one byte spare so the packet can always be null terminated */
+        deadlines_wait_for_bytes(deadlines, total_read > 0);
+        /* once the buffer went to the stage, the rest of the packet doesn't need to go through it */
+        bool splicing = total_read == 0 && packet_stage_can_splice(stage);
+        ssize_t read_bytes = splicing ? packet_stage_splice(stage, socketd, carry != NULL, &spliced_end)
+                                      : busy_poll_read(socketd, *buf_ptr + total_read, allocated_space - total_read - 1);
+        if (read_bytes < 0 && splicing && errno == EOPNOTSUPP) {
+            continue;
+        }
         if (read_bytes < 0) {
-            syslog(LOG_ERR, "Error while reading from the socket, error: %s", strerror(errno));
+            if (errno == EINTR && (total_read || stage->length)) {
+                /* a packet that already started must be completed first */
+                continue;
+            }
+            int err = errno;
+            deadlines_expired(deadlines);
+            if (err != EINTR) {
+                syslog(LOG_ERR, "Error while reading from the socket, error: %s", strerror(err));
+            }
             if (*buf_ptr != NULL) {
                 free(*buf_ptr);
                 *buf_ptr = NULL;
             }
-            return errno;
+            packet_stage_reset(stage);
+            return err;
         }
         else if (read_bytes == 0) {
-            syslog(LOG_NOTICE, "Looks like remote end close the connection, error: %s", strerror(errno));
+            if (deadlines_expired(deadlines)) {
+                syslog(LOG_NOTICE, "Connection timed out with %zu bytes of a packet pending, closing it", stage->length + total_read);
+            }
+            else {
+                syslog(LOG_NOTICE, "Looks like remote end close the connection, error: %s", strerror(errno));
+            }
             if (*buf_ptr != NULL) {
                 free(*buf_ptr);
                 *buf_ptr = NULL;
             }
+            packet_stage_reset(stage);
             return -1;
         }
+        if (splicing) {
+            continue;
+        }
+        if (total_read == 0 && stage->length == 0) {
+            phase_trace_mark(PHASE_READ_START);
+        }
+        if (carry != NULL) {
+            packet_end = memchr(*buf_ptr + total_read, '\n', read_bytes);
+        }
+        else if ((*buf_ptr)[total_read + read_bytes - 1] == '\n') {
+            packet_end = *buf_ptr + total_read + read_bytes - 1;
+        }
         total_read += read_bytes;
-    } while ((*buf_ptr)[total_read - 1] != '\n');
-    
+    }
+
+    size_t rest = packet_end != NULL ? total_read - (packet_end + 1 - *buf_ptr) : 0;
+    if (spliced_end && stage->overrun != NULL) {
+        /* the last splice went past the delimiter, the packets after this one start there */
+        carry->data = stage->overrun;
+        carry->size = stage->overrun_size;
+        stage->overrun = NULL;
+        stage->overrun_size = 0;
+    }
+    else if (rest) {
+        /* only ever with a carry, the packets after this one wait for the next call */
+        carry->data = malloc(rest + 1);
+        if (carry->data == NULL) {
+            syslog(LOG_ERR, "Failed to keep the pipelined packets, error: %s", strerror(errno));
+            free(*buf_ptr);
+            *buf_ptr = NULL;
+            packet_stage_reset(stage);
+            return ENOMEM;
+        }
+        memcpy(carry->data, packet_end + 1, rest);
+        carry->size = rest;
+        total_read -= rest;
+    }
+    deadlines_packet_done(deadlines);
+    if (stage->length) {
+        syslog(LOG_DEBUG, "Staged %zu bytes of a %zu bytes packet", stage->length, stage->length + total_read);
+    }
     /* here we pass back the size of the effetive data, instead of the allocated size... does not really matter */
     /* but like this we're not restricted to string data delimited with '\n' */
+    (*buf_ptr)[total_read] = '\0';
     *buf_size = total_read;
     return 0;
 }
@@ -211,17 +529,18 @@ int read_str_from_socket(int socketd, char** buf_ptr, size_t* buf_size) {
 int dump_buffer_to_file(char* buf_ptr, size_t buf_size, int filed) {
     size_t bytes_left_to_write = buf_size;
     size_t bytes_wrote_overall = 0;
-    size_t bytes_wrote = 0;
+    ssize_t bytes_wrote = 0;
 
     /* let's move pointer to the very end of the file */
-#ifndef USE_AESD_CHAR_DEVICE
-    if (lseek(filed, 0, SEEK_END) < 0) {
+    if (!is_char_device(filed) && lseek(filed, 0, SEEK_END) < 0) {
         syslog(LOG_ERR, "Could not move file pointer to the end of the file, error: %s", strerror(errno));
         return errno;
     }
-#endif
 
-    while ((bytes_wrote = write(filed, buf_ptr + bytes_wrote_overall, bytes_left_to_write)) < bytes_left_to_write) {
+    while ((bytes_wrote = write(filed, buf_ptr + bytes_wrote_overall, bytes_left_to_write)) < (ssize_t)bytes_left_to_write) {
+        if (bytes_wrote < 0 && errno == EINTR) {
+            continue;
+        }
         if (bytes_wrote <= 0) {
             syslog(LOG_ERR, "Failure to write to output file, error: %s", strerror(errno));
             return errno;
@@ -234,52 +553,152 @@ int dump_buffer_to_file(char* buf_ptr, size_t buf_size, int filed) {
     return 0;
 }
 
-int dump_file_to_socket(int filed, int socketd) {
-    /* make a backup of the current file pointer */
-#ifndef USE_AESD_CHAR_DEVICE
-    off_t current_file_offset = lseek(filed, 0, SEEK_CUR);
-    if (current_file_offset < 0) {
-        syslog(LOG_ERR, "Could not retrieve the current file offset, error: %s", strerror(errno));
-        return errno;
+/**
+ * Sends a chunk of the response being built, response_size counts what was sent of it so far.
+ * Only a zero copy ring buffer (zc_buffer) goes out with MSG_ZEROCOPY, the kernel keeps reading
+ * it after the send returns; anything else is copied, so its memory can be reused right away.
+ */
+static int send_chunk(int socketd, struct send_policy* policy, const char* buf, size_t size, size_t* response_size,
+                      struct zerocopy_buffer* zc_buffer) {
+    if (size == 0) {
+        return 0;
     }
-    /* move it to the beginning of the file, since we dump full contents */
-    if (lseek(filed, 0, SEEK_SET) < 0) {
-        syslog(LOG_ERR, "Failed to move file pointer to the beginning of the file, error: %s", strerror(errno));
-        return errno;
+    if (*response_size) {
+        /* second chunk, this response spans several writes */
+        send_policy_more_coming(policy, socketd);
     }
-    syslog(LOG_NOTICE, "Moved file pointer to beginning of file");
-#endif
-    /* now start reading the file and sending to socket */
-    char buf[TMP_BUF_SIZE] = {0};
-    int bytes_read = 0;
-    while ((bytes_read = read(filed, buf, TMP_BUF_SIZE)) > 0) {
-        size_t current_chunk_size = bytes_read;
-        size_t write_ptr = 0;
-        while (current_chunk_size > 0) {
-            int bytes_wrote = write(socketd, buf + write_ptr, current_chunk_size);
-            if (bytes_wrote < 0) {
-                syslog(LOG_ERR, "Failed to write a chunk of information to socket, error: %s", strerror(errno));
-                /* restore original file pointer, if possible */
-#ifndef USE_AESD_CHAR_DEVICE
-                if (lseek(filed, current_file_offset, SEEK_SET) < 0) {
-                    syslog(LOG_WARNING, "Could not restore the output file pointer to its original value, error: %s", strerror(errno));
-                }
-#endif
-                return errno;
-            }
-            write_ptr += bytes_wrote;
-            current_chunk_size -= bytes_wrote;
+    int ret_val = send_policy_frame(policy, socketd, size);
+    if (ret_val) {
+        return ret_val;
+    }
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t bytes_wrote;
+        if (zc_buffer != NULL) {
+            bytes_wrote = zerocopy_send(&policy->zerocopy, socketd, buf + sent, size - sent);
+        }
+        else {
+            uint64_t started_ns = phase_trace_clock();
+            bytes_wrote = write(socketd, buf + sent, size - sent);
+            phase_trace_add_send(started_ns);
+        }
+        if (bytes_wrote < 0 && errno == EINTR) {
+            continue;
         }
+        if (bytes_wrote < 0) {
+            syslog(LOG_ERR, "Failed to write a chunk of information to socket, error: %s", strerror(errno));
+            return errno;
+        }
+        sent += bytes_wrote;
     }
-    if (bytes_read < 0) {
-        syslog(LOG_ERR, "Error reading from the source file, error: %s", strerror(errno));
-        return errno;
+    if (zc_buffer != NULL) {
+        zerocopy_buffer_sent(&policy->zerocopy, zc_buffer);
     }
-#ifndef USE_AESD_CHAR_DEVICE
+    *response_size += size;
+    return 0;
+}
+
+/* sends a chunk of the response being built as a plain copy, buf is free to reuse once it returns */
+int send_response_chunk(int socketd, struct send_policy* policy, const char* buf, size_t size, size_t* response_size) {
+    return send_chunk(socketd, policy, buf, size, response_size, NULL);
+}
+
+/* sends filed from its current position on, up to limit bytes, as part of the response being built */
+int send_file_contents(int filed, int socketd, struct send_policy* policy, uint64_t limit, size_t* response_size) {
+    char stack_buf[DUMP_BUFFER_MAX];
+    size_t stack_buf_size = __atomic_load_n(&dump_buffer_size, __ATOMIC_RELAXED);
+    while (limit) {
+        /* with zero copy on, read into a buffer that stays pinned until the kernel is done with it */
+        struct zerocopy_buffer* zc_buffer = zerocopy_next_buffer(&policy->zerocopy, socketd);
+        char* buf = zc_buffer != NULL ? zc_buffer->data : stack_buf;
+        size_t to_read = zc_buffer != NULL ? ZEROCOPY_BUFFER_SIZE : stack_buf_size;
+        if (to_read > limit) {
+            to_read = limit;
+        }
+        ssize_t bytes_read = read(filed, buf, to_read);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            syslog(LOG_ERR, "Error reading from the source file, error: %s", strerror(errno));
+            return errno;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        int ret_val = send_chunk(socketd, policy, buf, bytes_read, response_size, zc_buffer);
+        if (ret_val) {
+            return ret_val;
+        }
+        limit -= bytes_read;
+    }
+    return 0;
+}
+
+static int send_fixed_reply(int socketd, struct send_policy* policy, const char* reply) {
+    size_t response_size = 0;
+    send_policy_begin(policy, socketd);
+    int ret_val = send_response_chunk(socketd, policy, reply, strlen(reply), &response_size);
+    if (ret_val) {
+        return ret_val;
+    }
+    return send_response_end(socketd, policy, response_size);
+}
+
+/* what a shed packet gets instead of the dump, see overload.h */
+int send_busy_reply(int socketd, struct send_policy* policy) {
+    return send_fixed_reply(socketd, policy, OVERLOAD_BUSY_REPLY);
+}
+
+/* what a replica answers a packet with instead of the dump, it only takes writes from its primary */
+int send_read_only_reply(int socketd, struct send_policy* policy) {
+    return send_fixed_reply(socketd, policy, READ_ONLY_REPLY);
+}
+
+/* what a command the server can't make sense of gets, the connection stays usable */
+int send_empty_reply(int socketd, struct send_policy* policy) {
+    send_policy_begin(policy, socketd);
+    return send_response_end(socketd, policy, 0);
+}
+
+/* ends the response being built, see send_response_chunk() */
+int send_response_end(int socketd, struct send_policy* policy, size_t response_size) {
+    int ret_val = send_policy_frame(policy, socketd, 0);
+    if (ret_val) {
+        return ret_val;
+    }
+    send_policy_end(policy, socketd, response_size);
+    return 0;
+}
+
+int dump_file_to_socket(int filed, int socketd, struct send_policy* policy, uint64_t from) {
+    /* the char device keeps its own read position (seek commands rely on it), regular files are dumped from the offset a seek asked for */
+    bool regular_file = !is_char_device(filed);
+    off_t current_file_offset = 0;
+    if (regular_file) {
+        /* make a backup of the current file pointer */
+        current_file_offset = lseek(filed, 0, SEEK_CUR);
+        if (current_file_offset < 0) {
+            syslog(LOG_ERR, "Could not retrieve the current file offset, error: %s", strerror(errno));
+            return errno;
+        }
+        /* move it to where the dump starts, the beginning of the file unless a seek said otherwise */
+        if (lseek(filed, from, SEEK_SET) < 0) {
+            syslog(LOG_ERR, "Failed to move file pointer to the beginning of the file, error: %s", strerror(errno));
+            return errno;
+        }
+        syslog(LOG_DEBUG, "Moved file pointer to offset %llu", (unsigned long long)from);
+    }
+    /* now start reading the file and sending to socket */
+    size_t response_size = 0;
+    send_policy_begin(policy, socketd);
+    int ret_val = send_file_contents(filed, socketd, policy, UINT64_MAX, &response_size);
     /* restore original file pointer, if possible */
-    if (lseek(filed, current_file_offset, SEEK_SET) < 0) {
+    if (regular_file && lseek(filed, current_file_offset, SEEK_SET) < 0) {
         syslog(LOG_WARNING, "Could not restore the output file pointer to its original value, error: %s", strerror(errno));
     }
-#endif
-    return 0;
+    if (ret_val) {
+        return ret_val;
+    }
+    return send_response_end(socketd, policy, response_size);
 }
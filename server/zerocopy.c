@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include "zerocopy.h"
+#include "phase_trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+size_t zerocopy_threshold = 0;
+
+/* send ids wrap around, compare them the way TCP compares sequence numbers */
+static bool send_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+/* reads whatever completions are queued, the error queue never blocks */
+static int drain_completions(struct zerocopy* zc, int socketd) {
+    while (true) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(socketd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : errno;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* sends ee_info to ee_data, both included, are done with their pages */
+            if (!send_before(serr->ee_data, zc->completed)) {
+                zc->completed = serr->ee_data + 1;
+            }
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied += serr->ee_data - serr->ee_info + 1;
+                if (zc->enabled) {
+                    /* the route can't send from our pages, pinning them only costs */
+                    syslog(LOG_DEBUG, "Zero copy sends are being copied by the kernel, back to plain sends");
+                    zc->enabled = false;
+                }
+            }
+        }
+    }
+}
+
+/* waits until every send before target has completed */
+static int wait_for_completion(struct zerocopy* zc, int socketd, uint32_t target, int timeout_ms) {
+    while (true) {
+        int ret_val = drain_completions(zc, socketd);
+        if (ret_val) {
+            return ret_val;
+        }
+        if (!send_before(zc->completed, target)) {
+            return 0;
+        }
+        /* no events asked for, an error queue with something in it shows up as POLLERR */
+        struct pollfd pfd = { .fd = socketd, .events = 0 };
+        ret_val = poll(&pfd, 1, timeout_ms);
+        if (ret_val < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret_val < 0) {
+            return errno;
+        }
+        if (ret_val == 0) {
+            return ETIMEDOUT;
+        }
+        if (!(pfd.revents & POLLERR)) {
+            return EPIPE;
+        }
+    }
+}
+
+void zerocopy_init(struct zerocopy* zc, int socketd) {
+    memset(zc, 0, sizeof(*zc));
+    if (!zerocopy_threshold) {
+        return;
+    }
+    int opt_val = 1;
+    if (setsockopt(socketd, SOL_SOCKET, SO_ZEROCOPY, &opt_val, sizeof(opt_val)) < 0) {
+        syslog(LOG_WARNING, "Could not enable zero copy sends on connection, error: %s", strerror(errno));
+        return;
+    }
+    zc->enabled = true;
+}
+
+/* write() for a response chunk, without the copy into the socket buffer when it's large enough */
+ssize_t zerocopy_send(struct zerocopy* zc, int socketd, const void* buf, size_t size) {
+    uint64_t started_ns = phase_trace_clock();
+    if (!zc->enabled || size < zerocopy_threshold) {
+        ssize_t written = write(socketd, buf, size);
+        phase_trace_add_send(started_ns);
+        return written;
+    }
+    ssize_t sent = send(socketd, buf, size, MSG_ZEROCOPY);
+    phase_trace_add_send(started_ns);
+    if (sent < 0 && errno == ENOBUFS) {
+        /* too many completions outstanding for the socket option memory, copy this one */
+        drain_completions(zc, socketd);
+        return write(socketd, buf, size);
+    }
+    if (sent > 0) {
+        zc->sends++;
+        zc->bytes += sent;
+        /* keep the error queue short, it is charged to the socket */
+        drain_completions(zc, socketd);
+    }
+    return sent;
+}
+
+/**
+ * Next buffer to read a response chunk into, waiting for the kernel to let go of it if it is
+ * still being sent from. NULL when zero copy is off or the buffer can't be had, the caller
+ * then reads into its own memory and sends a plain copy.
+ */
+struct zerocopy_buffer* zerocopy_next_buffer(struct zerocopy* zc, int socketd) {
+    if (!zc->enabled) {
+        return NULL;
+    }
+    struct zerocopy_buffer* buffer = &zc->buffers[zc->next_buffer];
+    if (buffer->data == NULL) {
+        buffer->data = malloc(ZEROCOPY_BUFFER_SIZE);
+        if (buffer->data == NULL) {
+            return NULL;
+        }
+    }
+    if (buffer->in_flight && send_before(zc->completed, buffer->last_send + 1)) {
+        int ret_val = wait_for_completion(zc, socketd, buffer->last_send + 1, ZEROCOPY_WAIT_TIMEOUT_MS);
+        if (ret_val) {
+            syslog(LOG_WARNING, "Zero copy buffer still in flight, error: %s", strerror(ret_val));
+            return NULL;
+        }
+    }
+    buffer->in_flight = false;
+    zc->next_buffer = (zc->next_buffer + 1) % ZEROCOPY_BUFFERS;
+    return buffer;
+}
+
+/* called after every send from the buffer, it stays pinned until the latest send completes */
+void zerocopy_buffer_sent(struct zerocopy* zc, struct zerocopy_buffer* buffer) {
+    if (zc->sends) {
+        buffer->last_send = zc->sends - 1;
+        buffer->in_flight = true;
+    }
+}
+
+void zerocopy_close(struct zerocopy* zc, int socketd) {
+    if (zc->sends) {
+        syslog(LOG_INFO, "Connection sent %lu bytes in %u zero copy sends, %lu of them copied by the kernel anyway",
+               zc->bytes, zc->sends, zc->copied);
+    }
+    if (zc->completed != zc->sends) {
+        int ret_val = wait_for_completion(zc, socketd, zc->sends, ZEROCOPY_WAIT_TIMEOUT_MS);
+        if (ret_val) {
+            /* the kernel may still read from them, a leak is better than sending garbage */
+            syslog(LOG_WARNING, "Leaving the zero copy buffers of a connection behind, %u sends never completed, error: %s",
+                   zc->sends - zc->completed, strerror(ret_val));
+            return;
+        }
+    }
+    for (int i = 0; i < ZEROCOPY_BUFFERS; i++) {
+        free(zc->buffers[i].data);
+        zc->buffers[i].data = NULL;
+    }
+}